@@ -0,0 +1,102 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _ARM64_BINARY_HPP_
+#define _ARM64_BINARY_HPP_
+
+#include "Filter.hpp"
+
+// AArch64 branch filter, BL / B word offsets and ADRP page offsets are replaced by absolute targets so that
+// calls to the same function look the same everywhere. Instructions are the 4 byte aligned words of the stream,
+// only the immediate bits change so the reverse filter finds the same instructions.
+class ARM64Filter : public ByteStreamFilter<16 * KB, 16 * KB> {
+public:
+	ARM64Filter(Stream* stream) : ByteStreamFilter(stream), offset_(0), transform_count_(0) {
+	}
+	virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		process<true>(out, out_count, in, in_count);
+	}
+	virtual void reverseFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		process<false>(out, out_count, in, in_count);
+	}
+	static uint32_t getMaxExpansion() {
+		return 1;
+	}
+	void dumpInfo() const {
+		std::cout << std::endl << "ARM64: " << transform_count_ << std::endl;
+	}
+	void setOpt(uint32_t s) {
+	}
+
+private:
+	template <bool encode>
+	forceinline uint32_t transform(uint32_t insn, uint32_t pc) {
+		if ((insn & 0x7C000000) == 0x14000000) {
+			// B / BL, imm26 in words.
+			const uint32_t imm = encode ? insn + (pc >> 2) : insn - (pc >> 2);
+			++transform_count_;
+			return (insn & 0xFC000000) | (imm & 0x03FFFFFF);
+		}
+		if ((insn & 0x9F000000) == 0x90000000) {
+			// ADRP, imm21 in pages split into immlo (bits 29-30) and immhi (bits 5-23).
+			uint32_t imm = ((insn >> 29) & 3) | (((insn >> 5) & 0x7FFFF) << 2);
+			imm = encode ? imm + (pc >> 12) : imm - (pc >> 12);
+			++transform_count_;
+			return (insn & 0x9F00001F) | ((imm & 3) << 29) | (((imm >> 2) & 0x7FFFF) << 5);
+		}
+		return insn;
+	}
+
+	template <bool encode>
+	void process(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		const size_t in_c = *in_count;
+		const size_t count = std::min(in_c, *out_count);
+		// Bytes before the first aligned word.
+		const size_t lead = (4 - (offset_ & 3)) & 3;
+		size_t pos = 0;
+		if (in_c < lead + 4) {
+			// Only the end of the stream has no whole word.
+			std::copy(in, in + count, out);
+			pos = count;
+		} else {
+			pos = std::min(lead, count);
+			std::copy(in, in + pos, out);
+			for (; pos + 4 <= count; pos += 4) {
+				const uint32_t insn = static_cast<uint32_t>(in[pos]) | (static_cast<uint32_t>(in[pos + 1]) << 8) |
+					(static_cast<uint32_t>(in[pos + 2]) << 16) | (static_cast<uint32_t>(in[pos + 3]) << 24);
+				const uint32_t value = transform<encode>(insn, static_cast<uint32_t>(offset_ + pos));
+				out[pos + 0] = static_cast<uint8_t>(value);
+				out[pos + 1] = static_cast<uint8_t>(value >> 8);
+				out[pos + 2] = static_cast<uint8_t>(value >> 16);
+				out[pos + 3] = static_cast<uint8_t>(value >> 24);
+			}
+		}
+		*in_count = *out_count = pos;
+		offset_ += pos;
+	}
+
+	uint64_t offset_;
+	size_t transform_count_;
+};
+
+#endif
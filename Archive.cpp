@@ -25,13 +25,27 @@
 
 #include <algorithm>
 #include <cstring>
+#include <map>
 
+#include "ARM64Binary.hpp"
+#include "ColumnFilter.hpp"
+#include "FloatFilter.hpp"
+#include "Image.hpp"
 #include "LZ.hpp"
+#include "RISCVBinary.hpp"
+#include "RecordFilter.hpp"
+#include "UTF16Filter.hpp"
 #include "X86Binary.hpp"
 #include "Wav16.hpp"
 
 static const bool kTestFilter = false;
+// Block size (leb128) followed by the block flags.
 static const size_t kSizePad = 10;
+static const size_t kBlockFlagsPos = kSizePad - 1;
+// The block expanded and was stored without the filter instead.
+static const uint8_t kBlockFlagStored = 1;
+// Bytes at the start of a binary block used to pick its branch filter.
+static const size_t kBinarySampleSize = 4 * MB;
 
 Archive::Header::Header() : major_version_(kCurMajorVersion), minor_version_(kCurMinorVersion) {
 	memcpy(magic_, getMagic(), kMagicStringLength);
@@ -57,14 +71,19 @@ bool Archive::Header::isSameVersion() const {
 	return major_version_ == kCurMajorVersion && minor_version_ == kCurMinorVersion;
 }
 
-Archive::Algorithm::Algorithm(const CompressionOptions& options, Detector::Profile profile) : profile_(profile) {
+Archive::Algorithm::Algorithm(const CompressionOptions& options, Detector::Profile profile, uint32_t stride)
+	: profile_(profile), stride_(stride), filter_mode_(0) {
 	mem_usage_ = options.mem_usage_;
 	algorithm_ = Compressor::kTypeStore;
 	filter_ = FilterType::kFilterTypeNone;
 
-	if (profile == Detector::kProfileWave16) {
+	if (profile == Detector::kProfileWave) {
 		algorithm_ = Compressor::kTypeWav16;
 		// algorithm_ = Compressor::kTypeStore;
+	} else if (profile == Detector::kProfileImage) {
+		algorithm_ = Compressor::kTypeImage;
+	} else if (profile == Detector::kProfileIncompressible) {
+		algorithm_ = Compressor::kTypeStore;
 	} else {
 		switch (options.comp_level_) {
 		case kCompLevelStore:
@@ -89,6 +108,7 @@ Archive::Algorithm::Algorithm(const CompressionOptions& options, Detector::Profi
 	}
 	switch (profile) {
 	case Detector::kProfileBinary:
+	case Detector::kProfileCode:
 		lzp_enabled_ = true;
 		filter_ = kFilterTypeX86;
 		break;
@@ -96,6 +116,35 @@ Archive::Algorithm::Algorithm(const CompressionOptions& options, Detector::Profi
 		lzp_enabled_ = true;
 		filter_ = kFilterTypeDict;
 		break;
+	case Detector::kProfileRecord:
+		lzp_enabled_ = true;
+		filter_mode_ = options.record_mode_;
+		filter_ = filter_mode_ != 0 ? kFilterTypeRecord : kFilterTypeNone;
+		break;
+	case Detector::kProfileFloat:
+		lzp_enabled_ = false;
+		filter_mode_ = options.float_mode_;
+		filter_ = filter_mode_ != 0 ? kFilterTypeFloat : kFilterTypeNone;
+		break;
+	case Detector::kProfileColumns:
+		lzp_enabled_ = true;
+		filter_ = kFilterTypeColumns;
+		break;
+	case Detector::kProfileUTF16:
+		lzp_enabled_ = true;
+		// The mode is the filter of the transcoded text.
+		filter_mode_ = kFilterTypeDict;
+		filter_ = kFilterTypeUTF16;
+		break;
+	case Detector::kProfileImage:
+		lzp_enabled_ = false;
+		break;
+	case Detector::kProfileIncompressible:
+		// Overrides don't matter for stored data.
+		lzp_enabled_ = false;
+		return;
+	default:
+		break;
 	}
 	// OVerrrides.
 	if (options.lzp_type_ == kLZPTypeEnable) lzp_enabled_ = true;
@@ -112,6 +161,7 @@ Archive::Algorithm::Algorithm(Stream* stream) {
 
 void Archive::init() {
 	opt_var_ = 0;
+	dict_ = nullptr;
 }
 
 Archive::Archive(Stream* stream, const CompressionOptions& options) : stream_(stream), options_(options) {
@@ -124,10 +174,29 @@ Archive::Archive(Stream* stream) : stream_(stream), opt_var_(0) {
 	header_.read(stream_);
 }
 
+static Compressor* newWav16(size_t sample_bytes, size_t channels) {
+	if (channels == 1) {
+		switch (sample_bytes) {
+		case 1: return new Wav16<1, 1>;
+		case 2: return new Wav16<2, 1>;
+		case 3: return new Wav16<3, 1>;
+		}
+	} else {
+		switch (sample_bytes) {
+		case 1: return new Wav16<1, 2>;
+		case 2: return new Wav16<2, 2>;
+		case 3: return new Wav16<3, 2>;
+		}
+	}
+	return nullptr;
+}
+
 Compressor* Archive::Algorithm::createCompressor() {
 	switch (algorithm_) {
 	case Compressor::kTypeWav16:
-		return new Wav16;
+		return newWav16(Detector::waveSampleBytes(stride_), Detector::waveChannels(stride_));
+	case Compressor::kTypeImage:
+		return new Image(Detector::imageRowBytes(stride_), Detector::imagePixelBytes(stride_));
 	case Compressor::kTypeStore:
 		return new Store;
 	case Compressor::kTypeCMTurbo:
@@ -151,6 +220,27 @@ void Archive::Algorithm::read(Stream* stream) {
 	lzp_enabled_ = stream->get() != 0 ? true : false;
 	filter_ = static_cast<FilterType>(stream->get());
 	profile_ = static_cast<Detector::Profile>(stream->get());
+	stride_ = filter_mode_ = 0;
+	if (filter_ == kFilterTypeRecord || filter_ == kFilterTypeFloat) {
+		stride_ = static_cast<uint32_t>(stream->leb128Decode());
+		filter_mode_ = static_cast<uint32_t>(stream->get());
+		check(filter_ == kFilterTypeRecord ? stride_ > 0 && stride_ <= RecordFilter::kMaxStride : stride_ == 4 || stride_ == 8);
+	}
+	if (filter_ == kFilterTypeUTF16) {
+		stride_ = static_cast<uint32_t>(stream->leb128Decode());
+		filter_mode_ = static_cast<uint32_t>(stream->get());
+		check(stride_ == UTF16Filter::kLittleEndian || stride_ == UTF16Filter::kBigEndian);
+		check(filter_mode_ == kFilterTypeDict);
+	}
+	if (algorithm_ == Compressor::kTypeImage) {
+		stride_ = static_cast<uint32_t>(stream->leb128Decode());
+		check(Detector::imageRowBytes(stride_) >= Detector::imagePixelBytes(stride_));
+	}
+	if (algorithm_ == Compressor::kTypeWav16) {
+		stride_ = static_cast<uint32_t>(stream->leb128Decode());
+		const size_t sample_bytes = Detector::waveSampleBytes(stride_);
+		check(sample_bytes > 0 && sample_bytes <= Detector::kMaxSampleBytes);
+	}
 }
 
 void Archive::Algorithm::write(Stream* stream) {
@@ -159,6 +249,13 @@ void Archive::Algorithm::write(Stream* stream) {
 	stream->put(lzp_enabled_);
 	stream->put(filter_);
 	stream->put(profile_);
+	if (filter_ == kFilterTypeRecord || filter_ == kFilterTypeFloat || filter_ == kFilterTypeUTF16) {
+		stream->leb128Encode(stride_);
+		stream->put(filter_mode_);
+	}
+	if (algorithm_ == Compressor::kTypeImage || algorithm_ == Compressor::kTypeWav16) {
+		stream->leb128Encode(stride_);
+	}
 }
 
 std::ostream& operator<<(std::ostream& os, CompLevel comp_level) {
@@ -173,22 +270,45 @@ std::ostream& operator<<(std::ostream& os, CompLevel comp_level) {
 	return os << "unknown";
 }
 
-Filter* Archive::Algorithm::createFilter(Stream* stream, Analyzer* analyzer) {
+Filter* Archive::Algorithm::createDictFilter(Stream* stream, Analyzer* analyzer, const Dict::ExternalDict* dict) {
+	if (dict != nullptr) {
+		return new Dict::Filter(stream, dict->getDict(), dict->getDictSize());
+	} else if (analyzer) {
+		auto& builder = analyzer->getDictBuilder();
+		Dict::CodeWordGeneratorFast generator;
+		Dict::CodeWordSet code_words;
+		generator.generateCodeWords(builder, &code_words);
+		auto dict_filter = new Dict::Filter(stream, 0x3, 0x4, 0x6);
+		dict_filter->addCodeWords(code_words.getCodeWords(), code_words.num1_, code_words.num2_, code_words.num3_);
+		return dict_filter;
+	} else {
+		return new Dict::Filter(stream);
+	}
+}
+
+Filter* Archive::Algorithm::createFilter(Stream* stream, Analyzer* analyzer, const Dict::ExternalDict* dict) {
 	switch (filter_) {
 	case kFilterTypeDict:
-		if (analyzer) {
-			auto& builder = analyzer->getDictBuilder();
-			Dict::CodeWordGeneratorFast generator;
-			Dict::CodeWordSet code_words;
-			generator.generateCodeWords(builder, &code_words);
-			auto dict_filter = new Dict::Filter(stream, 0x3, 0x4, 0x6);
-			dict_filter->addCodeWords(code_words.getCodeWords(), code_words.num1_, code_words.num2_, code_words.num3_);
-			return dict_filter;
-		} else {
-			return new Dict::Filter(stream);
-		}
+		return createDictFilter(stream, analyzer, dict);
 	case kFilterTypeX86:
 		return new X86AdvancedFilter(stream);
+	case kFilterTypeX64:
+		return new X64Filter(stream);
+	case kFilterTypeARM64:
+		return new ARM64Filter(stream);
+	case kFilterTypeRISCV:
+		return new RISCVFilter(stream);
+	case kFilterTypeRecord:
+		return new RecordFilter(stream, stride_, filter_mode_);
+	case kFilterTypeColumns:
+		return new ColumnFilter(stream);
+	case kFilterTypeFloat:
+		return new FloatFilter(stream, stride_, filter_mode_);
+	case kFilterTypeUTF16: {
+		// The dictionary of the text blocks also works on the transcoded text.
+		Filter* utf16 = new UTF16Filter(stream, stride_);
+		return new FilterChain(utf16, createDictFilter(utf16, analyzer, dict));
+	}
 	}
 	return nullptr;
 }
@@ -203,31 +323,273 @@ public:
 	}
 };
 
+// Add [offset, offset + length) to the segments, skipping deduplicated bytes. Ref index only moves forward.
+static void addRange(FileSegmentStream::FileSegments* seg, uint64_t offset, uint64_t length, const Dedup::Refs& refs, size_t* ref_idx) {
+	const uint64_t end = offset + length;
+	size_t& idx = *ref_idx;
+	while (offset < end) {
+		while (idx < refs.size() && refs[idx].dst_ + refs[idx].length_ <= offset) {
+			++idx;
+		}
+		const bool has_ref = idx < refs.size() && refs[idx].dst_ < end;
+		const uint64_t next = has_ref ? std::max(refs[idx].dst_, offset) : end;
+		if (next > offset) {
+			FileSegmentStream::SegmentRange range;
+			range.offset_ = offset;
+			range.length_ = next - offset;
+			seg->ranges_.push_back(range);
+		}
+		if (!has_ref) {
+			break;
+		}
+		offset = std::min(end, refs[idx].dst_ + refs[idx].length_);
+	}
+}
+
+size_t Archive::positionalUnit(const Detector::DetectedBlock& block) {
+	switch (block.profile()) {
+	case Detector::kProfileRecord:
+	case Detector::kProfileFloat:
+		return block.stride();
+	case Detector::kProfileWave:
+		return Detector::waveSampleBytes(block.stride()) * Detector::waveChannels(block.stride());
+	case Detector::kProfileImage:
+		return Detector::imageRowBytes(block.stride());
+	case Detector::kProfileUTF16:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+void Archive::alignPositionalRefs(Dedup::Refs* refs, const Analyzer::Blocks& blocks) {
+	class Range {
+	public:
+		uint64_t begin_, end_;
+		// 0 if the block has no unit, like the lines of column blocks.
+		size_t unit_;
+	};
+	std::vector<Range> ranges;
+	uint64_t pos = 0;
+	for (const auto& b : blocks) {
+		if (b.profile() == Detector::kProfileColumns || positionalUnit(b) != 0) {
+			Range range;
+			range.begin_ = pos;
+			range.end_ = pos + b.length();
+			range.unit_ = positionalUnit(b);
+			ranges.push_back(range);
+		}
+		pos += b.length();
+	}
+	// Refs are sorted and don't overlap, split each one at the block edges.
+	size_t idx = 0;
+	Dedup::Refs kept;
+	for (const auto& ref : *refs) {
+		const uint64_t end = ref.dst_ + ref.length_;
+		auto add = [&](uint64_t begin, uint64_t stop) {
+			if (stop > begin) {
+				Dedup::Ref piece;
+				piece.dst_ = begin;
+				piece.src_ = ref.src_ + (begin - ref.dst_);
+				piece.length_ = stop - begin;
+				kept.push_back(piece);
+			}
+		};
+		uint64_t cur = ref.dst_;
+		while (cur < end) {
+			while (idx < ranges.size() && ranges[idx].end_ <= cur) {
+				++idx;
+			}
+			if (idx < ranges.size() && ranges[idx].begin_ <= cur) {
+				const Range& r = ranges[idx];
+				const uint64_t stop = std::min(end, r.end_);
+				if (r.unit_ != 0) {
+					// Whole units from a unit boundary on keep the rest of the block aligned.
+					const uint64_t first = (cur - r.begin_ + r.unit_ - 1) / r.unit_ * r.unit_;
+					add(r.begin_ + first, r.begin_ + (stop - r.begin_) / r.unit_ * r.unit_);
+				}
+				cur = stop;
+			} else {
+				const uint64_t stop = idx < ranges.size() ? std::min(end, ranges[idx].begin_) : end;
+				add(cur, stop);
+				cur = stop;
+			}
+		}
+	}
+	refs->swap(kept);
+}
+
+// Incompressible windows that repeat other incompressible windows go to the binary stream instead of being stored,
+// both the first copy and the repeat, so that the match models can find the repeat. Chunks are found like dedup
+// does but only over the incompressible blocks.
+static void compressRepeatedWindows(Stream* in, Analyzer::Blocks* blocks) {
+	FileSegmentStream::FileSegments seg;
+	seg.base_offset_ = 0;
+	seg.stream_ = in;
+	// File offset of each incompressible block, by offset in the segments.
+	std::map<uint64_t, uint64_t> offsets;
+	uint64_t pos = 0, seg_pos = 0;
+	for (const auto& b : *blocks) {
+		if (b.profile() == Detector::kProfileIncompressible) {
+			FileSegmentStream::SegmentRange range;
+			range.offset_ = pos;
+			range.length_ = b.length();
+			seg.ranges_.push_back(range);
+			offsets[seg_pos] = pos;
+			seg_pos += b.length();
+		}
+		pos += b.length();
+	}
+	if (seg.ranges_.empty()) {
+		return;
+	}
+	seg.calculateTotalSize();
+	std::vector<FileSegmentStream::FileSegments> segments(1, seg);
+	FileSegmentStream stream(&segments, 0u);
+	Dedup dedup;
+	dedup.findDuplicates(&stream);
+	if (dedup.getRefs().empty()) {
+		return;
+	}
+	// File ranges of both sides of the repeats.
+	std::vector<std::pair<uint64_t, uint64_t>> repeats;
+	auto add = [&](uint64_t begin, uint64_t length) {
+		while (length != 0) {
+			auto it = --offsets.upper_bound(begin);
+			auto next = std::next(it);
+			const uint64_t block_end = next != offsets.end() ? next->first : seg_pos;
+			const uint64_t count = std::min(length, block_end - begin);
+			repeats.push_back(std::make_pair(it->second + (begin - it->first), it->second + (begin - it->first) + count));
+			begin += count;
+			length -= count;
+		}
+	};
+	for (const auto& ref : dedup.getRefs()) {
+		add(ref.src_, ref.length_);
+		add(ref.dst_, ref.length_);
+	}
+	std::sort(repeats.begin(), repeats.end());
+	// Split the incompressible blocks at the repeats.
+	Analyzer::Blocks new_blocks;
+	size_t idx = 0;
+	pos = 0;
+	for (const auto& b : *blocks) {
+		const uint64_t end = pos + b.length();
+		if (b.profile() != Detector::kProfileIncompressible) {
+			new_blocks.push_back(b);
+			pos = end;
+			continue;
+		}
+		uint64_t cur = pos;
+		while (cur < end) {
+			while (idx < repeats.size() && repeats[idx].second <= cur) {
+				++idx;
+			}
+			const bool repeated = idx < repeats.size() && repeats[idx].first <= cur;
+			uint64_t stop = end;
+			if (repeated) {
+				// Merge overlapping repeats.
+				stop = repeats[idx].second;
+				for (size_t i = idx; i < repeats.size() && repeats[i].first <= stop; ++i) {
+					stop = std::max(stop, repeats[i].second);
+				}
+				stop = std::min(stop, end);
+			} else if (idx < repeats.size()) {
+				stop = std::min(end, repeats[idx].first);
+			}
+			new_blocks.push_back(Detector::DetectedBlock(repeated ? Detector::kProfileBinary : Detector::kProfileIncompressible,
+				static_cast<uint32_t>(stop - cur)));
+			cur = stop;
+		}
+		pos = end;
+	}
+	blocks->swap(new_blocks);
+}
+
+// Pick the branch filter from counts of return instructions and x86-64 REX.W MOV / LEA, all of which are rare in
+// other data. Fallback is used if none of them is common.
+static FilterType detectBinaryFilter(Stream* stream, FilterType fallback) {
+	std::vector<uint8_t> buffer(kBinarySampleSize);
+	const size_t size = stream->read(&buffer[0], buffer.size());
+	uint64_t arm64 = 0, riscv = 0, x64 = 0;
+	for (size_t i = 0; i + 4 <= size; i += 2) {
+		const uint32_t w = static_cast<uint32_t>(buffer[i]) | (static_cast<uint32_t>(buffer[i + 1]) << 8) |
+			(static_cast<uint32_t>(buffer[i + 2]) << 16) | (static_cast<uint32_t>(buffer[i + 3]) << 24);
+		// RET.
+		arm64 += (i & 3) == 0 && w == 0xD65F03C0;
+		// C.RET or RET.
+		riscv += (w & 0xFFFF) == 0x8082 || w == 0x00008067;
+	}
+	for (size_t i = 0; i + 1 < size; ++i) {
+		const uint8_t op = buffer[i + 1];
+		x64 += (buffer[i] & 0xFB) == 0x48 && (op == 0x8B || op == 0x89 || op == 0x8D);
+	}
+	// Per MB thresholds, random data has about 90 REX.W matches per MB.
+	const uint64_t total = std::max(static_cast<uint64_t>(size), static_cast<uint64_t>(1));
+	if (arm64 * MB >= 64 * total && arm64 >= riscv) {
+		return kFilterTypeARM64;
+	} else if (riscv * MB >= 64 * total) {
+		return kFilterTypeRISCV;
+	} else if (x64 * MB >= 2 * KB * total) {
+		return kFilterTypeX64;
+	}
+	return fallback;
+}
+
 void Archive::constructBlocks(Stream* in, Analyzer* analyzer) {
 	// Compress blocks.
 	uint64_t total_in = 0;
+	const auto& refs = blocks_.dedup_.getRefs();
+	bool has_code = false;
+	for (const auto& b : analyzer->getBlocks()) {
+		has_code = has_code || b.profile() == Detector::kProfileCode;
+	}
+	// Each stream type is one solid block, record, float, image, wave and UTF-16 blocks one per record size, value size,
+	// layout or byte order.
+	std::vector<std::pair<Detector::Profile, uint32_t>> keys;
 	for (size_t p_idx = 0; p_idx < static_cast<size_t>(Detector::kProfileCount); ++p_idx) {
 		auto profile = static_cast<Detector::Profile>(p_idx);
+		if (profile != Detector::kProfileRecord && profile != Detector::kProfileFloat && profile != Detector::kProfileImage &&
+			profile != Detector::kProfileWave && profile != Detector::kProfileUTF16) {
+			keys.push_back(std::make_pair(profile, 0u));
+		}
+	}
+	std::vector<std::pair<Detector::Profile, uint32_t>> sized_keys;
+	for (const auto& b : analyzer->getBlocks()) {
+		if (b.stride() != 0) {
+			sized_keys.push_back(std::make_pair(b.profile(), b.stride()));
+		}
+	}
+	std::sort(sized_keys.begin(), sized_keys.end());
+	sized_keys.erase(std::unique(sized_keys.begin(), sized_keys.end()), sized_keys.end());
+	keys.insert(keys.end(), sized_keys.begin(), sized_keys.end());
+	for (const auto& key : keys) {
+		const auto profile = key.first;
 		// Compress each stream type.
 		uint64_t pos = 0;
+		size_t ref_idx = 0;
 		FileSegmentStream::FileSegments seg;
 		seg.base_offset_ = 0;
 		seg.stream_ = in;
 		for (const auto& b : analyzer->getBlocks()) {
 			const auto len = b.length();
-			if (b.profile() == profile) {
-				FileSegmentStream::SegmentRange range;
-				range.offset_ = pos;
-				range.length_ = len;
-				seg.ranges_.push_back(range);
+			if (b.profile() == profile && b.stride() == key.second) {
+				addRange(&seg, pos, len, refs, &ref_idx);
 			}
 			pos += len;
 		}
 		seg.calculateTotalSize();
 		if (seg.total_size_ > 0) {
 			auto* solid_block = new Archive::SolidBlock();
-			solid_block->algorithm_ = Algorithm(options_, profile);
+			solid_block->algorithm_ = Algorithm(options_, profile, key.second);
 			solid_block->segments_.push_back(seg);
+			if ((profile == Detector::kProfileBinary || profile == Detector::kProfileCode) &&
+				options_.filter_type_ == kFilterTypeAuto) {
+				// With the code sections of executables split out, the rest of the binary data is mostly not code.
+				const FilterType fallback = profile == Detector::kProfileBinary && has_code ? kFilterTypeNone : kFilterTypeX86;
+				FileSegmentStream sample(&solid_block->segments_, 0u);
+				solid_block->algorithm_.setFilter(detectBinaryFilter(&sample, fallback));
+			}
 			solid_block->total_size_ = seg.total_size_;
 			blocks_.blocks_.push_back(solid_block);
 		}
@@ -274,6 +636,12 @@ void Archive::Blocks::write(Stream* stream) {
 	for (auto* block : blocks_) {
 		block->write(stream);
 	}
+	dedup_.write(stream);
+	stream->put(has_dict_);
+	if (has_dict_) {
+		stream->leb128Encode(dict_hash_.h1_);
+		stream->leb128Encode(dict_hash_.h2_);
+	}
 }
 
 void Archive::Blocks::read(Stream* stream) { 
@@ -285,6 +653,12 @@ void Archive::Blocks::read(Stream* stream) {
 		block->read(stream);
 		blocks_.push_back(block);
 	}
+	dedup_.read(stream);
+	has_dict_ = stream->get() != 0;
+	if (has_dict_) {
+		dict_hash_.h1_ = stream->leb128Decode();
+		dict_hash_.h2_ = stream->leb128Decode();
+	}
 }
 
 void Archive::SolidBlock::write(Stream* stream) { 
@@ -354,11 +728,17 @@ void testFilter(Stream* stream, Analyzer* analyzer) {
 // Analyze and compress.
 void Archive::compress(Stream* in) {
 	Analyzer analyzer;
+	analyzer.setDictSampleSize(options_.dict_sample_size_);
+	analyzer.setCountWords(dict_ == nullptr);
+	analyzer.setDictBufferSize(static_cast<size_t>(options_.dict_order_size_));
 	auto start_a = clock();
 	std::cout << "Analyzing" << std::endl;
 	{
+		// Parallel analysis reads at arbitrary offsets, files support it.
+		auto* file = dynamic_cast<File*>(in);
+		const uint64_t length = file != nullptr ? file->length() : 0;
 		ProgressThread thr(in, stream_);
-		analyzer.analyze(in);
+		analyzer.analyze(in, length, file != nullptr ? std::thread::hardware_concurrency() : 1);
 	}
 	std::cout << std::endl;
 	analyzer.dump();
@@ -369,7 +749,24 @@ void Archive::compress(Stream* in) {
 		testFilter(in, &analyzer);
 	}
 
+	if (options_.dedup_) {
+		auto start_d = clock();
+		in->seek(0);
+		auto& dedup = blocks_.dedup_;
+		dedup.findDuplicates(in);
+		alignPositionalRefs(&dedup.getRefs(), analyzer.getBlocks());
+		std::cout << "Dedup " << formatNumber(dedup.dedupedBytes()) << " bytes in " << formatNumber(dedup.getRefs().size())
+			<< " refs took " << clockToSeconds(clock() - start_d) << "s" << std::endl << std::endl;
+	} else {
+		// Dedup takes out those repeats by itself.
+		compressRepeatedWindows(in, &analyzer.getBlocks());
+	}
+
 	constructBlocks(in, &analyzer);
+	if (dict_ != nullptr) {
+		blocks_.has_dict_ = true;
+		blocks_.dict_hash_ = dict_->getHash();
+	}
 	writeBlocks();
 
 	for (auto* block : blocks_.blocks_) {
@@ -383,22 +780,40 @@ void Archive::compress(Stream* in) {
 		Algorithm* algo = &block->algorithm_;
 		std::cout << "Compressing " << Detector::profileToString(algo->profile())
 			<< " stream size=" << formatNumber(block->total_size_) << "\t" << std::endl;
-		std::unique_ptr<Filter> filter(algo->createFilter(&segstream, &analyzer));
+		std::unique_ptr<Filter> filter(algo->createFilter(&segstream, &analyzer, dict_));
 		Stream* in_stream = &segstream;
 		if (filter.get() != nullptr) in_stream = filter.get();
 		auto in_start = in_stream->tell();
 		std::unique_ptr<Compressor> comp(algo->createCompressor());
 		comp->setOpt(opt_var_);
+		if (filter.get() == nullptr) {
+			// The compressor sees the input bytes as they are, far history is read back from the input.
+			comp->setHistory(&segstream);
+		}
 		{
 			ProgressThread thr(&segstream, stream_, true, out_start);
 			comp->compress(in_stream, stream_);
 		}
 		auto after_pos = stream_->tell();
+		auto filter_size = in_stream->tell() - in_start;
+		uint8_t flags = 0;
+		if (after_pos - out_start > block->total_size_ + kSizePad) {
+			// Expanded, store the original data instead.
+			std::cout << std::endl << "Block expanded to " << formatNumber(after_pos - out_start) << ", storing";
+			stream_->seek(out_start + kSizePad);
+			FileSegmentStream raw_stream(&block->segments_, 0u);
+			Store store;
+			store.compress(&raw_stream, stream_, block->total_size_);
+			after_pos = stream_->tell();
+			filter_size = block->total_size_;
+			flags |= kBlockFlagStored;
+		}
 
 		// Fix up the size.
 		stream_->seek(out_start);
-		const auto filter_size = in_stream->tell() - in_start;
 		stream_->leb128Encode(filter_size);
+		stream_->seek(out_start + kBlockFlagsPos);
+		stream_->put(flags);
 		stream_->seek(after_pos);
 
 		// Dump some info.
@@ -409,8 +824,12 @@ void Archive::compress(Stream* in) {
 }
 
 // Decompress.
-void Archive::decompress(Stream* out) {
+bool Archive::decompress(Stream* out) {
 	readBlocks();
+	if (blocks_.has_dict_ && (dict_ == nullptr || !(dict_->getHash() == blocks_.dict_hash_))) {
+		std::cerr << (dict_ == nullptr ? "Archive requires a dictionary" : "Dictionary doesn't match the archive") << std::endl;
+		return false;
+	}
 	for (auto* block : blocks_.blocks_) {
 		block->total_size_ = 0;
 		auto start_pos = stream_->tell();
@@ -422,19 +841,30 @@ void Archive::decompress(Stream* out) {
 		// Read size.
 		auto out_start = stream_->tell();
 		auto block_size = stream_->leb128Decode();
-		while (stream_->tell() < out_start + kSizePad) {
+		while (stream_->tell() < out_start + kBlockFlagsPos) {
 			stream_->get();
 		}
+		const uint8_t flags = static_cast<uint8_t>(stream_->get());
 
 		auto start = clock();
 		FileSegmentStream segstream(&block->segments_, 0u);	
 		Algorithm* algo = &block->algorithm_;
 		std::cout << "Decompressing " << Detector::profileToString(algo->profile())
 			<< " stream size=" << formatNumber(block->total_size_) << "\t" << std::endl;
-		std::unique_ptr<Filter> filter(algo->createFilter(&segstream, nullptr));
+		std::unique_ptr<Filter> filter;
+		std::unique_ptr<Compressor> comp;
+		if ((flags & kBlockFlagStored) != 0) {
+			comp.reset(new Store);
+		} else {
+			filter.reset(algo->createFilter(&segstream, nullptr, dict_));
+			comp.reset(algo->createCompressor());
+			if (filter.get() == nullptr) {
+				// Far history is read back from the output written so far.
+				comp->setHistory(&segstream);
+			}
+		}
 		Stream* out_stream = &segstream;
 		if (filter.get() != nullptr) out_stream = filter.get();
-		std::unique_ptr<Compressor> comp(algo->createCompressor());
 		comp->setOpt(opt_var_);
 		{
 			ProgressThread thr(&segstream, stream_, false, out_start);
@@ -444,4 +874,7 @@ void Archive::decompress(Stream* out) {
 		std::cout << std::endl << "Decompressed " << formatNumber(segstream.tell()) << " <- " << formatNumber(stream_->tell() - out_start)
 			<< " in " << clockToSeconds(clock() - start) << "s" << std::endl << std::endl;
 	}
+	// Repeated chunks are copied from the already decompressed data.
+	blocks_.dedup_.restore(out);
+	return true;
 }
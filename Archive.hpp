@@ -28,7 +28,10 @@
 
 #include "CM.hpp"
 #include "Compressor.hpp"
+#include "Dedup.hpp"
 #include "File.hpp"
+#include "FloatFilter.hpp"
+#include "RecordFilter.hpp"
 #include "Stream.hpp"
 
 // Force filter
@@ -36,6 +39,18 @@ enum FilterType {
 	kFilterTypeNone,
 	kFilterTypeDict,
 	kFilterTypeX86,
+	// Branch filters for other instruction sets, picked per binary block.
+	kFilterTypeX64,
+	kFilterTypeARM64,
+	kFilterTypeRISCV,
+	// Delta and / or transpose of fixed size records, the stride comes from the detector.
+	kFilterTypeRecord,
+	// Fields of line structured text stored column by column.
+	kFilterTypeColumns,
+	// Byte planes of float arrays, the value size comes from the detector.
+	kFilterTypeFloat,
+	// UTF-16 text transcoded to UTF-8 under the dictionary, the byte order comes from the detector.
+	kFilterTypeUTF16,
 	kFilterTypeAuto,
 	kFilterTypeCount,
 };
@@ -62,7 +77,12 @@ public:
 	static const CompLevel kDefaultLevel = kCompLevelMid;
 	static const FilterType kDefaultFilter = kFilterTypeAuto;
 	static const LZPType kDefaultLZPType = kLZPTypeAuto;
-	CompressionOptions() : mem_usage_(kDefaultMemUsage), comp_level_(kDefaultLevel), filter_type_(kDefaultFilter), lzp_type_(kDefaultLZPType) {
+	static const bool kDefaultDedup = false;
+	static const uint64_t kDefaultDictSampleSize = 0;
+	static const uint64_t kDefaultDictOrderSize = 0;
+	static const uint32_t kDefaultRecordMode = RecordFilter::kModeBoth;
+	static const uint32_t kDefaultFloatMode = FloatFilter::kModePlanes | FloatFilter::kModeDelta;
+	CompressionOptions() : mem_usage_(kDefaultMemUsage), comp_level_(kDefaultLevel), filter_type_(kDefaultFilter), lzp_type_(kDefaultLZPType), dedup_(kDefaultDedup), dict_sample_size_(kDefaultDictSampleSize), dict_order_size_(kDefaultDictOrderSize), record_mode_(kDefaultRecordMode), float_mode_(kDefaultFloatMode) {
 	}
 
 public:
@@ -70,6 +90,16 @@ public:
 	CompLevel comp_level_;
 	FilterType filter_type_;
 	LZPType lzp_type_;
+	// Replace repeated chunks with references before compression.
+	bool dedup_;
+	// Build the dictionary from about this many bytes of the input, 0 uses all of it.
+	uint64_t dict_sample_size_;
+	// Order the dictionary code words by suffix sorting up to this many bytes of text, 0 sorts them by word.
+	uint64_t dict_order_size_;
+	// RecordFilter mode for record blocks, 0 compresses them like other binary data.
+	uint32_t record_mode_;
+	// FloatFilter mode for float blocks, 0 compresses them like other binary data.
+	uint32_t float_mode_;
 };
 
 // File headers are stored in a list of blocks spread out through data.
@@ -78,7 +108,7 @@ public:
 	class Header {
 	public:
 		static const size_t kCurMajorVersion = 0;
-		static const size_t kCurMinorVersion = 83;
+		static const size_t kCurMinorVersion = 96;
 		static const size_t kMagicStringLength = 10;
 		
 		static const char* getMagic() {
@@ -105,15 +135,22 @@ public:
 	class Algorithm {
 	public:
 		Algorithm() {}
-		Algorithm(const CompressionOptions& options, Detector::Profile profile);
+		Algorithm(const CompressionOptions& options, Detector::Profile profile, uint32_t stride = 0);
 		Algorithm(Stream* stream);
 		Compressor* createCompressor();
 		void read(Stream* stream);
 		void write(Stream* stream);
-		Filter* createFilter(Stream* stream, Analyzer* analyzer);
+		Filter* createFilter(Stream* stream, Analyzer* analyzer, const Dict::ExternalDict* dict);
+		Filter* createDictFilter(Stream* stream, Analyzer* analyzer, const Dict::ExternalDict* dict);
 		Detector::Profile profile() const {
 			return profile_;
 		}
+		FilterType filter() const {
+			return filter_;
+		}
+		void setFilter(FilterType filter) {
+			filter_ = filter;
+		}
 
 	private:
 		uint8_t mem_usage_;
@@ -121,6 +158,10 @@ public:
 		bool lzp_enabled_;
 		FilterType filter_;
 		Detector::Profile profile_;
+		// Only stored for the record, float and UTF-16 filters, the record or value size or byte order and the filter
+		// mode.
+		uint32_t stride_;
+		uint32_t filter_mode_;
 	};
 
 	class SolidBlock {
@@ -138,6 +179,14 @@ public:
 	class Blocks {
 	public:
 		std::vector<SolidBlock*> blocks_;
+		// Repeated chunks, not part of any block.
+		Dedup dedup_;
+		// Text blocks use an external dictionary with this hash.
+		bool has_dict_;
+		Dedup::Hash128 dict_hash_;
+
+		Blocks() : has_dict_(false) {
+		}
 
 		void write(Stream* stream);
 		void read(Stream* stream);
@@ -161,14 +210,26 @@ public:
 		return true;
 	}
 
+	// Use an external dictionary for text, compressing and decompressing need the same one.
+	void setDict(const Dict::ExternalDict* dict) {
+		dict_ = dict;
+	}
+
 	void writeBlocks();
 	void readBlocks();
 
 	// Analyze and compress.
 	void compress(Stream* in);
 
-	// Decompress.
-	void decompress(Stream* out);
+	// Decompress, false if the archive needs a dictionary that wasn't provided.
+	bool decompress(Stream* out);
+
+	// Bytes per sample, row, record, value or code unit of blocks that are transformed or modelled by position, 0 for
+	// other blocks.
+	static size_t positionalUnit(const Detector::DetectedBlock& block);
+	// Dedup references are split at the edges of those blocks and trimmed to whole units inside them, so that the
+	// hole does not shift the rest of the block. Column blocks keep none.
+	static void alignPositionalRefs(Dedup::Refs* refs, const Analyzer::Blocks& blocks);
 
 private:
 	Stream* stream_;
@@ -176,6 +237,7 @@ private:
 	CompressionOptions options_;
 	size_t opt_var_;
 	Blocks blocks_;
+	const Dict::ExternalDict* dict_;
 
 	void init();
 	Compressor* createMetaDataCompressor();
@@ -57,11 +57,21 @@ void CM<kCMType>::init() {
 	hash_storage.resize(hash_alloc_size); // Add extra space for ctx.
 	hash_table = reinterpret_cast<uint8_t*>(hash_storage.getData()); // Here is where the real hash table starts
 
-	buffer.resize((MB / 4) << mem_usage, sizeof(uint32_t));
+	buffer.resizeMirrored((MB / 4) << mem_usage, sizeof(uint32_t));
 
 	// Match model.
 	match_model.resize(buffer.getSize() / 2);
 	match_model.init(MatchModelType::kMinMatch, 80U);
+	if (kUseLongMatch) {
+		if (history_ != nullptr && force_profile_) {
+			// Without the detector the history positions are the buffer positions. There is no ring to keep, its
+			// memory goes to more anchors since they cover the whole stream.
+			long_match_model_.init(buffer.getSize() / 2, 0, buffer.getSize(), history_);
+		} else {
+			// Anchors are sparse, one slot per 8 bytes of buffer covers the history.
+			long_match_model_.init(buffer.getSize() / 8, buffer.getSize() * kLongMatchHistory, buffer.getSize(), nullptr);
+		}
+	}
 	match_model_order_ = 0;
 	fixed_match_probs_.resize(81 * 2);
 	int magic_array[100];
@@ -152,7 +162,7 @@ void CM<kCMType>::init() {
 	// Statistics
 	if (kStatistics) {
 		for (auto& c : mixer_skip) c = 0;
-		other_count_ = match_count_ = non_match_count_ = 0;
+		other_count_ = match_count_ = non_match_count_ = long_match_count_ = 0;
 		std::cout << "Setup took: " << clock() - start << std::endl;
 		lzp_bit_match_bytes_ = lzp_bit_miss_bytes_ = lzp_miss_bytes_ = normal_bytes_ = 0;
 		for (auto& len : match_hits_) len = 0;
@@ -284,7 +294,8 @@ void CM<kCMType>::compress(Stream* in_stream, Stream* out_stream, uint64_t max_c
 			<< " mix nonskip=" << formatNumber(mixer_skip[1]) << std::endl;
 		std::cout << "match=" << formatNumber(match_count_)
 			<< " matchfail=" << formatNumber(non_match_count_)
-			<< " nonmatch=" << formatNumber(other_count_) << std::endl;
+			<< " nonmatch=" << formatNumber(other_count_)
+			<< " longmatch=" << formatNumber(long_match_count_) << std::endl;
 		if (!kFastStats) {
 			if (false)
 			for (size_t i = 0; i < kMaxMatch; ++i) {
@@ -31,6 +31,7 @@
 #include "Entropy.hpp"
 #include "Huffman.hpp"
 #include "Log.hpp"
+#include "LongMatchModel.hpp"
 #include "MatchModel.hpp"
 #include "Memory.hpp"
 #include "Mixer.hpp"
@@ -129,6 +130,10 @@ public:
 	static const bool kPrefetchMatchModel = true;
 	static const bool kPrefetchWordModel = true;
 	static const bool kFixedMatchProbs = false;
+	// Long range matches beyond the buffer window, only for the slower levels.
+	static const bool kUseLongMatch = kCMType == kCMTypeHigh || kCMType == kCMTypeMax;
+	// History kept in memory for long matches in buffer sizes, if there is no history stream.
+	static const size_t kLongMatchHistory = 4;
 
 	// SS table
 	static const uint32_t kShift = 12;
@@ -152,6 +157,8 @@ public:
 	MatchModelType match_model;
 	size_t match_model_order_;
 	std::vector<int> fixed_match_probs_;
+	LongMatchModel long_match_model_;
+	Stream* history_;
 
 	// Hash table
 	size_t hash_mask;
@@ -282,7 +289,7 @@ public:
 
 	// Statistics
 	uint64_t mixer_skip[2];
-	uint64_t match_count_, non_match_count_, other_count_;
+	uint64_t match_count_, non_match_count_, other_count_, long_match_count_;
 	uint64_t lzp_bit_match_bytes_, lzp_bit_miss_bytes_, lzp_miss_bytes_, normal_bytes_;
 	uint64_t match_hits_[kMaxMatch], match_miss_[kMaxMatch];
 
@@ -308,8 +315,13 @@ public:
 		mem_usage = usage;
 	}
 
+	void setHistory(Stream* history) {
+		history_ = history;
+	}
+
 	CM(uint32_t mem = 8, bool lzp_enabled = kUseLZP, Detector::Profile profile = Detector::kProfileDetect)
 		: mem_usage(mem), opt_var(0), lzp_enabled_(lzp_enabled) {
+		history_ = nullptr;
 		force_profile_ = profile != Detector::kProfileDetect;
 		if (force_profile_) {
 			profile_  = profileForDetectorProfile(profile);
@@ -693,12 +705,20 @@ public:
 		size_t expected_char = 0;
 
 		size_t mm_len = 0;
+		if (kUseLongMatch) {
+			long_match_model_.update(buffer);
+		}
 		if (match_model_order_ != 0) {
 			match_model.update(buffer);
+			const bool long_match = kUseLongMatch && long_match_model_.getLength() > match_model.getLength();
+			if (long_match) {
+				match_model.setExternalMatch(long_match_model_.getLength());
+				if (kStatistics) ++long_match_count_;
+			}
 			if (mm_len = match_model.getLength()) {
 				match_model.setCtx(h & 0xFF);
 				match_model.updateCurMdl();
-				expected_char = match_model.getExpectedChar(buffer);
+				expected_char = long_match ? long_match_model_.getExpectedChar() : match_model.getExpectedChar(buffer);
 				uint32_t expected_bits = use_huffman ? huff.getCode(expected_char).length : 8;
 				size_t expected_code = use_huffman ? huff.getCode(expected_char).value : expected_char;
 				match_model.updateExpectedCode(expected_code, expected_bits);
@@ -853,7 +873,7 @@ public:
 	}
 
 	static CMProfile profileForDetectorProfile(Detector::Profile profile) {
-		if (profile == Detector::kProfileText) {
+		if (profile == Detector::kProfileText || profile == Detector::kProfileColumns || profile == Detector::kProfileUTF16) {
 			return kProfileText;
 		}
 		return kProfileBinary;
@@ -0,0 +1,448 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _COLUMN_FILTER_HPP_
+#define _COLUMN_FILTER_HPP_
+
+#include <vector>
+
+#include "Filter.hpp"
+
+// Columnar transform for line structured text like CSV, TSV and logs. Each chunk of whole lines is split into
+// fields at a delimiter and stored one column after the other, columns of plain numbers as differences to the
+// number one line above. In a column, a field ends with '\n' if its line goes on and with the delimiter if the
+// line ends there, the last column has the rest of the line. Fields can't contain their end markers so the
+// reverse filter rebuilds the lines exactly.
+//
+// Chunk layout: kind byte, then for raw chunks leb128 length and the bytes. Column chunks have leb128 length of
+// the lines, delimiter, column count, leb128 mask of delta columns, leb128 length of each column, the columns.
+class ColumnFilter : public ByteStreamFilter<64 * KB, 64 * KB> {
+public:
+	static const size_t kMaxColumns = 32;
+	static const size_t kChunkSize = 32 * KB;
+	static const size_t kMinLines = 8;
+	static const size_t kMinColumns = 3;
+
+	explicit ColumnFilter(Stream* stream) : ByteStreamFilter(stream), column_chunks_(0), raw_chunks_(0) {
+		std::fill(prev_, prev_ + kMaxColumns, 0);
+	}
+	virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		const size_t in_c = *in_count;
+		size_t in_pos = 0, out_pos = 0;
+		while (in_pos < in_c && out_pos + kChunkSize + kMaxHeader <= *out_count) {
+			size_t len = in_c - in_pos;
+			if (len >= kChunkSize) {
+				len = kChunkSize;
+			} else if (in_c >= kChunkSize) {
+				// Only the end of the stream has less than a chunk.
+				break;
+			}
+			// Whole lines only, the bytes after the last new line go in the next chunk.
+			size_t lines_len = len;
+			while (lines_len > 0 && in[in_pos + lines_len - 1] != '\n') {
+				--lines_len;
+			}
+			uint8_t delim = 0;
+			size_t columns = 0;
+			if (lines_len != 0 && analyze(in + in_pos, lines_len, &delim, &columns)) {
+				out_pos += encodeChunk(out + out_pos, in + in_pos, lines_len, delim, columns);
+				in_pos += lines_len;
+				++column_chunks_;
+			} else {
+				out[out_pos++] = kChunkRaw;
+				out_pos += writeVarInt(out + out_pos, len);
+				std::copy(in + in_pos, in + in_pos + len, out + out_pos);
+				out_pos += len;
+				in_pos += len;
+				++raw_chunks_;
+			}
+		}
+		*in_count = in_pos;
+		*out_count = out_pos;
+	}
+	virtual void reverseFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		const size_t in_c = *in_count;
+		size_t in_pos = 0, out_pos = 0;
+		while (in_pos < in_c) {
+			const uint8_t* ptr = in + in_pos;
+			const uint8_t* const limit = in + in_c;
+			ChunkHeader header;
+			if (!readHeader(&ptr, limit, &header) || static_cast<size_t>(limit - ptr) < header.payload_len_ ||
+				out_pos + header.len_ > *out_count) {
+				// Rest of the chunk not written yet.
+				break;
+			}
+			if (header.kind_ == kChunkRaw) {
+				std::copy(ptr, ptr + header.len_, out + out_pos);
+			} else {
+				decodeChunk(out + out_pos, ptr, header);
+			}
+			out_pos += header.len_;
+			in_pos = ptr + header.payload_len_ - in;
+		}
+		*in_count = in_pos;
+		*out_count = out_pos;
+	}
+	static uint32_t getMaxExpansion() {
+		return 1;
+	}
+	void dumpInfo() const {
+		std::cout << std::endl << "Columns: " << column_chunks_ << " raw: " << raw_chunks_ << std::endl;
+	}
+	void setOpt(uint32_t s) {
+	}
+
+	// Picks the delimiter and column count for the whole lines in [data, data + size). The column count is the
+	// most fields nearly all lines have. Columns help when fields one line apart are alike, checked by their
+	// first bytes, but not when whole lines repeat. False if no delimiter fits.
+	static bool analyze(const uint8_t* data, size_t size, uint8_t* out_delim, size_t* out_columns) {
+		static const uint8_t kDelims[] = { ',', '\t', ';', '|', ' ' };
+		size_t best_columns = 0, best_matches = 0, best_compared = 0;
+		uint8_t best_delim = 0;
+		for (uint8_t delim : kDelims) {
+			size_t lines = 0;
+			size_t counts[kMaxColumns] = {};
+			for (size_t i = 0, count = 0; i < size; ++i) {
+				if (data[i] == delim) {
+					++count;
+				} else if (data[i] == '\n') {
+					++counts[std::min(count, kMaxColumns - 1)];
+					++lines;
+					count = 0;
+				}
+			}
+			if (lines < kMinLines) {
+				return false;
+			}
+			// Delimiters that at least 7 / 8 of the lines have.
+			size_t delims = kMaxColumns - 1, at_least = counts[delims];
+			while (delims > 0 && at_least * 8 < lines * 7) {
+				at_least += counts[--delims];
+			}
+			// Most lines must have exactly as many, lines of free text don't. A single delimiter is too often
+			// code or text cut in two.
+			if (delims + 1 < kMinColumns || counts[delims] * 4 < lines * 3) {
+				continue;
+			}
+			// Fields of the previous line, kNoField length if the line didn't have it.
+			size_t prev_start[kMaxColumns], prev_len[kMaxColumns];
+			std::fill(prev_len, prev_len + kMaxColumns, kNoField);
+			size_t matches = 0, repeats = 0, compared = 0, field = 0, start = 0;
+			// Columns with a field that isn't all digits.
+			uint64_t text_columns = 0;
+			for (size_t i = 0; i < size; ++i) {
+				const uint8_t c = data[i];
+				if (c != '\n' && (c != delim || field == delims)) {
+					if (static_cast<uint32_t>(c) - '0' > 9) {
+						text_columns |= static_cast<uint64_t>(1) << field;
+					}
+					continue;
+				}
+				const size_t len = i - start;
+				if (len == 0) {
+					text_columns |= static_cast<uint64_t>(1) << field;
+				}
+				if (prev_len[field] != kNoField) {
+					++compared;
+					matches += data[start] == data[prev_start[field]];
+					repeats += len == prev_len[field] && std::equal(data + start, data + i, data + prev_start[field]);
+				}
+				prev_start[field] = start;
+				prev_len[field] = len;
+				start = i + 1;
+				if (c == '\n') {
+					std::fill(prev_len + field + 1, prev_len + delims + 1, kNoField);
+					field = 0;
+				} else {
+					++field;
+				}
+			}
+			// Words split at spaces don't line up like the fields of tables do, logs only gain from the numbers.
+			const uint64_t all_columns = (static_cast<uint64_t>(1) << (delims + 1)) - 1;
+			if (delim == ' ' && (text_columns & all_columns) == all_columns) {
+				continue;
+			}
+			// Lines that mostly repeat the one before do better as they are.
+			if (compared == 0 || matches * 3 < compared || repeats * 2 >= compared) {
+				continue;
+			}
+			if (best_compared == 0 || matches * best_compared > best_matches * compared) {
+				best_delim = delim;
+				best_columns = delims + 1;
+				best_matches = matches;
+				best_compared = compared;
+			}
+		}
+		*out_delim = best_delim;
+		*out_columns = best_columns;
+		return best_compared != 0;
+	}
+
+private:
+	static const size_t kNoField = static_cast<size_t>(-1);
+	static const size_t kMaxHeader = 8 + 2 * 5 + kMaxColumns * 5;
+	// Canonical numbers only so that they print back the same.
+	static const size_t kMaxNumberLength = 18;
+	enum ChunkKind {
+		kChunkRaw,
+		kChunkColumns,
+	};
+
+	class ChunkHeader {
+	public:
+		uint8_t kind_;
+		uint8_t delim_;
+		size_t len_;
+		size_t payload_len_;
+		size_t columns_;
+		uint32_t delta_mask_;
+		size_t column_len_[kMaxColumns];
+	};
+
+	class Field {
+	public:
+		uint32_t start_;
+		uint32_t len_;
+		uint8_t end_;
+	};
+
+	static size_t writeVarInt(uint8_t* out, uint64_t n) {
+		size_t pos = 0;
+		for (; n >= 0x80; n >>= 7) {
+			out[pos++] = static_cast<uint8_t>(0x80 | (n & 0x7F));
+		}
+		out[pos++] = static_cast<uint8_t>(n);
+		return pos;
+	}
+	// False if the number doesn't end before limit.
+	static bool readVarInt(const uint8_t** ptr, const uint8_t* limit, uint64_t* n) {
+		*n = 0;
+		for (size_t shift = 0; *ptr < limit && shift < 64; shift += 7) {
+			const uint8_t c = *(*ptr)++;
+			*n |= static_cast<uint64_t>(c & 0x7F) << shift;
+			if ((c & 0x80) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static bool readHeader(const uint8_t** ptr, const uint8_t* limit, ChunkHeader* header) {
+		uint64_t n;
+		if (*ptr >= limit) {
+			return false;
+		}
+		header->kind_ = *(*ptr)++;
+		if (!readVarInt(ptr, limit, &n)) {
+			return false;
+		}
+		header->len_ = static_cast<size_t>(n);
+		check(header->len_ <= kChunkSize);
+		if (header->kind_ == kChunkRaw) {
+			header->payload_len_ = header->len_;
+			return true;
+		}
+		check(header->kind_ == kChunkColumns);
+		if (limit - *ptr < 2) {
+			return false;
+		}
+		header->delim_ = *(*ptr)++;
+		header->columns_ = *(*ptr)++;
+		check(header->columns_ > 0 && header->columns_ <= kMaxColumns);
+		if (!readVarInt(ptr, limit, &n)) {
+			return false;
+		}
+		header->delta_mask_ = static_cast<uint32_t>(n);
+		header->payload_len_ = 0;
+		for (size_t i = 0; i < header->columns_; ++i) {
+			if (!readVarInt(ptr, limit, &n)) {
+				return false;
+			}
+			header->column_len_[i] = static_cast<size_t>(n);
+			header->payload_len_ += header->column_len_[i];
+		}
+		check(header->payload_len_ <= header->len_);
+		return true;
+	}
+
+	static bool parseNumber(const uint8_t* ptr, size_t len, uint64_t* value) {
+		if (len == 0 || len > kMaxNumberLength || (ptr[0] == '0' && len > 1)) {
+			return false;
+		}
+		uint64_t n = 0;
+		for (size_t i = 0; i < len; ++i) {
+			const uint32_t digit = static_cast<uint32_t>(ptr[i]) - '0';
+			if (digit > 9) {
+				return false;
+			}
+			n = n * 10 + digit;
+		}
+		*value = n;
+		return true;
+	}
+	static size_t writeNumber(uint8_t* out, int64_t n) {
+		uint8_t digits[24];
+		size_t count = 0, pos = 0;
+		if (n < 0) {
+			out[pos++] = '-';
+		}
+		uint64_t u = n < 0 ? static_cast<uint64_t>(-n) : static_cast<uint64_t>(n);
+		do {
+			digits[count++] = static_cast<uint8_t>('0' + u % 10);
+			u /= 10;
+		} while (u != 0);
+		while (count != 0) {
+			out[pos++] = digits[--count];
+		}
+		return pos;
+	}
+	static size_t numberLength(int64_t n) {
+		uint8_t buffer[24];
+		return writeNumber(buffer, n);
+	}
+
+	// Returns the encoded size, at most the header plus the line bytes.
+	size_t encodeChunk(uint8_t* out, const uint8_t* in, size_t len, uint8_t delim, size_t columns) {
+		for (size_t i = 0; i < columns; ++i) {
+			fields_[i].clear();
+		}
+		Field field;
+		field.start_ = 0;
+		size_t column = 0;
+		for (size_t i = 0; i < len; ++i) {
+			const uint8_t c = in[i];
+			if (c == '\n' || (c == delim && column + 1 < columns)) {
+				field.len_ = static_cast<uint32_t>(i - field.start_);
+				// Line goes on, or ends in a column before the last.
+				field.end_ = c == delim || column + 1 == columns ? '\n' : delim;
+				fields_[column].push_back(field);
+				column = c == '\n' ? 0 : column + 1;
+				field.start_ = static_cast<uint32_t>(i + 1);
+			}
+		}
+		// Delta columns only if every field is a number and the differences are shorter.
+		uint32_t delta_mask = 0;
+		for (size_t i = 0; i < columns; ++i) {
+			size_t raw_len = 0, delta_len = 0;
+			uint64_t prev = prev_[i], value = 0;
+			bool numeric = !fields_[i].empty();
+			for (const Field& f : fields_[i]) {
+				if (!parseNumber(in + f.start_, f.len_, &value)) {
+					numeric = false;
+					break;
+				}
+				raw_len += f.len_;
+				delta_len += numberLength(static_cast<int64_t>(value - prev));
+				prev = value;
+			}
+			if (numeric && delta_len < raw_len) {
+				delta_mask |= 1u << i;
+			}
+		}
+		size_t pos = 0;
+		out[pos++] = kChunkColumns;
+		pos += writeVarInt(out + pos, len);
+		out[pos++] = delim;
+		out[pos++] = static_cast<uint8_t>(columns);
+		pos += writeVarInt(out + pos, delta_mask);
+		// The column lengths go first, the columns are built on the side.
+		size_t data_pos = 0;
+		uint8_t* data = column_buffer_;
+		for (size_t i = 0; i < columns; ++i) {
+			const size_t start = data_pos;
+			for (const Field& f : fields_[i]) {
+				if ((delta_mask >> i) & 1) {
+					uint64_t value = 0;
+					parseNumber(in + f.start_, f.len_, &value);
+					data_pos += writeNumber(data + data_pos, static_cast<int64_t>(value - prev_[i]));
+					prev_[i] = value;
+				} else {
+					std::copy(in + f.start_, in + f.start_ + f.len_, data + data_pos);
+					data_pos += f.len_;
+				}
+				data[data_pos++] = f.end_;
+			}
+			pos += writeVarInt(out + pos, data_pos - start);
+		}
+		dcheck(data_pos <= len);
+		std::copy(data, data + data_pos, out + pos);
+		return pos + data_pos;
+	}
+
+	void decodeChunk(uint8_t* out, const uint8_t* in, const ChunkHeader& header) {
+		const uint8_t* ptrs[kMaxColumns] = {};
+		const uint8_t* limits[kMaxColumns] = {};
+		for (size_t i = 0; i < header.columns_; ++i) {
+			ptrs[i] = i == 0 ? in : limits[i - 1];
+			limits[i] = ptrs[i] + header.column_len_[i];
+		}
+		const size_t last = header.columns_ - 1;
+		size_t pos = 0;
+		while (ptrs[0] < limits[0]) {
+			for (size_t column = 0; ; ++column) {
+				check(column <= last);
+				const uint8_t*& ptr = ptrs[column];
+				const uint8_t* start = ptr;
+				while (ptr < limits[column] && *ptr != '\n' && (column == last || *ptr != header.delim_)) {
+					++ptr;
+				}
+				check(ptr < limits[column]);
+				const size_t len = ptr - start;
+				const uint8_t end = *ptr++;
+				if ((header.delta_mask_ >> column) & 1) {
+					const bool neg = len != 0 && start[0] == '-';
+					uint64_t delta = 0;
+					check(parseNumber(start + neg, len - neg, &delta));
+					prev_[column] += neg ? 0 - delta : delta;
+					uint8_t number[24];
+					const size_t number_len = writeNumber(number, static_cast<int64_t>(prev_[column]));
+					check(pos + number_len + 1 <= header.len_);
+					std::copy(number, number + number_len, out + pos);
+					pos += number_len;
+				} else {
+					check(pos + len + 1 <= header.len_);
+					std::copy(start, ptr - 1, out + pos);
+					pos += len;
+				}
+				if (column == last || end == header.delim_) {
+					out[pos++] = '\n';
+					break;
+				}
+				out[pos++] = header.delim_;
+			}
+		}
+		for (size_t i = 0; i < header.columns_; ++i) {
+			check(ptrs[i] == limits[i]);
+		}
+		check(pos == header.len_);
+	}
+
+	// Last number of each column, carried over from chunk to chunk.
+	uint64_t prev_[kMaxColumns];
+	std::vector<Field> fields_[kMaxColumns];
+	uint8_t column_buffer_[kChunkSize];
+	size_t column_chunks_;
+	size_t raw_chunks_;
+};
+
+#endif
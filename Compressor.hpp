@@ -99,6 +99,7 @@ public:
 		kTypeCMMid,
 		kTypeCMHigh,
 		kTypeCMMax,
+		kTypeImage,
 	};
 
 	class Factory {
@@ -121,6 +122,10 @@ public:
 	}
 	virtual void setMemUsage(uint32_t level) {
 	}
+	// Reads back the bytes passed to the compressor by position, for models that look further back than their
+	// memory. The decompressor needs one that reads back the same bytes.
+	virtual void setHistory(Stream* history) {
+	}
 	virtual bool failed() {
 		return false;
 	}
@@ -25,19 +25,31 @@
 #define _SLIDING_WINDOW_HPP_
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include "Util.hpp"
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 template <typename T>
 class CyclicBuffer {
 protected:
 	size_t pos_, mask_, alloc_size_;
 	T *storage_, *data_;
+	// The storage is the same pages mapped three times in a row, data_ points to the middle copy.
+	bool mirrored_;
 public:
 
 	forceinline size_t getPos() const {return pos_;}
 	forceinline size_t getMask() const {return mask_;}
 	forceinline T* getData() { return data_; }
+	// If mirrored, data_[-size, 2 * size) is valid and any window of up to size elements is contiguous.
+	forceinline bool isMirrored() const { return mirrored_; }
 
 	inline size_t prev(size_t pos, size_t count) const {
 		// Relies on integer underflow behavior. Works since pow 2 size.
@@ -53,7 +65,7 @@ public:
 		return mask_ + 1;
 	}
 
-	CyclicBuffer() : storage_(nullptr), mask_(0) {
+	CyclicBuffer() : storage_(nullptr), mask_(0), mirrored_(false) {
 	}
 
 	virtual ~CyclicBuffer() {
@@ -79,18 +91,71 @@ public:
 	}
 
 	virtual void release() {
+		if (mirrored_) {
+#ifdef __linux__
+			munmap(storage_, alloc_size_ * sizeof(T));
+#endif
+		} else {
+			delete [] storage_;
+		}
 		pos_ = alloc_size_ = 0;
 		mask_ = static_cast<size_t>(-1);
-		delete [] storage_;
 		storage_ = data_ = nullptr;
+		mirrored_ = false;
 	}
 
 	void fill(T d) {
 		std::fill(storage_, storage_ + getSize(), d);
 	}
 
+	// Match length between the bytes starting at positions a and b, handles wraparound.
+	size_t matchLength(size_t a, size_t b, size_t max_len) const {
+		if (mirrored_ && max_len <= getSize()) {
+			return ::matchLength(data_ + (a & mask_), data_ + (b & mask_), max_len);
+		}
+		size_t len = 0;
+		while (len < max_len) {
+			a &= mask_;
+			b &= mask_;
+			const size_t run = std::min(max_len - len, getSize() - std::max(a, b));
+			const size_t cur = ::matchLength(data_ + a, data_ + b, run);
+			len += cur;
+			if (cur < run) {
+				break;
+			}
+			a += run;
+			b += run;
+		}
+		return len;
+	}
+
+	// Match length between the bytes before positions a and b, handles wraparound.
+	size_t reverseMatchLength(size_t a, size_t b, size_t max_len) const {
+		if (mirrored_ && max_len <= getSize()) {
+			return ::reverseMatchLength(data_ + ((a - 1) & mask_) + 1, data_ + ((b - 1) & mask_) + 1, max_len);
+		}
+		size_t len = 0;
+		while (len < max_len) {
+			// Keep a and b in [1, size] so the bytes before them are in the buffer.
+			a = ((a - 1) & mask_) + 1;
+			b = ((b - 1) & mask_) + 1;
+			const size_t run = std::min(max_len - len, std::min(a, b));
+			const size_t cur = ::reverseMatchLength(data_ + a, data_ + b, run);
+			len += cur;
+			if (cur < run) {
+				break;
+			}
+			a -= run;
+			b -= run;
+		}
+		return len;
+	}
+
 	// Can be used for LZ77.
 	void copyStartToEndOfBuffer(size_t count) {
+		if (mirrored_) {
+			return;
+		}
 		size_t size = getSize();
 		for (size_t i = 0 ;i < count ;++i) {
 			data_[size + i] = data_[i];
@@ -99,6 +164,9 @@ public:
 
 	// Can be used for LZ77.
 	void copyEndToStartOfBuffer(size_t count) {
+		if (mirrored_) {
+			return;
+		}
 		size_t size = getSize();
 		for (size_t i = 0;i < count;++i) {
 			storage_[i] = storage_[i + size];
@@ -108,13 +176,66 @@ public:
 	void resize(size_t new_size, size_t padding = sizeof(uint32_t)) {
 		// Ensure power of 2.
 		assert((new_size & (new_size - 1)) == 0);
-		delete [] storage_;
+		release();
 		mask_ = new_size - 1;
 		alloc_size_ = new_size + padding * 2;
 		storage_ = new T[alloc_size_]();
 		data_ = storage_ + padding;
 		restart();
 	}
+
+	// Double mapped ring buffer, wraparound is handled by the MMU so matches and copies can use plain
+	// pointers. Falls back to resize if the platform or size does not allow it, the contents are the same
+	// either way so the compressed format does not depend on it.
+	void resizeMirrored(size_t new_size, size_t padding = sizeof(uint32_t)) {
+		assert((new_size & (new_size - 1)) == 0);
+		release();
+		if (!mapMirrored(new_size)) {
+			resize(new_size, padding);
+		}
+	}
+
+private:
+	bool mapMirrored(size_t new_size) {
+#if defined(__linux__) && defined(SYS_memfd_create)
+		const size_t bytes = new_size * sizeof(T);
+		if (bytes % static_cast<size_t>(sysconf(_SC_PAGESIZE)) != 0) {
+			return false;
+		}
+		const int fd = static_cast<int>(syscall(SYS_memfd_create, "mcm_buffer", 0));
+		if (fd < 0) {
+			return false;
+		}
+		if (ftruncate(fd, bytes) != 0) {
+			close(fd);
+			return false;
+		}
+		// Reserve the address space first so that the three mappings are adjacent.
+		byte* base = reinterpret_cast<byte*>(mmap(nullptr, 3 * bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (base == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+		for (size_t i = 0; i < 3; ++i) {
+			if (mmap(base + i * bytes, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+				munmap(base, 3 * bytes);
+				close(fd);
+				return false;
+			}
+		}
+		// The mappings keep the file alive.
+		close(fd);
+		mask_ = new_size - 1;
+		alloc_size_ = 3 * new_size;
+		storage_ = reinterpret_cast<T*>(base);
+		data_ = storage_ + new_size;
+		mirrored_ = true;
+		restart();
+		return true;
+#else
+		return false;
+#endif
+	}
 };
 
 template <typename T>
@@ -137,6 +258,32 @@ public:
 		++size_;
 		this->push(c);
 	}
+	// Bulk versions, at most two copies.
+	void push_back(const T* data, size_t count) {
+		assert(size_ + count <= capacity());
+		const size_t pos = this->pos_ & this->mask_;
+		const size_t first = std::min(count, capacity() - pos);
+		std::memcpy(this->data_ + pos, data, first * sizeof(T));
+		std::memcpy(this->data_, data + first, (count - first) * sizeof(T));
+		this->pos_ += count;
+		size_ += count;
+	}
+	void pop_front(T* out, size_t count) {
+		dcheck(size_ >= count);
+		const size_t pos = front_pos_ & this->mask_;
+		const size_t first = std::min(count, capacity() - pos);
+		std::memcpy(out, this->data_ + pos, first * sizeof(T));
+		std::memcpy(out + first, this->data_, (count - first) * sizeof(T));
+		pop_front(count);
+	}
+	// Pointer to count elements starting at offset if they are contiguous in memory, otherwise nullptr.
+	forceinline const T* contiguous(size_t offset, size_t count) const {
+		const size_t pos = (front_pos_ + offset) & this->mask_;
+		if (this->mirrored_ ? count > capacity() : pos + count > capacity()) {
+			return nullptr;
+		}
+		return this->data_ + pos;
+	}
 	forceinline T front() const {
 		return this->data_[front_pos_ & this->mask_];
 	}
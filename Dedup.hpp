@@ -0,0 +1,255 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DEDUP_HPP_
+#define _DEDUP_HPP_
+
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "Stream.hpp"
+#include "Util.hpp"
+
+// Content defined chunking deduplication. Chunk boundaries come from a gear hash so that they survive
+// insertions, repeated chunks are replaced by references to their first occurrence.
+class Dedup {
+public:
+	static const size_t kMinChunk = 2 * KB;
+	static const size_t kMaxChunk = 64 * KB;
+	// Average chunk size is about kMinChunk + 2^kAvgBits.
+	static const size_t kAvgBits = 13;
+
+	class Hash128 {
+	public:
+		uint64_t h1_, h2_;
+		bool operator==(const Hash128& other) const {
+			return h1_ == other.h1_ && h2_ == other.h2_;
+		}
+	};
+
+	class Hash128Hasher {
+	public:
+		size_t operator()(const Hash128& h) const {
+			return static_cast<size_t>(h.h1_);
+		}
+	};
+
+	// Bytes [dst, dst + length) are a copy of [src, src + length), src + length <= dst.
+	class Ref {
+	public:
+		uint64_t dst_, src_, length_;
+	};
+	typedef std::vector<Ref> Refs;
+
+	Dedup() {
+		// Fixed seed, the table only affects where boundaries are.
+		uint64_t s = 0x9E3779B97F4A7C15ULL;
+		for (auto& g : gear_) {
+			s ^= s << 13;
+			s ^= s >> 7;
+			s ^= s << 17;
+			g = s;
+		}
+	}
+
+	// Murmur3 style 128 bit hash.
+	static Hash128 hash128(const byte* data, size_t n) {
+		uint64_t h1 = n, h2 = n;
+		const byte* limit = data + (n & ~static_cast<size_t>(15));
+		for (; data < limit; data += 16) {
+			uint64_t k1, k2;
+			memcpy(&k1, data, sizeof(k1));
+			memcpy(&k2, data + 8, sizeof(k2));
+			mixBlock(h1, h2, k1, k2);
+			h1 = rotl64(h1, 27) + h2;
+			h1 = h1 * 5 + 0x52DCE729;
+			h2 = rotl64(h2, 31) + h1;
+			h2 = h2 * 5 + 0x38495AB5;
+		}
+		byte tail[16] = {};
+		memcpy(tail, data, n & 15);
+		uint64_t k1, k2;
+		memcpy(&k1, tail, sizeof(k1));
+		memcpy(&k2, tail + 8, sizeof(k2));
+		mixBlock(h1, h2, k1, k2);
+		h1 += h2;
+		h2 += h1;
+		h1 = fmix64(h1);
+		h2 = fmix64(h2);
+		Hash128 ret;
+		ret.h1_ = h1 + h2;
+		ret.h2_ = h2 + ret.h1_;
+		return ret;
+	}
+
+	// Chunk the stream from its current position to the end and record repeated chunks. The stream needs readat
+	// since repeats are compared with their source bytes.
+	void findDuplicates(Stream* in) {
+		refs_.clear();
+		const uint64_t base = in->tell();
+		ReadAtStream reader(in, base);
+		std::unordered_map<Hash128, uint64_t, Hash128Hasher> seen;
+		std::vector<byte> buffer(kMaxChunk * 4);
+		std::vector<byte> chunk, src_chunk;
+		chunk.reserve(kMaxChunk);
+		src_chunk.resize(kMaxChunk);
+		uint64_t pos = 0, h = 0;
+		for (;;) {
+			const size_t count = reader.read(&buffer[0], buffer.size());
+			if (count == 0) {
+				break;
+			}
+			for (size_t i = 0; i < count; ++i) {
+				const byte c = buffer[i];
+				chunk.push_back(c);
+				h = (h << 1) + gear_[c];
+				if ((chunk.size() >= kMinChunk && (h >> (64 - kAvgBits)) == 0) || chunk.size() == kMaxChunk) {
+					addChunk(in, base, seen, pos, chunk, &src_chunk);
+					pos += chunk.size();
+					chunk.clear();
+					h = 0;
+				}
+			}
+		}
+		if (!chunk.empty()) {
+			addChunk(in, base, seen, pos, chunk, &src_chunk);
+		}
+	}
+
+	const Refs& getRefs() const {
+		return refs_;
+	}
+
+	Refs& getRefs() {
+		return refs_;
+	}
+
+	uint64_t dedupedBytes() const {
+		uint64_t total = 0;
+		for (const auto& ref : refs_) {
+			total += ref.length_;
+		}
+		return total;
+	}
+
+	// Refs are sorted by dst, offsets are stored as deltas.
+	void write(Stream* stream) const {
+		stream->leb128Encode(refs_.size());
+		uint64_t last = 0;
+		for (const auto& ref : refs_) {
+			stream->leb128Encode(ref.dst_ - last);
+			stream->leb128Encode(ref.dst_ - ref.src_);
+			stream->leb128Encode(ref.length_);
+			last = ref.dst_ + ref.length_;
+		}
+	}
+
+	void read(Stream* stream) {
+		const size_t count = static_cast<size_t>(stream->leb128Decode());
+		refs_.resize(count);
+		uint64_t last = 0;
+		for (auto& ref : refs_) {
+			ref.dst_ = last + stream->leb128Decode();
+			ref.src_ = ref.dst_ - stream->leb128Decode();
+			ref.length_ = stream->leb128Decode();
+			check(ref.src_ + ref.length_ <= ref.dst_);
+			last = ref.dst_ + ref.length_;
+		}
+	}
+
+	// Copy the referenced bytes once everything else has been written, sources are never references.
+	void restore(Stream* out) const {
+		std::vector<byte> buffer(kMaxChunk);
+		for (const auto& ref : refs_) {
+			for (uint64_t i = 0; i < ref.length_; ) {
+				const size_t count = static_cast<size_t>(std::min(static_cast<uint64_t>(buffer.size()), ref.length_ - i));
+				out->seek(ref.src_ + i);
+				check(out->read(&buffer[0], count) == count);
+				out->seek(ref.dst_ + i);
+				out->write(&buffer[0], count);
+				i += count;
+			}
+		}
+	}
+
+private:
+	uint64_t gear_[256];
+	Refs refs_;
+
+	static forceinline uint64_t rotl64(uint64_t x, uint32_t bits) {
+		return (x << bits) | (x >> (64 - bits));
+	}
+
+	static forceinline uint64_t fmix64(uint64_t k) {
+		k ^= k >> 33;
+		k *= 0xFF51AFD7ED558CCDULL;
+		k ^= k >> 33;
+		k *= 0xC4CEB9FE1A85EC53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+
+	static forceinline void mixBlock(uint64_t& h1, uint64_t& h2, uint64_t k1, uint64_t k2) {
+		static const uint64_t c1 = 0x87C37B91114253D5ULL, c2 = 0x4CF5AD432745937FULL;
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+	}
+
+	void addChunk(Stream* in, uint64_t base, std::unordered_map<Hash128, uint64_t, Hash128Hasher>& seen, uint64_t pos,
+		const std::vector<byte>& chunk, std::vector<byte>* src_chunk) {
+		// The length is part of the hash.
+		const Hash128 h = hash128(&chunk[0], chunk.size());
+		auto it = seen.find(h);
+		if (it == seen.end()) {
+			seen.insert(std::make_pair(h, pos));
+			return;
+		}
+		const uint64_t src = it->second;
+		// The hash is not collision resistant, a crafted chunk could match it with other bytes.
+		if (in->readat(base + src, &(*src_chunk)[0], chunk.size()) != chunk.size() ||
+			memcmp(&(*src_chunk)[0], &chunk[0], chunk.size()) != 0) {
+			return;
+		}
+		if (!refs_.empty()) {
+			auto& last = refs_.back();
+			if (last.dst_ + last.length_ == pos && last.src_ + last.length_ == src) {
+				last.length_ += chunk.size();
+				return;
+			}
+		}
+		Ref ref;
+		ref.dst_ = pos;
+		ref.src_ = src;
+		ref.length_ = chunk.size();
+		refs_.push_back(ref);
+	}
+};
+
+#endif
@@ -24,12 +24,23 @@
 #ifndef _DETECTOR_HPP_
 #define _DETECTOR_HPP_
 
-#include <fstream>
+#include <algorithm>
 #include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <thread>
 
+#include "ColumnFilter.hpp"
 #include "CyclicBuffer.hpp"
 #include "Dict.hpp"
+#include "Entropy.hpp"
+#include "FloatFilter.hpp"
+#include "RecordFilter.hpp"
 #include "Stream.hpp"
+#include "UTF16Filter.hpp"
 #include "UTF8.hpp"
 #include "Util.hpp"
 
@@ -37,10 +48,6 @@
 class Detector {
 	bool is_forbidden[256]; // Chars which don't appear in text often.
 	
-	// MZ pattern, todo replace with better detection.
-	typedef std::vector<byte> Pattern;
-	Pattern exe_pattern;
-
 	// Lookahed.
 	CyclicDeque<uint8_t> buffer_;
 
@@ -53,12 +60,91 @@ class Detector {
 
 	// Opt var
 	size_t opt_var_;
+
+	// Smaller tails at the end of the stream are not checked.
+	static const size_t kMinEntropyWindow = 4 * KB;
+	// Thresholds in bits per byte, lower if a compressed container was seen.
+	static const size_t kCostShift = 8;
+	static const uint32_t kMinOrder0Bits = 7900;
+	static const uint32_t kMinOrder0BitsContainer = 7600;
+	static const uint32_t kMinOrder1Bits = 7950;
+	static const uint32_t kMinOrder1BitsContainer = 7800;
+	SymbolCostTable<12, kCostShift> cost_table_;
+	std::vector<uint16_t> order1_probs_;
+	// Bytes popped so far, and the end of the last window which was not incompressible.
+	uint64_t pos_;
+	uint64_t checked_end_;
+	// Saw the signature of a compressed format (jpeg, zip, gzip, ...).
+	bool container_hint_;
+	// Code sections of the executables found so far, sorted [start, end) stream offsets.
+	typedef std::vector<std::pair<uint64_t, uint64_t>> CodeRanges;
+	CodeRanges code_ranges_;
+	// Executable and raster headers were searched for up to here.
+	uint64_t exe_checked_end_;
+	// End of the last executable image, the data in images is not checked for records.
+	uint64_t image_end_;
+	// Pixel data of the rasters found so far, sorted by start stream offset.
+	class RasterRange {
+	public:
+		uint64_t begin_;
+		uint64_t end_;
+		uint32_t layout_;
+
+		bool operator==(const RasterRange& other) const {
+			return begin_ == other.begin_ && end_ == other.end_ && layout_ == other.layout_;
+		}
+	};
+	typedef std::vector<RasterRange> RasterRanges;
+	RasterRanges raster_ranges_;
+	// Raster headers are parsed from this many bytes, smaller rasters are left to the normal detection.
+	static const size_t kRasterHeaderWindow = 4 * KB;
+	static const uint64_t kMinRasterSize = 8 * KB;
+	static const uint64_t kMaxRasterDim = 1u << 16;
+	// Headers and section tables are only read this far from the start of the image so that the result
+	// doesn't depend on how much is buffered.
+	static const size_t kExeHeaderWindow = 128 * KB;
+	// Offsets past this are not trusted.
+	static const uint64_t kMaxImageSize = 1 * GB;
+	// Sections closer than this are merged, smaller ones are left to the normal detection.
+	static const uint64_t kMaxCodeGap = 256;
+	static const uint64_t kMinCodeSize = 1 * KB;
+	// Binary blocks at least this big are checked for fixed size records, using up to kRecordSample bytes.
+	static const size_t kMinRecordBlock = 4 * KB;
+	static const size_t kRecordSample = 16 * KB;
+	// Float arrays have nearly all of their values in this many exponents.
+	static const size_t kFloatExponents = 16;
+	static const size_t kMinFloatValues = 256;
+	// Exponents this far from the bias are counted as not being floats, integers have them near 0.
+	static const uint32_t kFloatExponentRange = 64;
+	static const uint32_t kDoubleExponentRange = 256;
+	// UTF-16 text without a byte order mark needs most of the first kUTF16Sample code units to be ASCII, half of
+	// them letters or spaces and a few spaces. Shorter runs than kMinUTF16Size bytes stay binary.
+	static const size_t kUTF16Sample = 64;
+	static const size_t kMinUTF16Size = 256;
+	// Text blocks are checked for columns on the whole lines in the first kLineSample bytes.
+	static const size_t kLineSample = 16 * KB;
 public:
+	// Incompressible data is checked one window at a time, windows are aligned to stream offsets.
+	static const size_t kEntropyWindow = 64 * KB;
 	// Pre-detected.
 	enum Profile {
 		kProfileText,
 		kProfileBinary,
-		kProfileWave16,
+		kProfileWave,
+		// High entropy data, not worth modelling.
+		kProfileIncompressible,
+		// Code sections of executables, found from the headers.
+		kProfileCode,
+		// Arrays of fixed size records, the block has the record size.
+		kProfileRecord,
+		// Text lines split into fields at a delimiter.
+		kProfileColumns,
+		// Arrays of floats or doubles, the block has the value size.
+		kProfileFloat,
+		// Pixel data of uncompressed rasters, the block has the layout.
+		kProfileImage,
+		// UTF-16 text, the block has the byte order.
+		kProfileUTF16,
 		kProfileEOF,
 		kProfileCount,
 		// Not a real profile, tells CM to use streaming detection.
@@ -67,8 +153,8 @@ public:
 
 	class DetectedBlock {
 	public:
-		DetectedBlock(Profile profile = kProfileBinary, uint32_t length = 0)
-			: profile_(profile), length_(length) {
+		DetectedBlock(Profile profile = kProfileBinary, uint32_t length = 0, uint32_t stride = 0)
+			: profile_(profile), length_(length), stride_(stride) {
 		}
 		DetectedBlock(const DetectedBlock& other) {
 			*this = other;
@@ -76,6 +162,7 @@ public:
 		DetectedBlock& operator=(const DetectedBlock& other) {
 			profile_ = other.profile_;
 			length_ = other.length_;
+			stride_ = other.stride_;
 			return *this;
 		}
 
@@ -105,6 +192,8 @@ public:
 			const auto* orig_ptr = ptr;
 			auto c = *(ptr++);
 			profile_ = static_cast<Profile>(c & kDataProfileMask);
+			// Not stored, only used when compressing.
+			stride_ = 0;
 			auto length_bytes = getLengthBytes(c);
 			length_ = 0;
 			for (size_t i = 0; i < length_bytes; ++i) {
@@ -116,6 +205,11 @@ public:
 		Profile profile() const {
 			return profile_;
 		}
+		// Record size of record blocks, value size of float blocks, imageLayout of image blocks and waveLayout of wave
+		// blocks.
+		uint32_t stride() const {
+			return stride_;
+		}
 		uint64_t length() const {
 			return length_;
 		}
@@ -136,17 +230,51 @@ public:
 		static const size_t kDataProfileMask = (1u << kLengthBytesShift) - 1;
 		Profile profile_;
 		uint64_t length_;
+		uint32_t stride_;
 	};
 
 	static std::string profileToString(Profile profile) {
 		switch (profile) {
 		case kProfileBinary: return "binary";
 		case kProfileText: return "text";
-		case kProfileWave16: return "wav16";
+		case kProfileWave: return "wav";
+		case kProfileIncompressible: return "incompressible";
+		case kProfileCode: return "code";
+		case kProfileRecord: return "record";
+		case kProfileColumns: return "columns";
+		case kProfileFloat: return "float";
+		case kProfileImage: return "image";
+		case kProfileUTF16: return "utf16";
 		}
 		return "unknown";
 	}
 
+	// Image blocks keep the row size and the pixel size in bytes in the stride, the height is the number of rows
+	// in the block.
+	static const size_t kMaxPixelBytes = 4;
+	static uint32_t imageLayout(size_t row_bytes, size_t pixel_bytes) {
+		return static_cast<uint32_t>(row_bytes * kMaxPixelBytes + pixel_bytes - 1);
+	}
+	static size_t imageRowBytes(uint32_t layout) {
+		return layout / kMaxPixelBytes;
+	}
+	static size_t imagePixelBytes(uint32_t layout) {
+		return layout % kMaxPixelBytes + 1;
+	}
+
+	// Wave blocks keep the sample size in bytes and the channel count in the stride.
+	static const size_t kMaxSampleBytes = 3;
+	static const size_t kMaxWaveChannels = 2;
+	static uint32_t waveLayout(size_t sample_bytes, size_t channels) {
+		return static_cast<uint32_t>(sample_bytes * kMaxWaveChannels + channels - 1);
+	}
+	static size_t waveSampleBytes(uint32_t layout) {
+		return layout / kMaxWaveChannels;
+	}
+	static size_t waveChannels(uint32_t layout) {
+		return layout % kMaxWaveChannels + 1;
+	}
+
 	// std::vector<DetectedBlock> detected_blocks_;
 	DetectedBlock current_block_;
 
@@ -164,15 +292,72 @@ public:
 
 	// Last things.
 	uint32_t last_word_;
+	// Byte order of the UTF-16 block right before pos_, 0 after other blocks.
+	uint32_t utf16_order_;
+	// Record size of the last block if it was records, 0 otherwise.
+	uint32_t record_stride_;
 public:
 
-	Detector(Stream* stream) : stream_(stream), opt_var_(0), last_word_(0) {
+	Detector(Stream* stream)
+		: stream_(stream), opt_var_(0), pos_(0), checked_end_(0), container_hint_(false), exe_checked_end_(0), image_end_(0), last_word_(0),
+		utf16_order_(0), record_stride_(0) {
 	}
 
 	void setOptVar(size_t var) {
 		opt_var_ = var;
 	}
 
+	// Everything detectBlock depends on besides the data. Two detectors with the same state at the same
+	// offset detect the same blocks from there on.
+	class State {
+	public:
+		uint64_t pos_;
+		uint64_t checked_end_;
+		uint32_t last_word_;
+		uint32_t utf16_order_;
+		uint32_t record_stride_;
+		bool container_hint_;
+		bool has_saved_blocks_;
+		uint64_t exe_checked_end_;
+		uint64_t image_end_;
+		CodeRanges code_ranges_;
+		RasterRanges raster_ranges_;
+
+		bool operator==(const State& other) const {
+			return pos_ == other.pos_ && checked_end_ == other.checked_end_ && last_word_ == other.last_word_ &&
+				utf16_order_ == other.utf16_order_ && record_stride_ == other.record_stride_ &&
+				container_hint_ == other.container_hint_ &&
+				!has_saved_blocks_ && !other.has_saved_blocks_ &&
+				exe_checked_end_ == other.exe_checked_end_ && image_end_ == other.image_end_ &&
+				code_ranges_ == other.code_ranges_ && raster_ranges_ == other.raster_ranges_;
+		}
+	};
+
+	State getState() const {
+		State state;
+		state.pos_ = pos_;
+		// Any expired window means the next one gets checked.
+		state.checked_end_ = std::max(checked_end_, pos_);
+		state.last_word_ = last_word_;
+		state.utf16_order_ = utf16_order_;
+		state.record_stride_ = record_stride_;
+		state.container_hint_ = container_hint_;
+		state.has_saved_blocks_ = !saved_blocks_.empty();
+		state.exe_checked_end_ = std::max(exe_checked_end_, pos_);
+		state.image_end_ = std::max(image_end_, pos_);
+		state.code_ranges_ = code_ranges_;
+		state.raster_ranges_ = raster_ranges_;
+		return state;
+	}
+
+	// Start detecting at offset pos of the stream, last_word holds the bytes before it. Call after init.
+	void initRegion(uint64_t pos, uint32_t last_word) {
+		pos_ = checked_end_ = exe_checked_end_ = image_end_ = pos;
+		last_word_ = last_word;
+		utf16_order_ = 0;
+		record_stride_ = 0;
+	}
+
 	void init() {
 		overhead_bytes_ = 0;
 		small_len_ = 0;
@@ -191,23 +376,26 @@ public:
 			29, 30, 31
 		};
 		for (auto c : forbidden_arr) is_forbidden[c] = true;
+		for (size_t c = 0; c < 0x20; ++c) {
+			// The vectorized scan hard codes the allowed control chars.
+			dcheck(is_forbidden[c] != (c == '\t' || c == '\n' || c == '\r' || c == 18));
+		}
 		
-		buffer_.resize(256 * KB);
-		// Exe pattern
-		byte p[] = {0x4D, 0x5A, 0x90, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0xFF, 0xFF,};
-		exe_pattern.clear();
-		for (auto& c : p) exe_pattern.push_back(c);
+		buffer_.resizeMirrored(256 * KB);
+		order1_probs_.resize(16 * 256);
+		pos_ = checked_end_ = exe_checked_end_ = image_end_ = 0;
+		container_hint_ = false;
+		code_ranges_.clear();
+		raster_ranges_.clear();
 	}
 
 	void refillRead() {
-		const size_t kBufferSize = 4 * KB;
+		const size_t kBufferSize = 16 * KB;
 		uint8_t buffer[kBufferSize];
 		for (;;) {
 			const size_t remain = buffer_.capacity() - buffer_.size();
 			const size_t n = stream_->read(buffer, std::min(kBufferSize, remain));
-			for (size_t i = 0; i < n; ++i) {
-				buffer_.push_back(buffer[i]);
-			}
+			buffer_.push_back(buffer, n);
 			if (n == 0 || remain == 0) break;
 		}
 	}
@@ -253,12 +441,13 @@ public:
 
 	void flush() {
 		// TODO: Optimize
-		BufferedStreamWriter<4 * KB> sout(stream_);
+		const size_t kBufferSize = 16 * KB;
+		uint8_t buffer[kBufferSize];
 		while (buffer_.size() != 0) {
-			sout.put(buffer_.front());
-			buffer_.pop_front();
+			const size_t n = std::min(kBufferSize, buffer_.size());
+			buffer_.pop_front(buffer, n);
+			stream_->write(buffer, n);
 		}
-		sout.flush();
 	}
 
 	forceinline uint32_t at(uint32_t index) const {
@@ -312,17 +501,53 @@ public:
 		}
 		auto ret = buffer_.front();
 		buffer_.pop_front();
+		++pos_;
 		return ret;
 	}
 	size_t read(uint8_t* out, size_t count) {
 		const auto n = std::min(count, buffer_.size());
-		for (size_t i = 0; i < n; ++i) {
-			out[i] = buffer_[i];
-		}
-		buffer_.pop_front(n);
+		buffer_.pop_front(out, n);
 		current_block_.pop(n);
+		pos_ += n;
 		return n;
 	}
+	// Drop up to count chars without detection, returns how many were dropped.
+	uint64_t skip(uint64_t count) {
+		uint64_t skipped = 0;
+		while (skipped < count) {
+			if (buffer_.empty()) {
+				refillRead();
+				if (buffer_.empty()) {
+					break;
+				}
+			}
+			const size_t n = static_cast<size_t>(std::min(count - skipped, static_cast<uint64_t>(buffer_.size())));
+			buffer_.pop_front(n);
+			pos_ += n;
+			skipped += n;
+		}
+		return skipped;
+	}
+	// Same as skip but the chars are passed to callback(data, n) in chunks.
+	template <typename Callback>
+	uint64_t skip(uint64_t count, Callback callback) {
+		uint8_t chunk[16 * KB];
+		uint64_t skipped = 0;
+		while (skipped < count) {
+			if (buffer_.empty()) {
+				refillRead();
+				if (buffer_.empty()) {
+					break;
+				}
+			}
+			const size_t n = static_cast<size_t>(std::min(count - skipped, static_cast<uint64_t>(std::min(buffer_.size(), sizeof(chunk)))));
+			buffer_.pop_front(chunk, n);
+			callback(chunk, n);
+			pos_ += n;
+			skipped += n;
+		}
+		return skipped;
+	}
 
 	void dumpInfo() {
 		std::cout << "Detector overhead " << formatNumber(overhead_bytes_) << " small=" << small_len_ <<std::endl;
@@ -339,6 +564,10 @@ public:
 			return ret;
 		}
 		refillRead();
+		const uint32_t last_utf16_order = utf16_order_;
+		utf16_order_ = 0;
+		const uint32_t last_record_stride = record_stride_;
+		record_stride_ = 0;
 		const size_t buffer_size = buffer_.size();
 		if (buffer_size == 0) {
 			return DetectedBlock(kProfileEOF, 0);
@@ -346,52 +575,102 @@ public:
 		if (false) {
 			return DetectedBlock(kProfileBinary, static_cast<uint32_t>(buffer_.size()));
 		}
+		findHeaders(std::min(buffer_size, kEntropyWindow));
+		while (!code_ranges_.empty() && code_ranges_.front().second <= pos_) {
+			code_ranges_.erase(code_ranges_.begin());
+		}
+		while (!raster_ranges_.empty() && raster_ranges_.front().begin_ < pos_) {
+			// Passed or cut by a code section, the rows would not line up anymore.
+			raster_ranges_.erase(raster_ranges_.begin());
+		}
+		// Code sections come from headers which may be truncated or corrupt, the data in them is still checked for
+		// incompressible windows, rasters and waves. Finding one ends the section.
+		const bool in_code = !code_ranges_.empty() && code_ranges_.front().first <= pos_;
+		if (!raster_ranges_.empty() && raster_ranges_.front().begin_ == pos_) {
+			const RasterRange r = raster_ranges_.front();
+			raster_ranges_.erase(raster_ranges_.begin());
+			if (in_code || code_ranges_.empty() || r.end_ <= code_ranges_.front().first) {
+				endCodeRange(in_code);
+				return DetectedBlock(kProfileImage, static_cast<uint32_t>(r.end_ - r.begin_), r.layout_);
+			}
+		}
+		// Other blocks stop where the next code section starts.
+		size_t limit = buffer_size;
+		if (!code_ranges_.empty() && !in_code) {
+			limit = static_cast<size_t>(std::min(static_cast<uint64_t>(limit), code_ranges_.front().first - pos_));
+		}
+		if (!raster_ranges_.empty()) {
+			limit = static_cast<size_t>(std::min(static_cast<uint64_t>(limit), raster_ranges_.front().begin_ - pos_));
+		}
+		if (pos_ >= checked_end_) {
+			const uint64_t window_end = (pos_ / kEntropyWindow + 1) * kEntropyWindow;
+			const size_t window = static_cast<size_t>(std::min(static_cast<uint64_t>(limit), window_end - pos_));
+			if (window >= kMinEntropyWindow && isIncompressible(window)) {
+				endCodeRange(in_code);
+				return DetectedBlock(kProfileIncompressible, static_cast<uint32_t>(window));
+			}
+			checked_end_ = pos_ + window;
+		}
+		if (in_code) {
+			const size_t len = static_cast<size_t>(std::min(code_ranges_.front().second - pos_,
+				static_cast<uint64_t>(std::min(limit, static_cast<size_t>(checked_end_ - pos_)))));
+			for (size_t i = 0; i + 4 <= len; ++i) {
+				if (buffer_[i] == 'R' && readBytes(i) == 0x52494646) {
+					DetectedBlock header;
+					if (i != 0) {
+						return DetectedBlock(kProfileCode, static_cast<uint32_t>(i));
+					}
+					refillRead();
+					if (parseWave(4, &header)) {
+						endCodeRange(in_code);
+						return header;
+					}
+				}
+			}
+			return DetectedBlock(kProfileCode, static_cast<uint32_t>(len));
+		}
+		// Stop at the end of the checked window so that the next one gets checked too.
+		const size_t scan_size = std::min(limit, static_cast<size_t>(checked_end_ - pos_));
+
+		// UTF-16 text cut at the end of the buffer goes on without a byte order mark or ASCII.
+		size_t utf16_len = 0;
+		uint32_t byte_order = last_utf16_order;
+		if (byte_order == 0 || !checkUTF16(0, limit, byte_order, &utf16_len, 2)) {
+			byte_order = detectUTF16(0, limit, &utf16_len);
+		}
+		if (byte_order != 0) {
+			utf16_order_ = byte_order;
+			return DetectedBlock(kProfileUTF16, static_cast<uint32_t>(utf16_len), byte_order);
+		}
 
 		size_t binary_len = 0;
-		while (binary_len < buffer_size) {
+		while (binary_len < scan_size) {
+			if (last_word_ != 0x52494646) {
+				// Each control char ends a text run right away.
+				const size_t count = runLength<false>(binary_len, scan_size - binary_len);
+				if (count != 0) {
+					updateLastWord(binary_len, count);
+					binary_len += count;
+					continue;
+				}
+			}
 			UTF8Decoder<true> decoder;
 			size_t text_len = 0;
-			while (binary_len + text_len < buffer_size) {
+			while (binary_len + text_len < scan_size) {
 				size_t pos = binary_len + text_len;
-				if (true && last_word_ == 0x52494646) {
+				if (last_word_ == 0x52494646) {
 					refillRead();
-					// This is pretty bad, need a clean way to do it.
-					uint32_t fpos = pos;
-					uint32_t chunk_size = readBytes(fpos, 4, false); fpos += 4;
-					uint32_t format = readBytes(fpos); fpos += 4;
-					// Format subchunk.
-					uint32_t subchunk_id = readBytes(fpos); fpos += 4;
-					if (format == 0x57415645 && subchunk_id == 0x666d7420) {
-						uint32_t subchunk_size = readBytes(fpos, 4, false); fpos += 4;
-						if (subchunk_size == 16 || subchunk_size == 18) {
-							uint32_t audio_format = readBytes(fpos, 2, false); fpos += 2;
-							uint32_t num_channels = readBytes(fpos, 2, false); fpos += 2;
-							if (audio_format == 1 && num_channels == 2) {
-								fpos += subchunk_size - 6;
-								// fpos += 4; // Skip: Sample rate
-								// fpos += 4; // Skip: Byte rate
-								// fpos += 2; // Skip: Block align
-								uint32_t bits_per_sample = readBytes(fpos, 2, false); fpos += 2;
-								for (size_t i = 0; i < 5; ++i) {
-									uint32_t subchunk2_id = readBytes(fpos, 4); fpos += 4;
-									uint32_t subchunk2_size = readBytes(fpos, 4, false); fpos += 4;
-									if (subchunk2_id == 0x64617461) {
-										if (subchunk2_size >= chunk_size) {
-											break;
-										}
-										saved_blocks_.push_back(DetectedBlock(kProfileWave16, chunk_size));
-										return DetectedBlock(kProfileBinary, fpos);
-										// Read wave header, TODO binary block as big as fpos?? Need to be able to queue subblocks then.
-										// profile_length = fpos + subchunk2_size;
-										// profile = kWave;
-										// return profile;
-									} else {
-										fpos += subchunk2_size;
-										if (fpos >= buffer_.size()) break;
-									}
-									}
-							}
-						} 
+					DetectedBlock header;
+					if (parseWave(pos, &header)) {
+						return header;
+					}
+				}
+				if (decoder.done() && !hasRTag(last_word_)) {
+					const size_t count = runLength<true>(pos, scan_size - pos);
+					if (count != 0) {
+						updateLastWord(pos, count);
+						text_len += count;
+						continue;
 					}
 				}
 				auto c = buffer_[pos];
@@ -404,21 +683,714 @@ public:
 			}
 			if (text_len > 146) {
 				if (binary_len == 0) {
-					return DetectedBlock(kProfileText, static_cast<uint32_t>(text_len));
+					return DetectedBlock(isColumns(text_len) ? kProfileColumns : kProfileText, static_cast<uint32_t>(text_len));
 				} else {
 					break;
 				}
 			} else {
+				// A char followed by a zero byte may start little endian UTF-16 text, or big endian text one byte earlier.
+				const size_t pos = binary_len + text_len;
+				if (text_len == 1 && pos < scan_size && buffer_[pos] == 0) {
+					size_t start = utf16Start(pos - 1, limit, last_utf16_order);
+					if (start != 0) {
+						return DetectedBlock(kProfileBinary, static_cast<uint32_t>(start));
+					}
+				}
 				binary_len += text_len;
-				if (binary_len >= buffer_size) {
+				if (binary_len >= scan_size) {
 					break;
 				}
 				++binary_len;
 			}
 		}
+		// Tables in executables do better with the rest of the binary data.
+		if (binary_len >= kMinRecordBlock && pos_ >= image_end_) {
+			const size_t stride = detectStride(binary_len);
+			// Records with more than one field do better with the record filter, records found from the start of the
+			// block have to be the floats. Arrays that start off a value are split first, the records there are likely
+			// the floats too, but records which go on from the last block stay records.
+			size_t phase = 0;
+			const size_t width = detectFloat(binary_len, &phase);
+			if (width != 0 && (stride == 0 || (stride == width && phase == 0) ||
+				(stride % width == 0 && phase != 0 && stride != last_record_stride))) {
+				// Float blocks start and end on a value so the solid block stays aligned. The end of the checked
+				// window need not be on one, the next block would start off the array.
+				if (phase != 0) {
+					return DetectedBlock(kProfileBinary, static_cast<uint32_t>(phase));
+				}
+				size_t len = binary_len + (width - binary_len % width) % width;
+				if (len > limit) {
+					len -= width;
+				}
+				return DetectedBlock(kProfileFloat, static_cast<uint32_t>(len), static_cast<uint32_t>(width));
+			}
+			if (stride != 0) {
+				record_stride_ = static_cast<uint32_t>(stride);
+				return DetectedBlock(kProfileRecord, static_cast<uint32_t>(binary_len), static_cast<uint32_t>(stride));
+			}
+		}
 		return DetectedBlock(kProfileBinary, static_cast<uint32_t>(binary_len));
 	}
 
+	// Byte order of the UTF-16 text at pos or 0, and its length in bytes up to limit. Text with a byte order mark is
+	// taken as it is, without one most of the first code units have to be ASCII, which has every other byte zero.
+	uint32_t detectUTF16(size_t pos, size_t limit, size_t* out_len = nullptr) {
+		const uint32_t bom = readBytes(pos, 2);
+		if (bom == 0xFFFE || bom == 0xFEFF) {
+			const uint32_t byte_order = bom == 0xFEFF ? UTF16Filter::kBigEndian : UTF16Filter::kLittleEndian;
+			return checkUTF16(pos, limit, byte_order, out_len, kMinUTF16Size) ? byte_order : 0;
+		}
+		if (pos + 2 * kUTF16Sample > limit) {
+			return 0;
+		}
+		for (uint32_t byte_order = UTF16Filter::kLittleEndian; byte_order <= UTF16Filter::kBigEndian; ++byte_order) {
+			const size_t zero = byte_order == UTF16Filter::kBigEndian ? 0 : 1;
+			size_t ascii = 0, letters = 0, spaces = 0;
+			for (size_t i = 0; i < kUTF16Sample && i - ascii <= kUTF16Sample / 8; ++i) {
+				const uint8_t c = buffer_[pos + 2 * i + 1 - zero];
+				if (buffer_[pos + 2 * i + zero] == 0 && c < 0x80 && !is_forbidden[c]) {
+					++ascii;
+					letters += isLowerCase(c) || isUpperCase(c);
+					spaces += c == ' ' || c == '\n';
+				}
+			}
+			// Tables of small values in binaries repeat the same few units and have no words.
+			if (ascii >= kUTF16Sample * 7 / 8 && letters + spaces >= kUTF16Sample / 2 && spaces >= kUTF16Sample / 32) {
+				return checkUTF16(pos, limit, byte_order, out_len, kMinUTF16Size) ? byte_order : 0;
+			}
+		}
+		return 0;
+	}
+
+	// Start of the UTF-16 text around the char at pos including its byte order mark, 0 if there is none. Both byte
+	// orders fit ASCII text next to a zero byte, the one of the text broken up right before goes first.
+	size_t utf16Start(size_t pos, size_t limit, uint32_t last_order) {
+		const uint32_t first = last_order == UTF16Filter::kBigEndian ? UTF16Filter::kBigEndian : UTF16Filter::kLittleEndian;
+		for (uint32_t byte_order : { first, UTF16Filter::kLittleEndian + UTF16Filter::kBigEndian - first }) {
+			// Big endian text has the zero byte first.
+			size_t start = pos - (byte_order == UTF16Filter::kBigEndian);
+			if (start != 0 && start <= pos && detectUTF16(start, limit) == byte_order) {
+				if (start >= 2 && readBytes(start - 2, 2) == (byte_order == UTF16Filter::kBigEndian ? 0xFEFFu : 0xFFFEu)) {
+					start -= 2;
+				}
+				return start;
+			}
+		}
+		return 0;
+	}
+
+	// Length of the run of text code units at pos, with the surrogates paired and no control chars other than
+	// white space. At least min_len bytes long.
+	bool checkUTF16(size_t pos, size_t limit, uint32_t byte_order, size_t* out_len, size_t min_len) {
+		const bool big_endian = byte_order == UTF16Filter::kBigEndian;
+		size_t i = pos;
+		while (i + 2 <= limit) {
+			const uint32_t c = readBytes(i, 2, big_endian);
+			if (c < 0x80 ? is_forbidden[c] : (c >= 0xDC00 && c < 0xE000) || c >= 0xFFFE) {
+				break;
+			}
+			if (c >= 0xD800 && c < 0xDC00) {
+				const uint32_t low = i + 4 <= limit ? readBytes(i + 2, 2, big_endian) : 0;
+				if (low < 0xDC00 || low >= 0xE000) {
+					break;
+				}
+				i += 2;
+			}
+			i += 2;
+		}
+		if (out_len != nullptr) {
+			*out_len = i - pos;
+		}
+		return i - pos >= min_len;
+	}
+
+	// The first n bytes of the buffer, copied to scratch if they wrap around and the buffer is not mirrored.
+	const byte* sample(size_t n, std::vector<byte>* scratch) const {
+		const byte* ptr = buffer_.contiguous(0, n);
+		if (ptr != nullptr) {
+			return ptr;
+		}
+		scratch->resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			(*scratch)[i] = buffer_[i];
+		}
+		return scratch->data();
+	}
+
+	// Values of float arrays have few distinct exponents near the bias. For each value size and alignment, the
+	// share of the values in the sample with one of the most common kFloatExponents exponents, zeros are not
+	// counted. Returns the value size of the best one if nearly all of the values have those, 0 otherwise.
+	size_t detectFloat(size_t len, size_t* out_phase) const {
+		const size_t n = std::min(len, kRecordSample);
+		std::vector<byte> scratch;
+		const byte* ptr = sample(n, &scratch);
+		std::vector<uint32_t> counts;
+		size_t best_width = 0, best_phase = 0, best_common = 0, best_values = 1;
+		for (size_t width = 4; width <= 8; width += 4) {
+			const uint32_t bias = width == 4 ? 127 : 1023;
+			const uint32_t range = width == 4 ? kFloatExponentRange : kDoubleExponentRange;
+			for (size_t phase = 0; phase < width; ++phase) {
+				counts.assign(2 * bias + 2, 0);
+				size_t values = 0, zeros = 0;
+				for (size_t i = phase; i + width <= n; i += width) {
+					bool zero = true;
+					for (size_t j = 0; j < width - 1; ++j) {
+						zero = zero && ptr[i + j] == 0;
+					}
+					// Signed zero too.
+					if (zero && (ptr[i + width - 1] & 0x7F) == 0) {
+						++zeros;
+						continue;
+					}
+					++values;
+					const uint32_t e = FloatFilter::exponent(ptr + i, width);
+					if (e + range >= bias && e <= bias + range) {
+						++counts[e];
+					}
+				}
+				if (values < zeros || values < kMinFloatValues) {
+					continue;
+				}
+				std::partial_sort(counts.begin(), counts.begin() + kFloatExponents, counts.end(), std::greater<uint32_t>());
+				const size_t common = std::accumulate(counts.begin(), counts.begin() + kFloatExponents, static_cast<size_t>(0));
+				if (common * best_values > best_common * values) {
+					best_width = width;
+					best_phase = phase;
+					best_common = common;
+					best_values = values;
+				}
+			}
+		}
+		if (best_common * 8 < best_values * 7) {
+			return 0;
+		}
+		*out_phase = best_phase;
+		return best_width;
+	}
+
+	// Same check as ColumnFilter does for each chunk. The block can start in the middle of a line.
+	bool isColumns(size_t len) const {
+		const size_t n = std::min(len, kLineSample);
+		std::vector<byte> scratch;
+		const byte* ptr = sample(n, &scratch);
+		const byte* begin = std::find(ptr, ptr + n, '\n');
+		const byte* end = ptr + n;
+		while (end > begin && end[-1] != '\n') {
+			--end;
+		}
+		uint8_t delim;
+		size_t columns;
+		return end > begin + 1 && ColumnFilter::analyze(begin + 1, end - begin - 1, &delim, &columns);
+	}
+
+	// Autocorrelation of the start of the block, for each record size the number of bytes equal to the byte one
+	// record before. The best size must stand out from the byte before, and its matches must be in a few fields of
+	// the record, otherwise it is likely variable size records or noise. Returns 0 if there are no records.
+	size_t detectStride(size_t len) const {
+		static const size_t kMaxStride = RecordFilter::kMaxStride;
+		const size_t n = std::min(len, kRecordSample);
+		std::vector<byte> scratch;
+		const byte* ptr = sample(n, &scratch);
+		// Same positions for every stride.
+		const size_t start = kMaxStride, end = start + (n - start) / 16 * 16;
+		const __m128i zero = _mm_setzero_si128();
+		uint64_t matches[kMaxStride + 1] = {};
+		for (size_t s = 1; s <= kMaxStride; ++s) {
+			__m128i total = zero, acc = zero;
+			size_t run = 0;
+			for (size_t i = start; i < end; i += 16) {
+				const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i));
+				const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i - s));
+				// Equal bytes are -1.
+				acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(a, b));
+				if (++run == 255) {
+					total = _mm_add_epi64(total, _mm_sad_epu8(acc, zero));
+					acc = zero;
+					run = 0;
+				}
+			}
+			total = _mm_add_epi64(total, _mm_sad_epu8(acc, zero));
+			matches[s] = static_cast<uint64_t>(_mm_cvtsi128_si32(total)) +
+				static_cast<uint64_t>(_mm_cvtsi128_si32(_mm_srli_si128(total, 8)));
+		}
+		size_t best = 2;
+		for (size_t s = 3; s <= kMaxStride; ++s) {
+			if (matches[s] > matches[best]) {
+				best = s;
+			}
+		}
+		// Multiples of the record size score about the same.
+		for (size_t s = 2; s < best; ++s) {
+			if (best % s == 0 && matches[s] * 4 >= matches[best] * 3) {
+				best = s;
+				break;
+			}
+		}
+		const uint64_t count = end - start;
+		if (matches[best] * 8 < count || matches[best] * 4 < matches[1] * 5) {
+			return 0;
+		}
+		// Average match rate of the field each match is in, high if some fields repeat and others don't.
+		uint32_t field_matches[kMaxStride] = {};
+		for (size_t i = start; i < end; ++i) {
+			field_matches[i % best] += ptr[i] == ptr[i - best];
+		}
+		uint64_t sum_squares = 0;
+		for (size_t j = 0; j < best; ++j) {
+			sum_squares += static_cast<uint64_t>(field_matches[j]) * field_matches[j];
+		}
+		if (sum_squares * best * 2 < matches[best] * count) {
+			return 0;
+		}
+		return best;
+	}
+
+	// A RIFF tag ending in the next few bytes needs an R in the last 3.
+	static forceinline bool hasRTag(uint32_t word) {
+		return (word & 0xFF) == 'R' || ((word >> 8) & 0xFF) == 'R' || ((word >> 16) & 0xFF) == 'R';
+	}
+
+	forceinline void updateLastWord(size_t pos, size_t count) {
+		for (size_t i = count - std::min(count, static_cast<size_t>(4)); i < count; ++i) {
+			last_word_ = (last_word_ << 8) | buffer_[pos + i];
+		}
+	}
+
+	// Length of the run at pos of ASCII text with no forbidden chars (kText), or of forbidden control chars
+	// (!kText), 16 bytes at a time. Text runs also stop at R so that the RIFF check can be skipped for the
+	// run. The caller handles what is left (and non ASCII UTF-8) one byte at a time.
+	template <bool kText>
+	size_t runLength(size_t pos, size_t max_count) const {
+		const __m128i space = _mm_set1_epi8(0x20);
+		const __m128i tab = _mm_set1_epi8('\t');
+		const __m128i lf = _mm_set1_epi8('\n');
+		const __m128i cr = _mm_set1_epi8('\r');
+		const __m128i c18 = _mm_set1_epi8(18);
+		const __m128i r = _mm_set1_epi8('R');
+		size_t count = 0;
+		while (count + 16 <= max_count) {
+			const byte* ptr = buffer_.contiguous(pos + count, 16);
+			if (ptr == nullptr) {
+				break;
+			}
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+			// Signed compare, also catches bytes >= 0x80.
+			const __m128i ctrl = _mm_cmplt_epi8(v, space);
+			const __m128i allowed = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, lf)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, c18)));
+			const __m128i forbidden = _mm_andnot_si128(allowed, ctrl);
+			uint32_t mask;
+			if (kText) {
+				mask = _mm_movemask_epi8(_mm_or_si128(forbidden, _mm_cmpeq_epi8(v, r)));
+			} else {
+				// Bytes >= 0x80 are not control chars.
+				mask = _mm_movemask_epi8(forbidden) ^ 0xFFFF;
+				mask |= _mm_movemask_epi8(v);
+			}
+			if (mask != 0) {
+				return count + ctz(mask);
+			}
+			count += 16;
+		}
+		return count;
+	}
+
+	// Cheap order 0 entropy first, then the cost of coding the window with an adaptive order 1 bit model
+	// since a static order 1 estimate over 64KB is far too optimistic.
+	bool isIncompressible(size_t window) {
+		// Separate histograms avoid store to load stalls on runs of the same byte.
+		uint32_t counts[4][256] = {};
+		const byte* ptr = buffer_.contiguous(0, window);
+		if (ptr != nullptr) {
+			size_t i = 0;
+			for (; i + 4 <= window; i += 4) {
+				++counts[0][ptr[i + 0]];
+				++counts[1][ptr[i + 1]];
+				++counts[2][ptr[i + 2]];
+				++counts[3][ptr[i + 3]];
+			}
+			for (; i < window; ++i) {
+				++counts[0][ptr[i]];
+			}
+		} else {
+			for (size_t i = 0; i < window; ++i) {
+				++counts[0][buffer_[i]];
+			}
+		}
+		double order0 = 0.0;
+		for (size_t c = 0; c < 256; ++c) {
+			const uint32_t count = counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c];
+			if (count != 0) {
+				order0 -= static_cast<double>(count) * log2(static_cast<double>(count) / static_cast<double>(window));
+			}
+		}
+		if (order0 * 1000.0 < static_cast<double>(window) * kMinOrder0BitsContainer) {
+			container_hint_ = false;
+			return false;
+		}
+		// Only high entropy windows get here, look for signatures.
+		uint32_t word = 0;
+		for (size_t i = 0; i < window; ++i) {
+			word = (word << 8) | buffer_[i];
+			switch (word) {
+			case 0x52494646: // RIFF, leave it to the wave detection.
+				return false;
+			case 0x504B0304: // Zip local file header.
+			case 0x49444154: // PNG IDAT.
+			case 0x377ABCAF: // 7z.
+			case 0xFD377A58: // xz.
+				container_hint_ = true;
+				break;
+			}
+			if ((word & 0xFFFFFF) == 0xFFD8FF || (word & 0xFFFFFF) == 0x1F8B08 || (word & 0xFFFFFF) == 0x425A68) {
+				// Jpeg, gzip, bzip2.
+				container_hint_ = true;
+			}
+		}
+		uint32_t min_order0 = kMinOrder0Bits, min_order1 = kMinOrder1Bits;
+		if (container_hint_) {
+			min_order0 = kMinOrder0BitsContainer;
+			min_order1 = kMinOrder1BitsContainer;
+		}
+		if (order0 * 1000.0 < static_cast<double>(window) * min_order0) {
+			container_hint_ = false;
+			return false;
+		}
+		// Context is the high nibble of the previous byte so that the model learns quickly.
+		std::fill(order1_probs_.begin(), order1_probs_.end(), 1u << 15);
+		uint64_t cost = 0;
+		size_t prev = 0;
+		for (size_t i = 0; i < window; ++i) {
+			const size_t c = buffer_[i];
+			uint16_t* probs = &order1_probs_[(prev >> 4) * 256];
+			for (size_t node = 1, shift = 8; shift-- != 0; ) {
+				const size_t bit = (c >> shift) & 1;
+				uint16_t& p = probs[node];
+				cost += cost_table_.cost(std::min(std::max(p >> 4, 1), 4094), static_cast<uint32_t>(bit));
+				if (bit) {
+					p -= p >> 4;
+				} else {
+					p += (65535 - p) >> 4;
+				}
+				node = node * 2 + bit;
+			}
+			prev = c;
+		}
+		if (cost * 1000 < (static_cast<uint64_t>(window) * min_order1) << kCostShift) {
+			container_hint_ = false;
+			return false;
+		}
+		return true;
+	}
+
+	// Look for ELF and PE headers in the first size bytes of the buffer that were not searched yet.
+	void findHeaders(size_t size) {
+		for (size_t i = static_cast<size_t>(std::max(exe_checked_end_, pos_) - pos_); i < size; ++i) {
+			const uint8_t c = buffer_[i];
+			if (c == 0x7F && readBytes(i) == 0x7F454C46) {
+				parseElf(i);
+			} else if (c == 'M' && readBytes(i, 2) == 0x4D5A) {
+				parsePe(i);
+			} else if (c == 'B' && readBytes(i, 2) == 0x424D) {
+				parseBmp(i);
+			} else if (c == 'P' && (readBytes(i, 2) == 0x5035 || readBytes(i, 2) == 0x5036)) {
+				parsePnm(i);
+			} else if (c <= 64 && readBytes(i + 1, 2) <= 3 && readBytes(i + 1, 2) >= 2) {
+				// TGA has no magic, the color map type and image type are the first check.
+				parseTga(i);
+			}
+		}
+		exe_checked_end_ = std::max(exe_checked_end_, pos_ + size);
+	}
+
+	// Uncompressed BMP with 8 bit gray, 24 or 32 bit pixels.
+	void parseBmp(size_t base) {
+		const size_t limit = std::min(kRasterHeaderWindow, buffer_.size() - base);
+		const uint64_t offset = imageField(base, limit, 10, 4, false);
+		const uint64_t header_size = imageField(base, limit, 14, 4, false);
+		if (imageField(base, limit, 6, 4, false) != 0 || (header_size != 40 && header_size != 52 &&
+			header_size != 56 && header_size != 108 && header_size != 124)) {
+			return;
+		}
+		const uint64_t width = imageField(base, limit, 18, 4, false);
+		// Negative heights are top down.
+		const uint64_t height = std::abs(static_cast<int64_t>(static_cast<int32_t>(imageField(base, limit, 22, 4, false))));
+		const uint64_t bpp = imageField(base, limit, 28, 2, false);
+		const uint64_t compression = imageField(base, limit, 30, 4, false);
+		if (imageField(base, limit, 26, 2, false) != 1 || (compression != 0 && !(compression == 3 && bpp == 32))) {
+			return;
+		}
+		if (bpp == 8) {
+			// Palette indices only have the order of the colors if the palette is gray.
+			uint64_t colors = imageField(base, limit, 46, 4, false);
+			colors = colors != 0 ? colors : 256;
+			const uint64_t palette = 14 + header_size;
+			if (colors > 256 || palette + colors * 4 > std::min(static_cast<uint64_t>(limit), offset)) {
+				return;
+			}
+			for (uint64_t i = 0; i < colors; ++i) {
+				const uint64_t color = imageField(base, limit, palette + i * 4, 3, false);
+				if (color != (color & 0xFF) * 0x010101) {
+					return;
+				}
+			}
+		} else if (bpp != 24 && bpp != 32) {
+			return;
+		}
+		// Rows are padded to 4 bytes.
+		addRaster(pos_ + base + offset, width, height, bpp / 8, (width * bpp / 8 + 3) & ~static_cast<uint64_t>(3));
+	}
+
+	// Binary PGM and PPM with 8 bit samples.
+	void parsePnm(size_t base) {
+		const size_t limit = std::min(kRasterHeaderWindow, buffer_.size() - base);
+		uint64_t fields[3];
+		size_t pos = 2;
+		for (auto& field : fields) {
+			for (;;) {
+				if (pos >= limit) {
+					return;
+				}
+				const uint8_t c = buffer_[base + pos];
+				if (c == '#') {
+					while (pos < limit && buffer_[base + pos] != '\n') {
+						++pos;
+					}
+				} else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+					++pos;
+				} else {
+					break;
+				}
+			}
+			field = 0;
+			size_t digits = 0;
+			for (; pos < limit && buffer_[base + pos] >= '0' && buffer_[base + pos] <= '9' && digits < 6; ++pos, ++digits) {
+				field = field * 10 + buffer_[base + pos] - '0';
+			}
+			if (digits == 0 || pos >= limit) {
+				return;
+			}
+		}
+		// One whitespace char before the samples.
+		const uint8_t c = buffer_[base + pos];
+		if (fields[2] != 255 || (c != ' ' && c != '\t' && c != '\r' && c != '\n')) {
+			return;
+		}
+		const size_t pixel_bytes = buffer_[base + 1] == '6' ? 3 : 1;
+		addRaster(pos_ + base + pos + 1, fields[0], fields[1], pixel_bytes, fields[0] * pixel_bytes);
+	}
+
+	// PCM WAVE file, pos is just past the RIFF tag. Queues the sample data and sets header to the block up to it.
+	bool parseWave(size_t pos, DetectedBlock* header) {
+		const uint32_t chunk_size = readBytes(pos, 4, false);
+		size_t fpos = pos + 4;
+		if (readBytes(fpos) != 0x57415645 || readBytes(fpos + 4) != 0x666d7420) {
+			return false;
+		}
+		fpos += 8;
+		const uint32_t fmt_size = readBytes(fpos, 4, false); fpos += 4;
+		if (fmt_size != 16 && fmt_size != 18 && fmt_size != 40) {
+			return false;
+		}
+		uint32_t audio_format = readBytes(fpos, 2, false);
+		const uint32_t num_channels = readBytes(fpos + 2, 2, false);
+		const uint32_t block_align = readBytes(fpos + 12, 2, false);
+		const uint32_t bits_per_sample = readBytes(fpos + 14, 2, false);
+		if (audio_format == 0xFFFE && fmt_size == 40) {
+			// WAVE_FORMAT_EXTENSIBLE, the format is the start of the sub format GUID.
+			audio_format = readBytes(fpos + 24, 2, false);
+		}
+		const size_t sample_bytes = bits_per_sample / 8;
+		if (audio_format != 1 || bits_per_sample % 8 != 0 || sample_bytes == 0 || sample_bytes > kMaxSampleBytes ||
+			num_channels == 0 || num_channels > kMaxWaveChannels || block_align != num_channels * sample_bytes) {
+			return false;
+		}
+		fpos += fmt_size;
+		for (size_t i = 0; i < 5; ++i) {
+			const uint32_t subchunk_id = readBytes(fpos); fpos += 4;
+			const uint32_t subchunk_size = readBytes(fpos, 4, false); fpos += 4;
+			if (subchunk_id == 0x64617461) {
+				if (subchunk_size == 0 || subchunk_size >= chunk_size) {
+					return false;
+				}
+				saved_blocks_.push_back(DetectedBlock(kProfileWave, subchunk_size, waveLayout(sample_bytes, num_channels)));
+				*header = DetectedBlock(kProfileBinary, static_cast<uint32_t>(fpos));
+				return true;
+			}
+			// Chunks are padded to an even size.
+			fpos += subchunk_size + (subchunk_size & 1);
+			if (fpos >= buffer_.size()) {
+				break;
+			}
+		}
+		return false;
+	}
+
+	// Uncompressed true color or gray TGA.
+	void parseTga(size_t base) {
+		const size_t limit = std::min(kRasterHeaderWindow, buffer_.size() - base);
+		const uint64_t id_length = imageField(base, limit, 0, 1, false);
+		const uint64_t type = imageField(base, limit, 2, 1, false);
+		const uint64_t bpp = imageField(base, limit, 16, 1, false);
+		const uint64_t descriptor = imageField(base, limit, 17, 1, false);
+		// No color map and a zero origin.
+		if (limit < 18 || imageField(base, limit, 1, 1, false) != 0 || imageField(base, limit, 3, 5, false) != 0 ||
+			imageField(base, limit, 8, 4, false) != 0) {
+			return;
+		}
+		const uint64_t alpha_bits = descriptor & 0xF;
+		if ((descriptor & 0xC0) != 0 || !(type == 3 ? bpp == 8 && alpha_bits == 0 :
+			(bpp == 24 && alpha_bits == 0) || (bpp == 32 && (alpha_bits == 0 || alpha_bits == 8)))) {
+			return;
+		}
+		const uint64_t width = imageField(base, limit, 12, 2, false), height = imageField(base, limit, 14, 2, false);
+		addRaster(pos_ + base + 18 + id_length, width, height, bpp / 8, width * bpp / 8);
+	}
+
+	// Pixel data of height rows of row_bytes at stream offset pos.
+	void addRaster(uint64_t pos, uint64_t width, uint64_t height, size_t pixel_bytes, uint64_t row_bytes) {
+		if (width == 0 || height == 0 || width >= kMaxRasterDim || height >= kMaxRasterDim) {
+			return;
+		}
+		const uint64_t size = row_bytes * height;
+		// Rasters of an earlier header take precedence.
+		if (size < kMinRasterSize || size > kMaxImageSize ||
+			(!raster_ranges_.empty() && pos < raster_ranges_.back().end_)) {
+			return;
+		}
+		RasterRange r;
+		r.begin_ = pos;
+		r.end_ = pos + size;
+		r.layout_ = imageLayout(static_cast<size_t>(row_bytes), pixel_bytes);
+		raster_ranges_.push_back(r);
+	}
+
+	// Field of the image at buffer offset base, 0 if it is not in the first limit bytes.
+	uint64_t imageField(size_t base, size_t limit, uint64_t offset, size_t bytes, bool big_endian) const {
+		if (offset > limit || offset + bytes > limit) {
+			return 0;
+		}
+		uint64_t w = 0;
+		for (size_t i = 0; i < bytes; ++i) {
+			const uint64_t c = buffer_[base + static_cast<size_t>(offset) + (big_endian ? i : bytes - 1 - i)];
+			w = (w << 8) | c;
+		}
+		return w;
+	}
+
+	// Executable sections from the section table if it is in the header window, otherwise executable
+	// segments from the program headers.
+	void parseElf(size_t base) {
+		const size_t limit = std::min(kExeHeaderWindow, buffer_.size() - base);
+		const uint64_t ei_class = imageField(base, limit, 4, 1, false), ei_data = imageField(base, limit, 5, 1, false);
+		if ((ei_class != 1 && ei_class != 2) || (ei_data != 1 && ei_data != 2)) {
+			return;
+		}
+		const bool is64 = ei_class == 2, be = ei_data == 2;
+		const size_t word = is64 ? 8 : 4;
+		const uint64_t phoff = imageField(base, limit, is64 ? 0x20 : 0x1C, word, be);
+		const uint64_t shoff = imageField(base, limit, is64 ? 0x28 : 0x20, word, be);
+		const uint64_t phentsize = imageField(base, limit, is64 ? 0x36 : 0x2A, 2, be);
+		const uint64_t phnum = imageField(base, limit, is64 ? 0x38 : 0x2C, 2, be);
+		const uint64_t shentsize = imageField(base, limit, is64 ? 0x3A : 0x2E, 2, be);
+		const uint64_t shnum = imageField(base, limit, is64 ? 0x3C : 0x30, 2, be);
+		CodeRanges ranges;
+		uint64_t size = 0;
+		if (shnum != 0 && shentsize >= (is64 ? 0x28u : 0x18u) && shoff <= limit && shoff + shnum * shentsize <= limit) {
+			size = shoff + shnum * shentsize;
+			for (uint64_t i = 0; i < shnum; ++i) {
+				const uint64_t sh = shoff + i * shentsize;
+				const uint64_t type = imageField(base, limit, sh + 4, 4, be);
+				const uint64_t flags = imageField(base, limit, sh + 8, word, be);
+				const uint64_t offset = imageField(base, limit, sh + (is64 ? 0x18 : 0x10), word, be);
+				const uint64_t sec_size = imageField(base, limit, sh + (is64 ? 0x20 : 0x14), word, be);
+				// SHT_PROGBITS with SHF_EXECINSTR.
+				if (type == 1 && (flags & 4) != 0) {
+					ranges.push_back(std::make_pair(offset, offset + sec_size));
+				}
+				// Not SHT_NOBITS.
+				if (type != 8) {
+					size = std::max(size, offset + sec_size);
+				}
+			}
+		} else if (phnum != 0 && phentsize >= (is64 ? 0x38u : 0x20u) && phoff <= limit && phoff + phnum * phentsize <= limit) {
+			for (uint64_t i = 0; i < phnum; ++i) {
+				const uint64_t ph = phoff + i * phentsize;
+				const uint64_t type = imageField(base, limit, ph, 4, be);
+				const uint64_t flags = imageField(base, limit, ph + (is64 ? 4 : 0x18), 4, be);
+				const uint64_t offset = imageField(base, limit, ph + (is64 ? 8 : 4), word, be);
+				const uint64_t seg_size = imageField(base, limit, ph + (is64 ? 0x20 : 0x10), word, be);
+				// PT_LOAD with PF_X.
+				if (type == 1 && (flags & 1) != 0) {
+					ranges.push_back(std::make_pair(offset, offset + seg_size));
+				}
+				if (type == 1) {
+					size = std::max(size, offset + seg_size);
+				}
+			}
+		}
+		addImage(pos_ + base, size, &ranges);
+	}
+
+	// Sections with IMAGE_SCN_CNT_CODE or IMAGE_SCN_MEM_EXECUTE.
+	void parsePe(size_t base) {
+		const size_t limit = std::min(kExeHeaderWindow, buffer_.size() - base);
+		const uint64_t pe = imageField(base, limit, 0x3C, 4, false);
+		if (imageField(base, limit, pe, 4, true) != 0x50450000) {
+			return;
+		}
+		const uint64_t num_sections = imageField(base, limit, pe + 6, 2, false);
+		const uint64_t table = pe + 24 + imageField(base, limit, pe + 20, 2, false);
+		if (table + num_sections * 40 > limit) {
+			return;
+		}
+		CodeRanges ranges;
+		uint64_t size = table + num_sections * 40;
+		for (uint64_t i = 0; i < num_sections; ++i) {
+			const uint64_t sec = table + i * 40;
+			const uint64_t sec_size = imageField(base, limit, sec + 16, 4, false);
+			const uint64_t offset = imageField(base, limit, sec + 20, 4, false);
+			if ((imageField(base, limit, sec + 36, 4, false) & 0x20000020) != 0) {
+				ranges.push_back(std::make_pair(offset, offset + sec_size));
+			}
+			size = std::max(size, offset + sec_size);
+		}
+		addImage(pos_ + base, size, &ranges);
+	}
+
+	// Drop the rest of the current code range, if in one.
+	void endCodeRange(bool in_code) {
+		if (in_code) {
+			code_ranges_.erase(code_ranges_.begin());
+		}
+	}
+
+	// Image of size bytes at stream offset pos, code ranges are relative to it.
+	void addImage(uint64_t pos, uint64_t size, CodeRanges* ranges) {
+		// Ranges past the size the headers give are cut.
+		const uint64_t end = size < kMaxImageSize ? size : kMaxImageSize;
+		image_end_ = std::max(image_end_, pos + end);
+		std::sort(ranges->begin(), ranges->end());
+		CodeRanges merged;
+		for (auto r : *ranges) {
+			r.second = std::min(r.second, end);
+			if (r.first >= r.second) {
+				continue;
+			}
+			if (!merged.empty() && r.first <= merged.back().second + kMaxCodeGap) {
+				merged.back().second = std::max(merged.back().second, r.second);
+			} else {
+				merged.push_back(r);
+			}
+		}
+		for (const auto& r : merged) {
+			// Ranges of an earlier image take precedence.
+			if (r.second - r.first >= kMinCodeSize && (code_ranges_.empty() || pos + r.first >= code_ranges_.back().second)) {
+				code_ranges_.push_back(std::make_pair(pos + r.first, pos + r.second));
+			}
+		}
+	}
+
 	forceinline size_t readBytes(size_t pos, size_t bytes = 4, bool big_endian = true) {
 		if (pos + bytes > buffer_.size()) {
 			return 0;
@@ -442,45 +1414,50 @@ public:
 class Analyzer {
 public:
 	typedef std::vector<Detector::DetectedBlock> Blocks;
+	// Smallest region worth its own thread.
+	static const uint64_t kMinRegionSize = 4 * MB;
+	// Words are sampled from windows of this size spread over the input.
+	static const uint64_t kSampleWindow = 1 * MB;
 
-	void analyze(Stream* stream) {
-		Detector detector(stream);
-		detector.init();
-		for (;;) {
-			auto block = detector.detectBlock();
-			if (block.profile() == Detector::kProfileEOF) {
-				break;
-			}
-			for (size_t i = 0; i < block.length(); ++i) {
-				auto c = detector.popChar();
-				if (c == EOF) {
-					block.setLength(i);
-					break;
-				}
-				if (block.profile() == Detector::kProfileText) {
-					dict_builder_.addChar(c);
-				}
-			}
-			const size_t size = blocks_.size();
-			if (size > 0 && blocks_.back().profile() == block.profile()) {
-				// Same type, extend.
-				blocks_.back().extend(block.length());
-			} else {
-				const size_t min_binary_length = 1;
-				// replace <text> <bin> <text> with <text> if |<bin>| < min_binary_length.
-				if (block.profile() == Detector::kProfileText && size >= 2) {
-					auto& b1 = blocks_[size - 1];
-					auto& b2 = blocks_[size - 2];
-					if (b1.profile() == Detector::kProfileBinary &&
-						b2.profile() == Detector::kProfileText && 
-						b1.length() < min_binary_length) {
-						b2.extend(b1.length() + block.length());
-						blocks_.pop_back();
-						continue;
-					}
-				}
-				blocks_.push_back(block);
-			}
+	Analyzer() : count_words_(true), dict_sample_size_(0) {
+	}
+
+	// Not needed with an external dictionary.
+	void setCountWords(bool count_words) {
+		count_words_ = count_words;
+	}
+
+	// Keep up to size bytes of text for ordering the dictionary, 0 disables it.
+	void setDictBufferSize(size_t size) {
+		dict_builder_.setBufferSize(size);
+	}
+
+	// Only count words in about size bytes of the input, 0 counts all of them.
+	void setDictSampleSize(uint64_t size) {
+		dict_sample_size_ = size;
+	}
+
+	// With more than one thread or with sampling the stream needs a thread safe readat, length is the size of
+	// the stream.
+	void analyze(Stream* stream, uint64_t length = 0, size_t num_threads = 1) {
+		num_threads = static_cast<size_t>(std::min(static_cast<uint64_t>(num_threads), length / kMinRegionSize));
+		const bool sample = dict_sample_size_ != 0 && length > dict_sample_size_;
+		if (num_threads > 1) {
+			detectParallel(stream, length, num_threads);
+		} else {
+			detectSerial(stream, count_words_ && !sample);
+		}
+		if (!count_words_ || (num_threads <= 1 && !sample)) {
+			// Not needed or counted during detection.
+			return;
+		}
+		const Ranges text_ranges = getTextRanges();
+		const Ranges ranges = sample ? sampleRanges(text_ranges, length) : text_ranges;
+		countWordsParallel(stream, ranges, std::max(num_threads, static_cast<size_t>(1)));
+		const uint64_t text_size = rangesSize(text_ranges), sampled_size = rangesSize(ranges);
+		if (sampled_size != 0 && sampled_size < text_size) {
+			// Estimate the full counts, the code word generator has absolute thresholds.
+			dict_builder_.getWords().scale(text_size, sampled_size);
 		}
 	}
 	void dump() {
@@ -505,8 +1482,291 @@ public:
 	}
 
 private:
+	// Offset, length.
+	typedef std::vector<std::pair<uint64_t, uint64_t>> Ranges;
+
+	class Region {
+	public:
+		uint64_t start_, end_;
+		std::unique_ptr<ReadAtStream> stream_;
+		std::unique_ptr<Detector> detector_;
+		// Detected blocks and the detector state before each of them.
+		std::vector<std::pair<Detector::State, Detector::DetectedBlock>> blocks_;
+		bool eof_;
+	};
+
  	Blocks blocks_;
 	Dict::Builder dict_builder_;
+	bool count_words_;
+	uint64_t dict_sample_size_;
+
+	void detectSerial(Stream* stream, bool count_words) {
+		Detector detector(stream);
+		detector.init();
+		for (;;) {
+			auto block = detector.detectBlock();
+			if (block.profile() == Detector::kProfileEOF) {
+				break;
+			}
+			if (count_words && block.profile() == Detector::kProfileText) {
+				Dict::Builder* builder = &dict_builder_;
+				block.setLength(detector.skip(block.length(), [builder](const uint8_t* data, size_t n) {
+					builder->addChars(data, n);
+				}));
+			} else {
+				block.setLength(detector.skip(block.length()));
+			}
+			addBlock(block);
+		}
+	}
+
+	Ranges getTextRanges() const {
+		Ranges ranges;
+		uint64_t pos = 0;
+		for (const auto& b : blocks_) {
+			if (b.profile() == Detector::kProfileText) {
+				ranges.push_back(std::make_pair(pos, b.length()));
+			}
+			pos += b.length();
+		}
+		return ranges;
+	}
+
+	static uint64_t rangesSize(const Ranges& ranges) {
+		uint64_t size = 0;
+		for (const auto& r : ranges) {
+			size += r.second;
+		}
+		return size;
+	}
+
+	// The parts of the text ranges inside evenly spread sample windows.
+	Ranges sampleRanges(const Ranges& text_ranges, uint64_t length) const {
+		const uint64_t num_windows = std::max(dict_sample_size_ / kSampleWindow, static_cast<uint64_t>(1));
+		const uint64_t stride = length / num_windows;
+		Ranges ranges;
+		size_t idx = 0;
+		for (uint64_t w = 0; w < num_windows; ++w) {
+			const uint64_t start = w * stride, end = start + kSampleWindow;
+			while (idx < text_ranges.size() && text_ranges[idx].first + text_ranges[idx].second <= start) {
+				++idx;
+			}
+			for (size_t i = idx; i < text_ranges.size() && text_ranges[i].first < end; ++i) {
+				const uint64_t r_start = std::max(start, text_ranges[i].first);
+				const uint64_t r_end = std::min(end, text_ranges[i].first + text_ranges[i].second);
+				ranges.push_back(std::make_pair(r_start, r_end - r_start));
+			}
+		}
+		return ranges;
+	}
+
+	void addBlock(const Detector::DetectedBlock& block) {
+		const size_t size = blocks_.size();
+		if (size > 0 && blocks_.back().profile() == block.profile() && blocks_.back().stride() == block.stride()) {
+			// Same type, extend.
+			blocks_.back().extend(block.length());
+			return;
+		}
+		const size_t min_binary_length = 1;
+		// replace <text> <bin> <text> with <text> if |<bin>| < min_binary_length.
+		if (block.profile() == Detector::kProfileText && size >= 2) {
+			auto& b1 = blocks_[size - 1];
+			auto& b2 = blocks_[size - 2];
+			if (b1.profile() == Detector::kProfileBinary &&
+				b2.profile() == Detector::kProfileText && 
+				b1.length() < min_binary_length) {
+				b2.extend(b1.length() + block.length());
+				blocks_.pop_back();
+				return;
+			}
+		}
+		blocks_.push_back(block);
+	}
+
+	// Detect the next block and skip its data, false on EOF.
+	static bool detectNext(Detector* detector, Detector::State* state, Detector::DetectedBlock* block) {
+		*state = detector->getState();
+		*block = detector->detectBlock();
+		if (block->profile() == Detector::kProfileEOF) {
+			return false;
+		}
+		block->setLength(detector->skip(block->length()));
+		return true;
+	}
+
+	static void detectRegion(Region* region) {
+		Detector::State state;
+		Detector::DetectedBlock block;
+		while (region->detector_->getState().pos_ < region->end_) {
+			if (!detectNext(region->detector_.get(), &state, &block)) {
+				region->eof_ = true;
+				break;
+			}
+			region->blocks_.push_back(std::make_pair(state, block));
+		}
+	}
+
+	// Each region is detected from a fresh detector. The first region is exact, the detector of an exact region
+	// keeps going until it reaches a block where the next region had the same state, from there on the next
+	// region is exact too. The blocks come out the same as a serial pass.
+	void detectParallel(Stream* stream, uint64_t length, size_t num_threads) {
+		std::vector<Region> regions(num_threads);
+		for (size_t i = 0; i < num_threads; ++i) {
+			auto& region = regions[i];
+			// Window aligned, the serial detector usually reaches these offsets at a block boundary.
+			region.start_ = length * i / num_threads / Detector::kEntropyWindow * Detector::kEntropyWindow;
+			region.end_ = length;
+			if (i > 0) {
+				regions[i - 1].end_ = region.start_;
+			}
+			uint32_t last_word = 0;
+			if (region.start_ >= sizeof(last_word)) {
+				uint8_t prev[sizeof(last_word)];
+				check(stream->readat(region.start_ - sizeof(last_word), prev, sizeof(prev)) == sizeof(prev));
+				for (auto c : prev) {
+					last_word = (last_word << 8) | c;
+				}
+			}
+			region.stream_.reset(new ReadAtStream(stream, region.start_));
+			region.detector_.reset(new Detector(region.stream_.get()));
+			region.detector_->init();
+			region.detector_->initRegion(region.start_, last_word);
+			region.eof_ = false;
+		}
+		std::vector<std::thread> threads;
+		for (auto& region : regions) {
+			threads.push_back(std::thread(detectRegion, &region));
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		// Reconcile the region boundaries.
+		Blocks detected;
+		Region* exact = &regions[0];
+		for (const auto& p : exact->blocks_) {
+			detected.push_back(p.second);
+		}
+		bool eof = exact->eof_;
+		Detector::State state;
+		Detector::DetectedBlock block;
+		for (size_t i = 1; i < num_threads && !eof; ++i) {
+			Region* next = &regions[i];
+			size_t idx = 0;
+			for (;;) {
+				const auto cur_state = exact->detector_->getState();
+				while (idx < next->blocks_.size() && next->blocks_[idx].first.pos_ < cur_state.pos_) {
+					++idx;
+				}
+				if (idx == next->blocks_.size()) {
+					// Passed the whole region without getting in sync, the exact detector covers it.
+					break;
+				}
+				if (next->blocks_[idx].first == cur_state) {
+					for (; idx < next->blocks_.size(); ++idx) {
+						detected.push_back(next->blocks_[idx].second);
+					}
+					exact = next;
+					eof = next->eof_;
+					break;
+				}
+				if (!detectNext(exact->detector_.get(), &state, &block)) {
+					eof = true;
+					break;
+				}
+				detected.push_back(block);
+			}
+		}
+		while (!eof && detectNext(exact->detector_.get(), &state, &block)) {
+			detected.push_back(block);
+		}
+		for (const auto& b : detected) {
+			addBlock(b);
+		}
+	}
+
+	// Count words in shards of the ranges, then merge.
+	void countWordsParallel(Stream* stream, const Ranges& ranges, size_t num_threads) {
+		const uint64_t size = rangesSize(ranges);
+		std::vector<std::unique_ptr<Dict::Builder>> builders;
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < num_threads; ++i) {
+			builders.push_back(std::unique_ptr<Dict::Builder>(new Dict::Builder));
+			// Shards are merged in order, each one buffers its part of the first buffer size bytes of the text.
+			builders.back()->setBufferSize(dict_builder_.getBufferSize());
+			threads.push_back(std::thread(countWords, stream, &ranges, size * i / num_threads,
+				size * (i + 1) / num_threads, builders.back().get()));
+		}
+		// Merge in shard order.
+		for (size_t i = 0; i < num_threads; ++i) {
+			threads[i].join();
+			dict_builder_.merge(*builders[i]);
+		}
+	}
+
+	// Feed the bytes [begin, end) to the builder, counted over the ranges. Shards other than the first
+	// skip up to the first non word char and the builder goes past end until it adds one, so that each word is
+	// added by exactly one builder. The buffer size of the builder is for the whole text, only bytes below it are
+	// buffered.
+	static void countWords(Stream* stream, const Ranges* ranges, uint64_t begin, uint64_t end, Dict::Builder* builder) {
+		std::vector<uint8_t> buffer(64 * KB);
+		const uint64_t buffer_size = builder->getBufferSize();
+		bool skip = begin != 0;
+		bool buffer_set = false;
+		uint64_t text_pos = 0;
+		for (const auto& range : *ranges) {
+			if (text_pos + range.second <= begin) {
+				text_pos += range.second;
+				continue;
+			}
+			const uint64_t skip_bytes = begin > text_pos ? begin - text_pos : 0;
+			uint64_t offset = range.first + skip_bytes;
+			uint64_t remain = range.second - skip_bytes;
+			text_pos += skip_bytes;
+			while (remain != 0) {
+				const size_t n = stream->readat(offset, &buffer[0], static_cast<size_t>(std::min(static_cast<uint64_t>(buffer.size()), remain)));
+				if (n == 0) {
+					return;
+				}
+				size_t i = 0;
+				if (skip) {
+					while (i < n && isWordChar(buffer[i])) {
+						++i;
+					}
+					if (i < n) {
+						skip = false;
+						if (text_pos + i >= end) {
+							return;
+						}
+						++i;
+					}
+				}
+				if (!skip && !buffer_set) {
+					const uint64_t start = text_pos + i;
+					builder->setBufferSize(static_cast<size_t>(buffer_size > start ? buffer_size - start : 0));
+					buffer_set = true;
+				}
+				if (!skip) {
+					// Past end, stop after the first non word char.
+					size_t limit = n;
+					if (text_pos + n > end) {
+						limit = std::max(i, static_cast<size_t>(end > text_pos ? end - text_pos : 0));
+						while (limit < n && isWordChar(buffer[limit])) {
+							++limit;
+						}
+						if (limit < n) {
+							builder->addChars(&buffer[i], limit + 1 - i);
+							return;
+						}
+					}
+					builder->addChars(&buffer[i], limit - i);
+				}
+				text_pos += n;
+				offset += n;
+				remain -= n;
+			}
+		}
+	}
 };
 
 #endif
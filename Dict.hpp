@@ -28,9 +28,12 @@
 #include <map>
 #include <memory>
 #include <numeric>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#include "Dedup.hpp"
+#include "File.hpp"
 #include "Filter.hpp"
 
 class Dict {
@@ -38,53 +41,160 @@ public:
 	static const size_t kMaxWordLen = 256;
 	static const size_t kInvalidChar = 256;
 	typedef std::pair<size_t, std::string> WCPair;
+
+	static forceinline uint32_t hashWord(const uint8_t* begin, const uint8_t* end) {
+		uint32_t h = static_cast<uint32_t>(end - begin) * 0x9E3779B1u;
+		for (; begin != end; ++begin) {
+			h = (h + *begin) * 0x2F0B4A23u;
+		}
+		return h ^ (h >> 15);
+	}
 	
 	class CompareWCPair {
 	public:
 		CompareWCPair(size_t extra_cost = 0) : extra_cost_(extra_cost) {
 		}
 		bool operator()(const WCPair& a, const WCPair& b) const {
-			return (a.first - 1) * (std::max(extra_cost_, a.second.length()) - extra_cost_) <
-				(b.first - 1) * (std::max(extra_cost_, b.second.length()) - extra_cost_);
+			const size_t cost_a = (a.first - 1) * (std::max(extra_cost_, a.second.length()) - extra_cost_);
+			const size_t cost_b = (b.first - 1) * (std::max(extra_cost_, b.second.length()) - extra_cost_);
+			// Break ties by word so that the order doesn't depend on the hash map.
+			return cost_a < cost_b || (cost_a == cost_b && a.second > b.second);
 		}
 
 	private:
 		const size_t extra_cost_;
 	};
 
-	// Maybe not very memory efficient.
+	// Open addressing word counts. Words are stored inline in a bump allocated arena and slots keep the
+	// hash so that neither lookups nor growth touch the words unless the hashes match.
 	class WordCollectionMap {
-		std::unordered_map<std::string, uint32_t> words_;
+		class Slot {
+		public:
+			uint32_t hash_;
+			// Offset of the length prefixed word in the arena, kEmpty if unused.
+			uint32_t offset_;
+			uint32_t count_;
+		};
+		static const uint32_t kEmpty = 0xFFFFFFFFu;
+		static const size_t kMinSlots = 1u << 12;
+
+		std::vector<Slot> slots_;
+		std::vector<uint8_t> arena_;
+		size_t size_;
 		size_t max_words_;
 	public:
 
-		WordCollectionMap(size_t max_words = 10000000) : max_words_(max_words) {
+		WordCollectionMap(size_t max_words = 10000000) : size_(0), max_words_(max_words) {
+			clear();
 		}
 		void getWords(std::vector<WCPair>& out_pairs, size_t min_occurences = 10) {
-			for (auto& p : words_) {
-				if (p.second > min_occurences) {
-					out_pairs.push_back(WCPair(p.second, p.first));
+			for (const auto& s : slots_) {
+				if (s.offset_ != kEmpty && s.count_ > min_occurences) {
+					out_pairs.push_back(WCPair(s.count_, wordAt(s.offset_)));
 				}
 			}
 		}
 		forceinline size_t size() const {
-			return words_.size();
+			return size_;
 		}
 		void clear() {
-			words_.clear();
-		}
-		void addWord(const uint8_t* begin, const uint8_t* end) {
-			while (words_.size() > max_words_) {
-				for (auto it = words_.begin(); it != words_.end(); ) {
-					it->second /= 2;
-					if (it->second == 0) {
-						it = words_.erase(it);
-					} else {
-						++it;
+			Slot empty;
+			empty.hash_ = 0;
+			empty.offset_ = kEmpty;
+			empty.count_ = 0;
+			slots_.assign(kMinSlots, empty);
+			arena_.clear();
+			size_ = 0;
+		}
+		void merge(const WordCollectionMap& other) {
+			for (const auto& s : other.slots_) {
+				if (s.offset_ != kEmpty) {
+					const uint8_t* word = &other.arena_[s.offset_];
+					add(word + 1, word + 1 + word[0], s.hash_, s.count_);
+				}
+			}
+		}
+		// Multiply the counts by num / den.
+		void scale(uint64_t num, uint64_t den) {
+			for (auto& s : slots_) {
+				s.count_ = static_cast<uint32_t>(std::min(static_cast<uint64_t>(s.count_) * num / den, static_cast<uint64_t>(0xFFFFFFFFu)));
+			}
+		}
+		forceinline void addWord(const uint8_t* begin, const uint8_t* end) {
+			if (UNLIKELY(size_ > max_words_)) {
+				halve();
+			}
+			add(begin, end, hashWord(begin, end), 1);
+		}
+
+	private:
+		std::string wordAt(uint32_t offset) const {
+			const uint8_t* word = &arena_[offset];
+			return std::string(word + 1, word + 1 + word[0]);
+		}
+		forceinline void add(const uint8_t* begin, const uint8_t* end, uint32_t h, uint32_t count) {
+			const size_t len = end - begin;
+			dcheck(len < 256);
+			const size_t mask = slots_.size() - 1;
+			for (size_t i = h & mask; ; i = (i + 1) & mask) {
+				Slot& s = slots_[i];
+				if (s.offset_ == kEmpty) {
+					s.hash_ = h;
+					s.offset_ = static_cast<uint32_t>(arena_.size());
+					s.count_ = count;
+					arena_.push_back(static_cast<uint8_t>(len));
+					arena_.insert(arena_.end(), begin, end);
+					// Keep the load factor under 1/2.
+					if (++size_ * 2 > slots_.size()) {
+						rehash(slots_.size() * 2);
+					}
+					return;
+				}
+				if (s.hash_ == h && arena_[s.offset_] == len && std::equal(begin, end, &arena_[s.offset_ + 1])) {
+					s.count_ += count;
+					return;
+				}
+			}
+		}
+		void rehash(size_t new_size) {
+			std::vector<Slot> old_slots;
+			old_slots.swap(slots_);
+			Slot empty;
+			empty.hash_ = 0;
+			empty.offset_ = kEmpty;
+			empty.count_ = 0;
+			slots_.assign(new_size, empty);
+			const size_t mask = new_size - 1;
+			for (const auto& s : old_slots) {
+				if (s.offset_ != kEmpty) {
+					size_t i = s.hash_ & mask;
+					while (slots_[i].offset_ != kEmpty) {
+						i = (i + 1) & mask;
+					}
+					slots_[i] = s;
+				}
+			}
+		}
+		// Halve the counts until the map fits, words that reach zero are removed and the arena compacted.
+		void halve() {
+			while (size_ > max_words_) {
+				std::vector<Slot> old_slots;
+				old_slots.swap(slots_);
+				std::vector<uint8_t> old_arena;
+				old_arena.swap(arena_);
+				size_t new_size = kMinSlots;
+				while (new_size < size_ * 2) {
+					new_size *= 2;
+				}
+				clear();
+				rehash(new_size);
+				for (const auto& s : old_slots) {
+					if (s.offset_ != kEmpty && s.count_ / 2 != 0) {
+						const uint8_t* word = &old_arena[s.offset_];
+						add(word + 1, word + 1 + word[0], s.hash_, s.count_ / 2);
 					}
 				}
 			}
-			++words_[std::string(begin, end)];
 		}
 	};
 
@@ -132,27 +242,104 @@ public:
 		}
 	};
 
-	class SuffixSortComparator {
+	// Sparse suffix sort, sorts positions of a buffer by the bytes starting at them. Only the first kMaxDepth
+	// bytes are compared so that repetitive text can't blow up the time, ties are broken by position which
+	// makes the order total and independent of the number of threads.
+	class SuffixSorter {
 	public:
-		SuffixSortComparator(const uint8_t* arr) : arr_(arr) {
+		static const size_t kMaxDepth = 32;
+		static const size_t kMinShardSize = 64 * KB;
+
+		SuffixSorter(const uint8_t* arr, size_t size) : arr_(arr), size_(size) {
 		}
-		forceinline bool operator()(uint32_t a, uint32_t b) const {
-			while (a > 0 && b > 0) {
-				if (arr_[--a] != arr_[--b]) {
-					return arr_[a] < arr_[b];
+
+		void sort(std::vector<uint32_t>* positions, size_t num_threads) const {
+			const size_t count = positions->size();
+			std::vector<Suffix> suffixes(count);
+			for (size_t i = 0; i < count; ++i) {
+				suffixes[i].key_ = key((*positions)[i]);
+				suffixes[i].pos_ = (*positions)[i];
+			}
+			num_threads = std::max(std::min(num_threads, count / kMinShardSize), static_cast<size_t>(1));
+			std::vector<size_t> bounds;
+			for (size_t i = 0; i <= num_threads; ++i) {
+				bounds.push_back(count * i / num_threads);
+			}
+			Suffix* data = suffixes.empty() ? nullptr : &suffixes[0];
+			const SuffixSorter* sorter = this;
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < num_threads; ++i) {
+				threads.push_back(std::thread([data, &bounds, sorter, i]() {
+					std::sort(data + bounds[i], data + bounds[i + 1], *sorter);
+				}));
+			}
+			for (auto& t : threads) {
+				t.join();
+			}
+			// Merge pairs of sorted shards until there is one left.
+			for (size_t width = 1; width < num_threads; width *= 2) {
+				threads.clear();
+				for (size_t i = 0; i + width < num_threads; i += 2 * width) {
+					const size_t end = std::min(i + 2 * width, num_threads);
+					threads.push_back(std::thread([data, &bounds, sorter, i, width, end]() {
+						std::inplace_merge(data + bounds[i], data + bounds[i + width], data + bounds[end], *sorter);
+					}));
+				}
+				for (auto& t : threads) {
+					t.join();
 				}
 			}
-			return a < b;
+			for (size_t i = 0; i < count; ++i) {
+				(*positions)[i] = suffixes[i].pos_;
+			}
 		}
+
+		class Suffix {
+		public:
+			// First 8 bytes, big endian so that keys compare like the bytes.
+			uint64_t key_;
+			uint32_t pos_;
+		};
+
+		forceinline bool operator()(const Suffix& a, const Suffix& b) const {
+			if (a.key_ != b.key_) {
+				return a.key_ < b.key_;
+			}
+			for (size_t i = 8; i < kMaxDepth; ++i) {
+				const uint32_t ca = at(a.pos_ + i), cb = at(b.pos_ + i);
+				if (ca != cb) {
+					return ca < cb;
+				}
+			}
+			return a.pos_ < b.pos_;
+		}
+
 	private:
+		// Bytes past the end are 0.
+		forceinline uint32_t at(size_t pos) const {
+			return pos < size_ ? arr_[pos] : 0u;
+		}
+
+		uint64_t key(uint32_t pos) const {
+			uint64_t k = 0;
+			for (size_t i = 0; i < 8; ++i) {
+				k = (k << 8) | at(pos + i);
+			}
+			return k;
+		}
+
 		const uint8_t* const arr_;
+		const size_t size_;
 	};
 
 	class Builder {
-		static const size_t kSuffixSize = 100 * MB;
-		// Suffix array buffer.
+	public:
+		// Buffer positions are 32 bit.
+		static const size_t kMaxBufferSize = 1024 * MB;
+	private:
+		// Copy of the first buffer_limit_ bytes of text.
 		std::vector<uint8_t> buffer_;
-		size_t buffer_pos_;
+		size_t buffer_limit_;
 		// Current word.
 		static const size_t kMinWordLen = 3;
 		static const size_t kMaxWordLen = 0x20;
@@ -161,8 +348,31 @@ public:
 		size_t word_pos_;
 		// CC: first char EOR whole word.
 		WordCollectionMap words_;
-	public:
-		void addChar(uint8_t c) {
+
+		// Capital conversion, all caps words and words with only the first char upper case are counted as
+		// their lower case version.
+		forceinline void addWord(const uint8_t* word, size_t len) {
+			const bool first_cap = isUpperCase(word[0]);
+			size_t cap_count = first_cap;
+			for (size_t i = 1; i < len; ++i) {
+				cap_count += isUpperCase(word[i]);
+			}
+			if (cap_count == len || (first_cap && cap_count == 1)) {
+				uint8_t lower[kMaxWordLen];
+				std::copy(word, word + len, lower);
+				for (size_t i = 0; i < (first_cap && cap_count == 1 ? 1 : len); ++i) {
+					lower[i] = makeLowerCase(lower[i]);
+				}
+				words_.addWord(lower, lower + len);
+			} else {
+				words_.addWord(word, word + len);
+			}
+		}
+		void addToBuffer(const uint8_t* data, size_t count) {
+			const size_t n = std::min(count, buffer_limit_ - std::min(buffer_limit_, buffer_.size()));
+			buffer_.insert(buffer_.end(), data, data + n);
+		}
+		forceinline void countChar(uint8_t c) {
 			// Add to current word.
 			if (isWordChar(c)) {
 				if (word_pos_ < kMaxWordLen) {
@@ -170,34 +380,67 @@ public:
 				}
 			} else {
 				if (word_pos_ >= kMinWordLen) {
-					bool first_cap = isUpperCase(word_[0]);
-					size_t cap_count = first_cap;
-					for (size_t i = 1; i < word_pos_; ++i) {
-						cap_count += isUpperCase(word_[i]);
-					}
-					if (cap_count == word_pos_) {
-						for (size_t i = 0; i < word_pos_; ++i) {
-							word_[i] = makeLowerCase(word_[i]);
-						}
-					} else if (first_cap && cap_count == 1) {
-						word_[0] = makeLowerCase(word_[0]);
-					}
-					words_.addWord(word_, word_ + word_pos_);
+					addWord(word_, word_pos_);
 				}
-				/*
-				for (size_t i = 0; i < word_pos_; ++i) {
-					if (buffer_pos_ < buffer_.size()) buffer_[buffer_pos_++] = word_[i];
-				}
-				if (buffer_pos_ < buffer_.size()) buffer_[buffer_pos_++] = c;
-				*/
 				word_pos_ = 0;
 			}
 		}
+	public:
+		void addChar(uint8_t c) {
+			if (buffer_.size() < buffer_limit_) {
+				buffer_.push_back(c);
+			}
+			countChar(c);
+		}
+		// Same as calling addChar for each char, words that are inside the data are not copied.
+		void addChars(const uint8_t* data, size_t count) {
+			addToBuffer(data, count);
+			const uint8_t* ptr = data;
+			const uint8_t* const limit = data + count;
+			while (ptr < limit && word_pos_ != 0) {
+				countChar(*(ptr++));
+			}
+			while (ptr < limit) {
+				while (ptr < limit && !isWordChar(*ptr)) {
+					++ptr;
+				}
+				const uint8_t* start = ptr;
+				while (ptr < limit && isWordChar(*ptr)) {
+					++ptr;
+				}
+				const size_t len = std::min(static_cast<size_t>(ptr - start), kMaxWordLen);
+				if (ptr == limit) {
+					// The word may continue in the next call.
+					std::copy(start, start + len, word_);
+					word_pos_ = len;
+					break;
+				}
+				if (len >= kMinWordLen) {
+					addWord(start, len);
+				}
+				++ptr;
+			}
+		}
+		// Shards count separate parts of the input, merging them in a fixed order gives the same words
+		// regardless of the number of shards.
+		void merge(const Builder& other) {
+			words_.merge(other.words_);
+			if (!other.buffer_.empty()) {
+				addToBuffer(&other.buffer_[0], other.buffer_.size());
+			}
+		}
 		void init() {
-			buffer_pos_ = 0;
-			buffer_.resize(kSuffixSize);
+			buffer_.clear();
+			buffer_limit_ = 0;
 			word_pos_ = 0;
 		}
+		// Buffer up to size bytes of text for ordering the code words, 0 disables it.
+		void setBufferSize(size_t size) {
+			buffer_limit_ = std::min(size, kMaxBufferSize);
+		}
+		size_t getBufferSize() const {
+			return buffer_limit_;
+		}
 		Builder() {
 			init();
 		}
@@ -210,6 +453,9 @@ public:
 		const std::vector<uint8_t>* getBuffer() const {
 			return &buffer_;
 		}
+		void releaseBuffer() {
+			std::vector<uint8_t>().swap(buffer_);
+		}
 	};
 
 	class CodeWordGenerator {
@@ -219,6 +465,101 @@ public:
 
 	class CodeWordGeneratorFast {
 		static const bool kVerbose = true;
+
+		// Index of the code word, or -1 if the word isn't one. Case is folded the same way as the builder.
+		static int64_t findCodeWord(const std::vector<std::string>& cw, const std::vector<uint32_t>& table, const uint8_t* word, size_t len) {
+			uint8_t lower[0x20];
+			if (len > sizeof(lower)) {
+				return -1;
+			}
+			const bool first_cap = isUpperCase(word[0]);
+			size_t cap_count = first_cap;
+			for (size_t i = 1; i < len; ++i) {
+				cap_count += isUpperCase(word[i]);
+			}
+			std::copy(word, word + len, lower);
+			if (cap_count == len || (first_cap && cap_count == 1)) {
+				for (size_t i = 0; i < (first_cap && cap_count == 1 ? 1 : len); ++i) {
+					lower[i] = makeLowerCase(lower[i]);
+				}
+			}
+			const size_t mask = table.size() - 1;
+			for (size_t slot = hashWord(lower, lower + len) & mask; table[slot] != 0; slot = (slot + 1) & mask) {
+				const std::string& s = cw[table[slot] - 1];
+				if (s.length() == len && std::equal(lower, lower + len, reinterpret_cast<const uint8_t*>(s.data()))) {
+					return table[slot] - 1;
+				}
+			}
+			return -1;
+		}
+
+		// Sort the suffixes that follow the 2 and 3 byte code words in the buffer and order the code words by
+		// their average rank, words followed by similar text get nearby codes.
+		void orderByContext(const std::vector<uint8_t>& buffer, std::vector<std::string>* cw, size_t count1, size_t count2) {
+			auto start_time = clock();
+			size_t table_size = 1;
+			while (table_size < (cw->size() - count1) * 2) {
+				table_size <<= 1;
+			}
+			std::vector<uint32_t> table(table_size, 0u);
+			for (size_t i = count1; i < cw->size(); ++i) {
+				const auto* w = reinterpret_cast<const uint8_t*>((*cw)[i].data());
+				size_t slot = hashWord(w, w + (*cw)[i].length()) & (table_size - 1);
+				while (table[slot] != 0) {
+					slot = (slot + 1) & (table_size - 1);
+				}
+				table[slot] = static_cast<uint32_t>(i + 1);
+			}
+			// Ends of code words.
+			const uint8_t* arr = &buffer[0];
+			const size_t size = buffer.size();
+			std::vector<uint32_t> positions;
+			for (size_t pos = 0; pos < size; ) {
+				if (!isWordChar(arr[pos])) {
+					++pos;
+					continue;
+				}
+				size_t len = 0;
+				while (pos + len < size && isWordChar(arr[pos + len])) {
+					++len;
+				}
+				if (findCodeWord(*cw, table, arr + pos, len) != -1) {
+					positions.push_back(static_cast<uint32_t>(pos + len));
+				}
+				pos += len;
+			}
+			SuffixSorter sorter(arr, size);
+			sorter.sort(&positions, std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1)));
+			// Sum of ranks, count.
+			std::vector<std::pair<uint64_t, uint64_t>> ranks(cw->size());
+			for (size_t i = 0; i < positions.size(); ++i) {
+				size_t len = 0;
+				while (len < positions[i] && isWordChar(arr[positions[i] - len - 1])) {
+					++len;
+				}
+				auto& r = ranks[static_cast<size_t>(findCodeWord(*cw, table, arr + positions[i] - len, len))];
+				r.first += i;
+				++r.second;
+			}
+			// Re-sort each code length by average rank, words that were never seen go last.
+			const size_t bounds[] = { count1, count1 + count2, cw->size() };
+			for (size_t b = 0; b < 2; ++b) {
+				std::vector<std::pair<uint64_t, std::string>> sort_arr;
+				for (size_t i = bounds[b]; i < bounds[b + 1]; ++i) {
+					const auto& r = ranks[i];
+					const uint64_t avg = r.second != 0 ? r.first / r.second : std::numeric_limits<uint64_t>::max();
+					sort_arr.push_back(std::make_pair(avg, (*cw)[i]));
+				}
+				std::sort(sort_arr.begin(), sort_arr.end());
+				for (size_t i = 0; i < sort_arr.size(); ++i) {
+					(*cw)[bounds[b] + i] = sort_arr[i].second;
+				}
+			}
+			if (kVerbose) {
+				std::cout << "Suffix sorted " << positions.size() << " words of " << prettySize(size)
+					<< " in " << clockToSeconds(clock() - start_time) << "s" << std::endl;
+			}
+		}
 	public:
 		void generateCodeWords(Builder& builder, CodeWordSet* words) {
 			auto start_time = clock();
@@ -293,101 +634,10 @@ public:
 			}
 			word_pairs.erase(word_pairs.begin(), word_pairs.begin() + count3);
 			
-			if (false) {
-				// High mode, incomplete.
-				// Total / count.
-				typedef std::pair<uint64_t, uint64_t> MeanPair;
-				std::unordered_map<std::string, MeanPair> words2b;
-				std::unordered_map<std::string, MeanPair> words3b;
-				auto it = cw->begin() + count1;
-				for (; it != cw->begin() + count1 + count2; ++it) {
-					words2b.insert(std::make_pair(*it, MeanPair(0, 0)));
-				}
-				for (; it != cw->end(); ++it) {
-					words3b.insert(std::make_pair(*it, MeanPair(0, 0)));
-				}
-				
-				// Expensive suffix sort approach.
-				auto* buffer = builder.getBuffer();
-				// Find interesting indexes.
-				std::vector<uint32_t> indexes;
-				size_t num_words = 0;
-				static const size_t kSuffixOffset = 0;
-				const uint8_t* arr = &buffer->operator[](0);
-				for (size_t pos = 0; pos < buffer->size(); ) {
-					if (isWordChar(arr[pos])) {
-						size_t len = 0;
-						for (;pos + len < buffer->size() && isWordChar(arr[pos + len]); ++len) {
-						}
-						std::string s(arr + pos, arr + pos + len);
-						if (words2b.find(s) != words2b.end() || words3b.find(s) != words3b.end()) {
-							indexes.push_back(pos + kSuffixOffset);
-						}
-						++num_words;
-						pos += len;
-					} else {
-						++pos;
-					}
-				}
-
-				SuffixSortComparator cmp(arr);
-				auto start = clock();
-				std::cout << "sorting " << indexes.size() << "/" << num_words << std::endl;
-				std::sort(indexes.begin(), indexes.end(), cmp);
-				std::cout << "sorting took " << clockToSeconds(clock() - start) << std::endl;
-
-				// Use suffix to build avg indexes.
-				// Whether or not do dump suffixes.
-				// std::ofstream fout("suffixes.txt");
-				for (size_t i = 0; i < indexes.size(); ++i) {
-					size_t pos = indexes[i] - kSuffixOffset;
-					check(isWordChar(arr[pos]));
-					size_t len = 0;
-					for (;pos + len < buffer->size() && isWordChar(arr[pos + len]); ++len) {
-					}
-					std::string s(arr + pos, arr + pos + len);
-
-#if 0
-					auto end = pos + len;
-					std::string str(std::max(arr, arr + pos - 12), std::min(arr + end, arr + buffer->size()));
-					for (auto& c : str) {
-						if (c == '\n') c = '_';
-						if (c == '\t') c = '_';
-					}
-					fout << str << std::endl;
-#endif
-
-					auto it = words2b.find(s);
-					if (it == words2b.end()) {
-						it = words3b.find(s);
-						check(it != words3b.end());
-					}
-					it->second.first += i;
-					++it->second.second;
-				}
-
-				// Re-sort based on averages.
-				std::vector<std::pair<uint32_t, std::string>> sort_arr;
-				// 2b first
-				for (auto& p : words2b) {
-					sort_arr.push_back(std::make_pair(static_cast<uint32_t>(p.second.first / p.second.second), p.first));
-				}
-				std::sort(sort_arr.begin(), sort_arr.end());
-				it = cw->begin() + count1;
-				for (auto& p : sort_arr) {
-					*(it++) = p.second;
-				}
-
-				// 3b first
-				sort_arr.clear();
-				for (auto& p : words3b) {
-					sort_arr.push_back(std::make_pair(static_cast<uint32_t>(p.second.first / p.second.second), p.first));
-				}
-				std::sort(sort_arr.begin(), sort_arr.end());
-				for (auto& p : sort_arr) {
-					*(it++) = p.second;
-				}
-
+			if (!builder.getBuffer()->empty()) {
+				// High mode.
+				orderByContext(*builder.getBuffer(), cw, count1, count2);
+				builder.releaseBuffer();
 			} else {
 				std::sort(cw->begin() + count1, cw->begin() + count1 + count2);
 				std::sort(cw->begin() + count1 + count2, cw->end());
@@ -408,6 +658,10 @@ public:
 
 	// Encodes / decods words / code words.
 	class Filter : public ByteStreamFilter<16 * KB, 16 * KB> {
+	public:
+		// Size, escapes and number of 1b / 2b / 3b first bytes.
+		static const size_t kHeaderSize = 10;
+	private:
 		// Capital conersion.
 		size_t escape_char_;
 		size_t escape_cap_first_;
@@ -419,19 +673,23 @@ public:
 		std::vector<uint8_t> dict_buffer_;
 		size_t dict_buffer_pos_;
 		size_t dict_buffer_size_;
+		// The dictionary the tables refer to, either dict_buffer_ or an external one.
+		const uint8_t* dict_;
+		size_t dict_size_;
+
+		// Words are the null terminated strings in dict_, word i is [word_offsets_[i], word_offsets_[i + 1] - 1).
+		std::vector<uint32_t> word_offsets_;
 
-		// Encoding data structures.
-		std::unordered_map<std::string, CodeWord> encode_map_;
+		// Encoding data structures, open addressing table of word index + 1 and the code for each word.
+		std::vector<uint32_t> encode_table_;
+		std::vector<CodeWord> codes_;
 
 		// State
 		uint8_t last_char_;
 
-		// Decode data structures
-		std::vector<std::string> words1b;
-		size_t word1bstart;
-		std::vector<std::string> words2b;
+		// Decode data structures, index of the first word for each code byte.
+		uint32_t word_base_[256];
 		size_t word2bstart;
-		std::vector<std::string> words3b;
 		size_t word3bstart;
 
 		// Optimizations
@@ -480,75 +738,104 @@ public:
 			dict_buffer_[2] = static_cast<uint8_t>(dict_buffer_size_ >> 8);
 			dict_buffer_[3] = static_cast<uint8_t>(dict_buffer_size_ >> 0);
 			// Generate the actual encode map.
-			generate(*words, num1, num2, num3, true);
-			std::cout << "Dictionary words=" << words->size() << " size=" << prettySize(dict_buffer_.size()) << std::endl;
+			useDict(&dict_buffer_[0], dict_buffer_.size());
+		}
+		const std::vector<uint8_t>& getDictBuffer() const {
+			return dict_buffer_;
 		}
 		void createFromBuffer() {
-			ReadMemoryStream rms(&dict_buffer_);
-			size_t pos = 0;
-			// Save space for dict size.
-			for (size_t i = 0; i < 4; ++i) {
-				rms.get();
-			}
-			// Encode escapes and such.
-			escape_char_ = rms.get();
-			escape_cap_first_ = rms.get();
-			escape_cap_word_ = rms.get();
-			size_t num1 = rms.get();
-			size_t num2 = rms.get();
-			size_t num3 = rms.get();
-			word1bstart = 128;
-			word2bstart = word1bstart + num1;
-			word3bstart = word2bstart + num2;
-			// Encode words.
-			std::vector<std::string> words;	
-			while (rms.tell() != dict_buffer_.size()) {
-				words.push_back(rms.readString());
-			}
-			// Generate the actual encode map.
-			generate(words, num1, num2, num3, false);
-			std::cout << "Dictionary words=" << words.size() << " size=" << prettySize(dict_buffer_.size()) << std::endl;
+			useDict(&dict_buffer_[0], dict_buffer_.size());
+		}
+		// Build the tables for a serialized dictionary, it must outlive the filter.
+		void useDict(const uint8_t* dict, size_t size) {
+			check(size >= kHeaderSize);
+			dict_ = dict;
+			dict_size_ = size;
+			// Skip the dict size.
+			size_t pos = 4;
+			escape_char_ = dict_[pos++];
+			escape_cap_first_ = dict_[pos++];
+			escape_cap_word_ = dict_[pos++];
+			size_t num1 = dict_[pos++];
+			size_t num2 = dict_[pos++];
+			size_t num3 = dict_[pos++];
+			generate(num1, num2, num3);
+			std::cout << "Dictionary words=" << codes_.size() << " size=" << prettySize(size) << std::endl;
 		}
-		void generate(std::vector<std::string>& words, size_t num1, size_t num2, size_t num3, bool encode) {
+		// Index the words that follow the header in dict_ and build the encode and decode tables.
+		void generate(size_t num1, size_t num2, size_t num3) {
 			static const size_t start = 128u;
-			size_t end1 = start + num1;
-			size_t end2 = end1 + num2;
-			size_t end3 = end2 + num3;
+			word_offsets_.clear();
+			size_t pos = kHeaderSize;
+			while (pos < dict_size_) {
+				word_offsets_.push_back(static_cast<uint32_t>(pos));
+				while (pos < dict_size_ && dict_[pos] != '\0') {
+					++pos;
+				}
+				++pos;
+			}
+			const size_t num_words = word_offsets_.size();
+			word_offsets_.push_back(static_cast<uint32_t>(pos));
+			const size_t end1 = start + num1;
+			const size_t end2 = end1 + num2;
+			const size_t end3 = end2 + num3;
+			word2bstart = end1;
+			word3bstart = end2;
+			// Codes past the end of the dictionary map to an extra empty word.
+			std::fill(word_base_, word_base_ + 256, static_cast<uint32_t>(num_words));
 			size_t idx = 0;
+			for (size_t b1 = start; b1 < end3 && b1 < 256; ++b1) {
+				word_base_[b1] = static_cast<uint32_t>(std::min(idx, num_words));
+				idx += b1 < end1 ? 1 : (b1 < end2 ? 128 : 128 * 128);
+			}
+			word_offsets_.push_back(word_offsets_.back() + 1);
+			codes_.clear();
+			size_t table_size = 1;
+			while (table_size < num_words * 2) {
+				table_size *= 2;
+			}
+			encode_table_.assign(table_size, 0u);
 			for (size_t b1 = start; b1 < end1; ++b1) {
-				if (idx < words.size()) {
-					if (encode) {
-						encode_map_.insert(std::make_pair(words[idx++], CodeWord(1, static_cast<uint8_t>(b1))));
-					} else {
-						words1b.push_back(words[idx++]);
-					}
-				}
+				codes_.push_back(CodeWord(1, static_cast<uint8_t>(b1)));
 			}
 			for (size_t b1 = end1; b1 < end2; ++b1) {
 				for (size_t b2 = start; b2 < 256; ++b2) {
-					if (idx < words.size()) {
-						if (encode) {
-							encode_map_.insert(std::make_pair(words[idx++], CodeWord(2, static_cast<uint8_t>(b1), static_cast<uint8_t>(b2))));
-						} else {
-							words2b.push_back(words[idx++]);
-						}
-					}
+					codes_.push_back(CodeWord(2, static_cast<uint8_t>(b1), static_cast<uint8_t>(b2)));
 				}
 			}
-			for (size_t b1 = end2; b1 < end3; ++b1) {
+			for (size_t b1 = end2; b1 < end3 && codes_.size() < num_words; ++b1) {
 				for (size_t b2 = start; b2 < 256; ++b2) {
 					for (size_t b3 = start; b3 < 256; ++b3) {
-						if (idx < words.size()) {
-							if (encode) {
-								encode_map_.insert(std::make_pair(
-									words[idx++], CodeWord(3, static_cast<uint8_t>(b1), static_cast<uint8_t>(b2), static_cast<uint8_t>(b3))));
-							} else {
-								words3b.push_back(words[idx++]);
-							}
-						}
+						codes_.push_back(CodeWord(3, static_cast<uint8_t>(b1), static_cast<uint8_t>(b2), static_cast<uint8_t>(b3)));
 					}
 				}
 			}
+			// Words without a code are not encoded, the first copy of a word wins.
+			codes_.resize(std::min(num_words, codes_.size()));
+			for (size_t i = 0; i < codes_.size(); ++i) {
+				const uint8_t* word = dict_ + word_offsets_[i];
+				const size_t len = word_offsets_[i + 1] - word_offsets_[i] - 1;
+				if (findWord(word, len) == nullptr) {
+					size_t slot = hashWord(word, word + len) & (table_size - 1);
+					while (encode_table_[slot] != 0) {
+						slot = (slot + 1) & (table_size - 1);
+					}
+					encode_table_[slot] = static_cast<uint32_t>(i + 1);
+				}
+			}
+		}
+		forceinline const CodeWord* findWord(const uint8_t* word, size_t len) const {
+			const size_t mask = encode_table_.size() - 1;
+			for (size_t slot = hashWord(word, word + len) & mask; ; slot = (slot + 1) & mask) {
+				const uint32_t idx = encode_table_[slot];
+				if (idx == 0) {
+					return nullptr;
+				}
+				const uint32_t offset = word_offsets_[idx - 1];
+				if (word_offsets_[idx] - offset - 1 == len && std::equal(word, word + len, dict_ + offset)) {
+					return &codes_[idx - 1];
+				}
+			}
 		}
 		virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
 			uint8_t* in_ptr = in;
@@ -575,24 +862,25 @@ public:
 						}
 						const size_t max_out = static_cast<size_t>(out_limit - out_ptr);
 						if (word_len >= 3 && word_len <= kMaxWordLen) {
-							std::string word(in_ptr, in_ptr + word_len);
+							uint8_t* word = word_;
+							std::copy(in_ptr, in_ptr + word_len, word);
 							size_t upper_count = 0;
 							for (size_t i = 0; i < word_len; ++i) {
 								upper_count += isUpperCase(in_ptr[i]);
 							}
 							if (upper_count == word_len) {
-								for (auto& c : word) c = makeLowerCase(c);
+								for (size_t i = 0; i < word_len; ++i) word[i] = makeLowerCase(word[i]);
 							} else if (upper_count == 1 && isUpperCase(in_ptr[0])) {
 								word[0] = makeLowerCase(word[0]);
 							}
-							auto it = encode_map_.find(word);
-							if (it != encode_map_.end()) {
+							const CodeWord* code = findWord(word, word_len);
+							if (code != nullptr) {
 								if (upper_count == word_len) {
 									*(out_ptr++) = escape_cap_word_;
 								} else if (upper_count == 1 && isUpperCase(in_ptr[0])) {
 									*(out_ptr++) = escape_cap_first_;
 								}
-								auto& code_word = it->second;
+								auto& code_word = *code;
 								const auto num_bytes = code_word.numBytes();
 								dcheck(num_bytes >= 1 && num_bytes <= 3);
 								*(out_ptr++) = code_word.byte1();
@@ -640,31 +928,31 @@ public:
 					const bool all_cap = c == escape_cap_word_;
 					if (c >= 128 || first_cap || all_cap) {
 						if (first_cap || all_cap) c = *(in_ptr++);
-						std::string* word;
 						assert(c >= 128);
-						if (c < word2bstart) {
-							word = &words1b[c - word1bstart];
-						} else if (c < word3bstart) {
+						size_t idx = word_base_[c];
+						if (c >= word2bstart) {
 							int c2 = *(in_ptr++);
-							assert(c2 >= 128);
-							word = &words2b[(c - word2bstart) * 128 + c2 - start_byte];
-						} else {
-							assert(c >= word3bstart);
-							int c2 = *(in_ptr++);
-							int c3 = *(in_ptr++);
 							assert(c2 >= start_byte);
-							assert(c3 >= start_byte);
-							word = &words3b[(c - word3bstart) * 128 * 128 + (c2 - start_byte) * 128 + c3 - start_byte];
+							if (c < word3bstart) {
+								idx += c2 - start_byte;
+							} else {
+								int c3 = *(in_ptr++);
+								assert(c3 >= start_byte);
+								idx += (c2 - start_byte) * 128 + c3 - start_byte;
+							}
 						}
-						const size_t word_len = word->length();
-						auto* word_start = &word->operator[](0);
-						std::copy(word_start, word_start + word_len, out_ptr);
+						idx = std::min(idx, word_offsets_.size() - 2);
+						const uint32_t offset = word_offsets_[idx];
+						const size_t word_len = word_offsets_[idx + 1] - offset - 1;
+						std::copy(dict_ + offset, dict_ + offset + word_len, out_ptr);
 						const size_t capital_c = all_cap ? word_len : static_cast<size_t>(first_cap);
 						for (size_t i = 0; i < capital_c; ++i) {
 							out_ptr[i] = makeUpperCase(out_ptr[i]);
 						}
 						out_ptr += word_len;
-						last_char_ = out_ptr[-1];
+						if (word_len != 0) {
+							last_char_ = out_ptr[-1];
+						}
 						continue;
 					}
 					if (c == escape_char_) {
@@ -690,12 +978,81 @@ public:
 			, last_char_(0) {
 			init();
 		}
+		// Uses an external dictionary instead of one stored in the stream, for both directions.
+		Filter(Stream* stream, const uint8_t* dict, size_t dict_size)
+			: ByteStreamFilter(stream), dict_buffer_pos_(0), dict_buffer_size_(0), last_char_(0) {
+			init();
+			useDict(dict, dict_size);
+		}
 		void init() {
 			for (size_t i = 0; i < 256; ++i) {
 				is_word_char_[i] = isWordChar(i);
 			}
 		}
 	};
+
+	// Dictionary file shared between archives. Archives only record its hash.
+	// magic
+	// version
+	// serialized dictionary, as stored at the start of a filtered stream
+	class ExternalDict {
+	public:
+		static const size_t kMagicLength = 7;
+		static const uint8_t kVersion = 1;
+
+		static const char* getMagic() {
+			return "MCMDICT";
+		}
+
+		// Returns 0 on success, errno otherwise.
+		static int write(const std::string& name, const std::vector<uint8_t>& dict) {
+			::File fout;
+			int err = fout.open(name, std::ios_base::out | std::ios_base::binary);
+			if (err != 0) {
+				return err;
+			}
+			fout.write(reinterpret_cast<const uint8_t*>(getMagic()), kMagicLength);
+			fout.put(kVersion);
+			fout.write(&dict[0], dict.size());
+			return fout.close() != 0 ? errno : 0;
+		}
+
+		// False if the file can't be read or isn't a dictionary.
+		bool open(const std::string& name) {
+			if (file_.open(name) != 0 || file_.getSize() < kMagicLength + 1 + Filter::kHeaderSize) {
+				return false;
+			}
+			const uint8_t* data = file_.getData();
+			if (!std::equal(data, data + kMagicLength, reinterpret_cast<const uint8_t*>(getMagic())) || data[kMagicLength] != kVersion) {
+				return false;
+			}
+			// The serialized dictionary starts with its size.
+			const uint8_t* dict = getDict();
+			const size_t size = (static_cast<size_t>(dict[0]) << 24) | (static_cast<size_t>(dict[1]) << 16) |
+				(static_cast<size_t>(dict[2]) << 8) | static_cast<size_t>(dict[3]);
+			if (size != getDictSize()) {
+				return false;
+			}
+			hash_ = Dedup::hash128(dict, size);
+			return true;
+		}
+
+		const uint8_t* getDict() const {
+			return file_.getData() + kMagicLength + 1;
+		}
+
+		size_t getDictSize() const {
+			return file_.getSize() - kMagicLength - 1;
+		}
+
+		const Dedup::Hash128& getHash() const {
+			return hash_;
+		}
+
+	private:
+		MappedFile file_;
+		Dedup::Hash128 hash_;
+	};
 	
 	Dict() {
 
@@ -25,15 +25,23 @@
 #define _FILE_STREAM_HPP_
 
 #include <cassert>
+#include <cerrno>
 #include <fstream>
 #include <mutex>
 #include <stdio.h>
 #include <sstream>
+#include <vector>
 
 #include "Compressor.hpp"
 #include "Stream.hpp"
 
-#ifndef WIN32
+#ifdef WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #define _fseeki64 fseeko
 #define _ftelli64 ftello
 // extern int __cdecl _fseeki64(FILE *, int64_t, int);
@@ -77,13 +85,30 @@ inline std::vector<FileInfo> EnumerateFiles(const std::string& dir) {
 
 class File : public Stream {
 protected:
+	enum Op {
+		kOpNone,
+		kOpRead,
+		kOpWrite,
+	};
 	std::mutex lock;
 	uint64_t offset; // Current offset in the file.
 	FILE* handle;
+	Op last_op_;
+
+	// stdio needs a seek when switching between reading and writing.
+	forceinline void switchOp(Op op) {
+		if (UNLIKELY(last_op_ != op)) {
+			if (last_op_ != kOpNone) {
+				_fseeki64(handle, offset, SEEK_SET);
+			}
+			last_op_ = op;
+		}
+	}
 public:
 	File()
 		: handle(nullptr),
-		  offset(0) {
+		  offset(0),
+		  last_op_(kOpNone) {
 	}
 
 	std::mutex& getLock() {
@@ -92,6 +117,7 @@ public:
 
 	// Not thread safe.
 	void write(const uint8_t* bytes, size_t count) {
+		switchOp(kOpWrite);
 		while (count != 0) {
 			size_t ret = fwrite(bytes, 1, count, handle);
 			if (ret == 0 && ferror(handle) != 0) {
@@ -110,6 +136,7 @@ public:
 
 	// Not thread safe.
 	forceinline void put(int c) {
+		switchOp(kOpWrite);
 		++offset;
 		fputc(c, handle);
 	}
@@ -126,6 +153,7 @@ public:
 
 	void rewind() {
 		offset = 0;
+		last_op_ = kOpNone;
 		::rewind(handle);
 	}
 
@@ -149,6 +177,7 @@ public:
 			oss << "b";
 		}
 		handle = fopen(fileName.c_str(), oss.str().c_str());
+		last_op_ = kOpNone;
 		if (handle != nullptr) {
 			offset = 0;
 			return 0;
@@ -158,6 +187,7 @@ public:
 
 	// Not thread safe.
 	size_t read(uint8_t* buffer, size_t bytes) {
+		switchOp(kOpRead);
 		size_t ret = fread(buffer, 1, bytes, handle);
 		offset += ret;
 		return ret;
@@ -165,6 +195,7 @@ public:
 
 	// Not thread safe.
 	int get() {
+		switchOp(kOpRead);
 		++offset;
 		return fgetc(handle);
 	}
@@ -182,6 +213,7 @@ public:
 			return 0; // No need to do anything.
 		}
 		int ret = _fseeki64(handle, pos, origin);
+		last_op_ = kOpNone;
 		if (ret == 0) {
 			if (origin != SEEK_SET) {
 				// Don't necessarily know where the end is.
@@ -194,6 +226,16 @@ public:
 		return ret;
 	}
 
+	// Drop everything past the current offset.
+	int truncate() {
+		fflush(handle);
+#ifdef WIN32
+		return _chsize_s(_fileno(handle), offset);
+#else
+		return ftruncate(fileno(handle), offset);
+#endif
+	}
+
 	forceinline FILE* getHandle() {
 		return handle;
 	}
@@ -237,6 +279,91 @@ public:
 	}
 };
 
+// Read only view of a whole file, mapped where supported and read into memory otherwise.
+class MappedFile {
+public:
+	MappedFile() : data_(nullptr), size_(0), mapped_(false) {
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	// Returns 0 on success, errno otherwise.
+	int open(const std::string& name) {
+		close();
+#ifdef WIN32
+		FILE* f = fopen(name.c_str(), "rb");
+		if (f == nullptr) {
+			return errno;
+		}
+		_fseeki64(f, 0, SEEK_END);
+		buffer_.resize(static_cast<size_t>(_ftelli64(f)));
+		_fseeki64(f, 0, SEEK_SET);
+		const size_t count = fread(buffer_.data(), 1, buffer_.size(), f);
+		fclose(f);
+		if (count != buffer_.size()) {
+			buffer_.clear();
+			return EIO;
+		}
+		data_ = buffer_.data();
+		size_ = buffer_.size();
+#else
+		const int fd = ::open(name.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return errno;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			const int err = errno;
+			::close(fd);
+			return err;
+		}
+		size_ = static_cast<size_t>(st.st_size);
+		if (size_ != 0) {
+			void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) {
+				const int err = errno;
+				::close(fd);
+				size_ = 0;
+				return err;
+			}
+			data_ = reinterpret_cast<const uint8_t*>(data);
+			mapped_ = true;
+		}
+		::close(fd);
+#endif
+		return 0;
+	}
+
+	void close() {
+#ifndef WIN32
+		if (mapped_) {
+			munmap(const_cast<uint8_t*>(data_), size_);
+		}
+#endif
+		buffer_.clear();
+		data_ = nullptr;
+		size_ = 0;
+		mapped_ = false;
+	}
+
+	const uint8_t* getData() const {
+		return data_;
+	}
+
+	size_t getSize() const {
+		return size_;
+	}
+
+private:
+	const uint8_t* data_;
+	size_t size_;
+	bool mapped_;
+	// Used when the file can't be mapped.
+	std::vector<uint8_t> buffer_;
+};
+
 // Used to mirror data within a file.
 class FileMirror {
 	bool is_dirty_;
@@ -420,6 +547,7 @@ public:
 		seekStart();
 	}
 	void seekStart() {
+		cur_stream_ = nullptr;
 		file_idx_ = -1;
 		range_idx_ = 0;
 		num_ranges_ = 0;
@@ -441,6 +569,29 @@ public:
 	virtual size_t read(uint8_t* buf, size_t n) {
 		return process<false>(buf, n);
 	}
+	// Reads at an offset into the concatenated ranges, doesn't move the stream.
+	virtual size_t readat(uint64_t pos, uint8_t* buf, size_t n) {
+		size_t count = 0;
+		for (const auto& segs : *segments_) {
+			for (const auto& range : segs.ranges_) {
+				if (count == n) {
+					return count;
+				}
+				if (pos >= range.length_) {
+					pos -= range.length_;
+					continue;
+				}
+				const size_t max_c = static_cast<size_t>(std::min(static_cast<uint64_t>(n - count), range.length_ - pos));
+				const size_t read_c = segs.stream_->readat(segs.base_offset_ + range.offset_ + pos, buf + count, max_c);
+				count += read_c;
+				if (read_c != max_c) {
+					return count;
+				}
+				pos = 0;
+			}
+		}
+		return count;
+	}
 	virtual uint64_t tell() const {
 		return count_;
 	}
@@ -175,7 +175,7 @@ public:
 template <uint32_t kBlockSize = 0x10000>
 class ByteBufferFilter : public Filter {
 public:
-	ByteBufferFilter(Stream* stream) : stream_(stream), block_pos_(0), block_size_(0) {
+	ByteBufferFilter(Stream* stream) : stream_(stream), block_pos_(0), block_size_(0), count_(0) {
 		block_.reset(new uint8_t[kBlockSize]);
 		block_data_ = block_.get();
 	}
@@ -230,6 +230,9 @@ public:
 	}
 	virtual void forwardFilter(byte* ptr, size_t size) = 0;
 	virtual void reverseFilter(byte* ptr, size_t size) = 0;
+	uint64_t tell() const {
+		return count_;
+	}
 
 private:
 	size_t refillRead() {
@@ -237,6 +240,7 @@ private:
 		block_pos_ = 0;
 		block_size_ = stream_->read(block_.get(), kBlockSize);
 		forwardFilter(block_data_, block_size_);
+		count_ += block_size_;
 		return block_size_;
 	}
 	size_t flushWrite() {
@@ -252,6 +256,8 @@ private:
 	uint8_t* block_data_;
 	size_t block_size_;
 	size_t block_pos_;
+	// Filtered bytes read so far.
+	uint64_t count_;
 };
 
 
@@ -272,6 +278,37 @@ public:
 	}
 };
 
+// Outer filter on top of inner, both owned. Data goes through inner then outer when reading.
+class FilterChain : public Filter {
+public:
+	FilterChain(Filter* inner, Filter* outer) : inner_(inner), outer_(outer) {
+	}
+	virtual int get() {
+		return outer_->get();
+	}
+	virtual size_t read(byte* buf, size_t n) {
+		return outer_->read(buf, n);
+	}
+	virtual void put(int c) {
+		outer_->put(c);
+	}
+	virtual void write(const byte* buf, size_t n) {
+		outer_->write(buf, n);
+	}
+	virtual uint64_t tell() const {
+		return outer_->tell();
+	}
+	virtual void flush() {
+		outer_->flush();
+		inner_->flush();
+	}
+
+private:
+	// Destroyed in reverse order, outer first.
+	std::unique_ptr<Filter> inner_;
+	std::unique_ptr<Filter> outer_;
+};
+
 template <typename Compressor, typename Filter>
 class FilterCompressor : public Compressor {
 public:
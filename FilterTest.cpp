@@ -21,11 +21,20 @@
     along with MCM.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "ARM64Binary.hpp"
+#include "Archive.hpp"
+#include "ColumnFilter.hpp"
 #include "Compressor.hpp"
 #include "CM.hpp"
 #include "DeltaFilter.hpp"
+#include "Dict.hpp"
 #include "Filter.hpp"
+#include "FloatFilter.hpp"
+#include "RISCVBinary.hpp"
+#include "RecordFilter.hpp"
 #include "TurboCM.hpp"
+#include "UTF16Filter.hpp"
+#include "Wav16.hpp"
 #include "X86Binary.hpp"
 
 #include <numeric>
@@ -40,6 +49,24 @@ static const uint32_t kBenchDataSize = 7654321;
 
 typedef FixedDeltaFilter<2, 2> WavDeltaFilter;
 
+template <size_t kStride, uint32_t kMode>
+class FixedRecordFilter : public RecordFilter {
+public:
+	FixedRecordFilter(Stream* stream) : RecordFilter(stream, kStride, kMode) { }
+};
+
+template <size_t kWidth, uint32_t kMode>
+class FixedFloatFilter : public FloatFilter {
+public:
+	FixedFloatFilter(Stream* stream) : FloatFilter(stream, kWidth, kMode) { }
+};
+
+template <uint32_t kByteOrder>
+class FixedUTF16Filter : public UTF16Filter {
+public:
+	FixedUTF16Filter(Stream* stream) : UTF16Filter(stream, kByteOrder) { }
+};
+
 class SimpleFilter : public ByteStreamFilter<4 * KB, 4 * KB> {
 public:
 	SimpleFilter(Stream* stream) : ByteStreamFilter(stream) { }
@@ -252,6 +279,149 @@ void testFilter() {
 	}
 }
 
+static void appendText(std::vector<byte>* data, size_t size) {
+	static const char* const kWords[] = { "the ", "record ", "block ", "is ", "repeated ", "twice\n" };
+	for (size_t i = 0; data->size() < size; ++i) {
+		for (const char* c = kWords[(i * 7 + i / 3) % 6]; *c != '\0'; ++c) {
+			data->push_back(*c);
+		}
+	}
+}
+
+// Dedup references may only take whole records out of record blocks, the record filter would see the rest of the
+// block shifted.
+void testPositionalDedup() {
+	std::vector<byte> records;
+	for (uint32_t i = 0; i < 32 * KB; ++i) {
+		const uint32_t value = i * 3 + rand() % 4;
+		records.push_back(static_cast<byte>(i));
+		records.push_back(static_cast<byte>(i >> 8));
+		records.push_back(static_cast<byte>(value));
+		records.push_back(static_cast<byte>(value >> 8));
+		records.push_back(0x7F);
+		records.push_back(static_cast<byte>(rand() % 3));
+	}
+	std::vector<byte> data;
+	appendText(&data, 16 * KB);
+	data.insert(data.end(), records.begin(), records.end());
+	appendText(&data, data.size() + 16 * KB);
+	data.insert(data.end(), records.begin(), records.end());
+	appendText(&data, data.size() + 16 * KB);
+	Analyzer analyzer;
+	analyzer.analyze(&ReadMemoryStream(&data));
+	Dedup dedup;
+	dedup.findDuplicates(&ReadMemoryStream(&data));
+	Dedup::Refs refs = dedup.getRefs();
+	Archive::alignPositionalRefs(&refs, analyzer.getBlocks());
+	size_t record_blocks = 0;
+	uint64_t deduped = 0;
+	uint64_t pos = 0;
+	for (const auto& b : analyzer.getBlocks()) {
+		if (b.profile() == Detector::kProfileRecord) {
+			++record_blocks;
+			for (const auto& ref : refs) {
+				if (ref.dst_ < pos + b.length() && pos < ref.dst_ + ref.length_) {
+					check(ref.dst_ >= pos && ref.dst_ + ref.length_ <= pos + b.length());
+					check((ref.dst_ - pos) % b.stride() == 0 && ref.length_ % b.stride() == 0);
+					deduped += ref.length_;
+				}
+			}
+		}
+		pos += b.length();
+	}
+	check(record_blocks == 2);
+	// Most of the second copy still goes.
+	check(deduped >= records.size() / 2);
+}
+
+// Float arrays that do not start on a multiple of the value size are still detected as floats, after a short binary
+// block up to the first value.
+void testFloatDetection() {
+	for (size_t width = 4; width <= 8; width += 4) {
+		const size_t prefix = width == 4 ? 1 : 3;
+		std::vector<byte> data(prefix, 0x55);
+		for (size_t i = 0; i < 16 * KB; ++i) {
+			const double value = 100.0 * sin(static_cast<double>(i) * 0.01) + static_cast<double>(rand() % 100) * 0.001;
+			byte bytes[8];
+			if (width == 4) {
+				const float f = static_cast<float>(value);
+				memcpy(bytes, &f, width);
+			} else {
+				memcpy(bytes, &value, width);
+			}
+			data.insert(data.end(), bytes, bytes + width);
+		}
+		Analyzer analyzer;
+		analyzer.analyze(&ReadMemoryStream(&data));
+		uint64_t pos = 0, floats = 0;
+		for (const auto& b : analyzer.getBlocks()) {
+			check(b.profile() != Detector::kProfileRecord);
+			if (b.profile() == Detector::kProfileFloat) {
+				check(b.stride() == width && pos % width == prefix);
+				floats += b.length();
+			}
+			pos += b.length();
+		}
+		check(floats * 10 >= data.size() * 9);
+	}
+}
+
+// Round trip of a noisy sine through the wave model, which has to code it in under kMaxTenthBits / 10 bits per sample.
+template <size_t kSampleBytes, size_t kChannels, size_t kMaxTenthBits>
+void testWave() {
+	std::vector<byte> data;
+	const size_t frames = 32 * KB + rand() % 16;
+	for (size_t i = 0; i < frames; ++i) {
+		for (size_t ch = 0; ch < kChannels; ++ch) {
+			const double amplitude = kSampleBytes == 1 ? 100.0 : 10000.0;
+			const int value = static_cast<int>(amplitude * sin(static_cast<double>(i * (ch + 1)) * 0.02)) + rand() % 3 - 1;
+			const uint32_t sample = static_cast<uint32_t>(kSampleBytes == 1 ? value + 128 : value);
+			for (size_t j = 0; j < kSampleBytes; ++j) {
+				data.push_back(static_cast<byte>(sample >> (8 * j)));
+			}
+		}
+	}
+	// A partial last frame.
+	data.push_back(0x55);
+	std::vector<byte> out_data;
+	Wav16<kSampleBytes, kChannels> comp;
+	comp.compress(&ReadMemoryStream(&data), &WriteVectorStream(&out_data), data.size());
+	check(out_data.size() * 80 < frames * kChannels * kMaxTenthBits);
+	std::vector<byte> result;
+	Wav16<kSampleBytes, kChannels> decomp;
+	decomp.decompress(&ReadMemoryStream(&out_data), &WriteVectorStream(&result), data.size());
+	check(result == data);
+}
+
+// Filter throughput without a compressor, stored output.
+template<class FilterType>
+void speedFilter(const std::vector<byte>& data) {
+	Store store;
+	std::vector<byte> out_data;
+	uint64_t start = clock();
+	for (uint32_t i = 0; i < kTestIterations; ++i) {
+		out_data.clear();
+		ReadMemoryStream rms(&data);
+		FilterType f(&rms);
+		WriteVectorStream wvs(&out_data);
+		store.compress(&f, &wvs, std::numeric_limits<uint64_t>::max());
+	}
+	std::cout << "Filter forward: " << data.size() << "->" << out_data.size() << " rate="
+		<< prettySize(computeRate(data.size() * kTestIterations, clock() - start)) << "/S" << std::endl;
+	std::vector<byte> result;
+	start = clock();
+	for (uint32_t i = 0; i < kTestIterations; ++i) {
+		result.clear();
+		WriteVectorStream wvs(&result);
+		FilterType reverse_filter(&wvs);
+		ReadMemoryStream rms(&out_data);
+		store.decompress(&rms, &reverse_filter, std::numeric_limits<uint64_t>::max());
+		reverse_filter.flush();
+	}
+	std::cout << "Filter reverse: " << prettySize(computeRate(data.size() * kTestIterations, clock() - start)) << "/S" << std::endl;
+	check(result == data);
+}
+
 template<class FilterType>
 void benchFilter(const std::vector<byte>& data) {
 	CM<kCMTypeMax> comp(6);
@@ -315,11 +485,29 @@ void runFilterTests() {
 		testFilter<SplitFilter>();
 		testFilter<X86BinaryFilter>();
 		testFilter<X86AdvancedFilter>();
+		testFilter<X64Filter>();
+		testFilter<ARM64Filter>();
+		testFilter<RISCVFilter>();
 		testFilter<Delta16>();
 		testFilter<FixedDeltaFilter<1, 1>>();
 		testFilter<FixedDeltaFilter<2, 1>>();
 		testFilter<FixedDeltaFilter<1, 2>>();
+		testFilter<FixedRecordFilter<3, RecordFilter::kModeDelta>>();
+		testFilter<FixedRecordFilter<24, RecordFilter::kModeTranspose>>();
+		testFilter<FixedRecordFilter<256, RecordFilter::kModeBoth>>();
+		testFilter<FixedFloatFilter<4, FloatFilter::kModePlanes | FloatFilter::kModeDelta>>();
+		testFilter<FixedFloatFilter<8, FloatFilter::kModePlanes | FloatFilter::kModeXor>>();
+		testFilter<FixedFloatFilter<4, FloatFilter::kModeXor | FloatFilter::kModeDelta>>();
+		testFilter<ColumnFilter>();
+		testFilter<FixedUTF16Filter<UTF16Filter::kLittleEndian>>();
+		testFilter<FixedUTF16Filter<UTF16Filter::kBigEndian>>();
 		testFilter<IdentityFilter>();
+		testPositionalDedup();
+		testFloatDetection();
+		testWave<2, 2, 42>();
+		// The byte contexts of 8 bit samples take it from about 2.65 to 2.35.
+		testWave<1, 1, 25>();
+		testWave<1, 2, 25>();
 		std::cout << "Running test " << i << std::endl;
 	}
 	std::cout << "Done running " << kTestIterations << " test iterations" << std::endl;
@@ -350,6 +538,7 @@ void runFilterTests() {
 	for (uint32_t i = 0; i < 256; ++i) {
 		std::cout << i << "=" << freq[i] << std::endl;
 	}
+	speedFilter<X86AdvancedFilter>(data);
 	//benchFilter<Delta16>(data);
 	//benchFilter<X86AdvancedFilter>(data);
 	//benchFilter<Delta8>(data);
@@ -0,0 +1,150 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _FLOAT_FILTER_HPP_
+#define _FLOAT_FILTER_HPP_
+
+#include <memory>
+
+#include "Filter.hpp"
+
+// Transform for arrays of little endian IEEE-754 floats or doubles. Floats are rotated left by one bit so that the
+// exponent is the top byte and the sign the bottom bit, the 11 bit exponent of doubles doesn't fit a byte so they
+// are not. Each value is then optionally XORed with the value before and / or has each byte replaced by its
+// difference to the same byte of the value before. The values of a block are stored as byte planes, top byte
+// first, so the exponents are together and the mantissa bytes follow from the most to the least predictable.
+// Bytes after the last whole value are not changed.
+class FloatFilter : public ByteBufferFilter<64 * KB> {
+public:
+	static const size_t kBlockSize = 64 * KB;
+	enum Mode {
+		kModePlanes = 1,
+		kModeXor = 2,
+		kModeDelta = 4,
+	};
+
+	FloatFilter(Stream* stream, size_t width, uint32_t mode)
+		: ByteBufferFilter(stream), width_(width), mode_(mode), prev_(0) {
+		check(width_ == 4 || width_ == 8);
+		buffer_.reset(new uint8_t[kBlockSize]);
+	}
+	virtual void forwardFilter(byte* ptr, size_t size) {
+		if (width_ == 4) {
+			process<true, 4>(ptr, size);
+		} else {
+			process<true, 8>(ptr, size);
+		}
+	}
+	virtual void reverseFilter(byte* ptr, size_t size) {
+		if (width_ == 4) {
+			process<false, 4>(ptr, size);
+		} else {
+			process<false, 8>(ptr, size);
+		}
+	}
+	static uint32_t getMaxExpansion() {
+		return 1;
+	}
+	void dumpInfo() const {
+	}
+	void setOpt(uint32_t s) {
+	}
+
+	// Exponent field of the little endian value at ptr.
+	static uint32_t exponent(const uint8_t* ptr, size_t width) {
+		if (width == 4) {
+			return ((ptr[3] & 0x7F) << 1) | (ptr[2] >> 7);
+		}
+		return ((ptr[7] & 0x7F) << 4) | (ptr[6] >> 4);
+	}
+
+private:
+	template <size_t kWidth>
+	static forceinline uint64_t rotateLeft(uint64_t value) {
+		return kWidth == 4 ? ((value << 1) | (value >> 31)) & 0xFFFFFFFF : value;
+	}
+	template <size_t kWidth>
+	static forceinline uint64_t rotateRight(uint64_t value) {
+		return kWidth == 4 ? (value >> 1) | ((value & 1) << 31) : value;
+	}
+
+	// Each byte minus the same byte of b.
+	template <size_t kWidth>
+	static forceinline uint64_t subBytes(uint64_t a, uint64_t b) {
+		uint64_t ret = 0;
+		for (size_t j = 0; j < kWidth; ++j) {
+			ret |= static_cast<uint64_t>(static_cast<uint8_t>((a >> (8 * j)) - (b >> (8 * j)))) << (8 * j);
+		}
+		return ret;
+	}
+
+	template <bool encode, size_t kWidth>
+	void process(byte* ptr, size_t size) {
+		const size_t count = size / kWidth;
+		const bool planes = (mode_ & kModePlanes) != 0;
+		const bool xor_delta = (mode_ & kModeXor) != 0, delta = (mode_ & kModeDelta) != 0;
+		uint8_t* const buffer = buffer_.get();
+		for (size_t i = 0; i < count; ++i) {
+			uint64_t value = 0;
+			for (size_t j = 0; j < kWidth; ++j) {
+				// Plane j holds byte kWidth - 1 - j of each value.
+				uint8_t c = encode || !planes ? ptr[i * kWidth + j] : ptr[(kWidth - 1 - j) * count + i];
+				if (!encode && delta) {
+					c += static_cast<uint8_t>(prev_ >> (8 * j));
+				}
+				value |= static_cast<uint64_t>(c) << (8 * j);
+			}
+			if (encode) {
+				const uint64_t rotated = rotateLeft<kWidth>(value);
+				value = xor_delta ? rotated ^ prev_ : rotated;
+				if (delta) {
+					value = subBytes<kWidth>(value, prev_);
+				}
+				prev_ = rotated;
+			} else {
+				if (xor_delta) {
+					value ^= prev_;
+				}
+				prev_ = value;
+				value = rotateRight<kWidth>(value);
+			}
+			for (size_t j = 0; j < kWidth; ++j) {
+				const uint8_t c = static_cast<uint8_t>(value >> (8 * j));
+				if (encode && planes) {
+					buffer[(kWidth - 1 - j) * count + i] = c;
+				} else {
+					buffer[i * kWidth + j] = c;
+				}
+			}
+		}
+		std::copy(buffer, buffer + count * kWidth, ptr);
+	}
+
+	const size_t width_;
+	const uint32_t mode_;
+	// Last value after the rotate, carried over from block to block.
+	uint64_t prev_;
+	std::unique_ptr<uint8_t[]> buffer_;
+};
+
+#endif
@@ -0,0 +1,377 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _IMAGE_HPP_
+#define _IMAGE_HPP_
+
+#include <cstdlib>
+#include <vector>
+
+#include "Compressor.hpp"
+#include "CyclicBuffer.hpp"
+#include "Log.hpp"
+#include "Mixer.hpp"
+#include "Model.hpp"
+#include "Range.hpp"
+#include "SSE.hpp"
+#include "Stream.hpp"
+#include "Util.hpp"
+
+// Compressor for uncompressed rasters. Each byte is predicted from the same channel of the neighbouring pixels,
+// with whichever of a few predictors had the lowest recent error, and the difference to the prediction is coded bit
+// by bit. The contexts come from the W, N, NW and NE neighbours, the residuals around it and the residual of the
+// channel before in the same pixel. Rows are row_bytes apart so row padding is coded like another channel. A match
+// model over the earlier bytes catches the repeats of screenshots and drawings, long matches code whole bytes.
+class Image : public Compressor {
+public:
+	// SS table
+	static const uint32_t kShift = 12;
+	static const int kMaxValue = 1 << kShift;
+	static const int kMinST = -kMaxValue / 2;
+	static const int kMaxST = kMaxValue / 2;
+	typedef ss_table<short, kMaxValue, kMinST, kMaxST, 8> SSTable;
+	typedef bitLearnModel<kShift, 8, 30> BitModel;
+	// Context tables and the match model.
+	static const size_t kTables = 8;
+	static const size_t kInputs = kTables + 1;
+	typedef Mixer<int, kInputs, 17, 11> ImageMixer;
+
+	static const size_t kMaxPixelBytes = 4;
+	// Bit models per context table, each context has 256 for the bits of the residual.
+	static const size_t kTableBits = 20;
+	static const size_t kActivityBuckets = 12;
+	static const size_t kResidualBuckets = 17;
+	// Three spatial predictors, then the same ones plus the error they had on the channel before.
+	static const size_t kPredictors = 6;
+	// Matches are found from a hash of about the last 8 bytes.
+	static const size_t kMatchHashBits = 22;
+	static const size_t kHistorySize = 16 * MB;
+	static const size_t kMaxMatchModel = 15;
+	// Matches at least this long code a flag for the expected byte first.
+	static const size_t kLongMatch = 16;
+
+	Image(size_t row_bytes, size_t pixel_bytes) : row_bytes_(row_bytes), pixel_bytes_(pixel_bytes), opt_var_(0) {
+		check(pixel_bytes_ > 0 && pixel_bytes_ <= kMaxPixelBytes);
+		check(row_bytes_ >= pixel_bytes_);
+	}
+
+	bool setOpt(uint32_t var) {
+		opt_var_ = var;
+		return true;
+	}
+
+	virtual void compress(Stream* in_stream, Stream* out_stream, uint64_t max_count) {
+		BufferedStreamReader<4 * KB> sin(in_stream);
+		BufferedStreamWriter<4 * KB> sout(out_stream);
+		init();
+		ent_.init();
+		for (uint64_t i = 0; i < max_count; ++i) {
+			const int c = sin.get();
+			if (c == EOF) {
+				break;
+			}
+			processByte<false>(sout, static_cast<uint8_t>(c));
+		}
+		ent_.flush(sout);
+		sout.flush();
+	}
+
+	virtual void decompress(Stream* in_stream, Stream* out_stream, uint64_t max_count) {
+		BufferedStreamReader<4 * KB> sin(in_stream);
+		BufferedStreamWriter<4 * KB> sout(out_stream);
+		init();
+		ent_.initDecoder(sin);
+		for (; max_count > 0; --max_count) {
+			sout.put(processByte<true>(sin));
+		}
+		sout.flush();
+		size_t remain = sin.remain();
+		if (remain > 0) {
+			// Go back all the characters we didn't actually read.
+			auto target = in_stream->tell() - remain;
+			in_stream->seek(target);
+		}
+	}
+
+private:
+	void init() {
+		table_.build(0);
+		// Rows have kMaxPixelBytes of padding on the right and twice that on the left.
+		padded_row_ = row_bytes_ + 3 * kMaxPixelBytes;
+		rows_.assign(3 * padded_row_, 0);
+		residuals_.assign(2 * padded_row_, 0);
+		row_ = 0;
+		x_ = 0;
+		for (auto& errors : pred_errors_) {
+			std::fill(errors, errors + kPredictors, 0);
+		}
+		for (auto& t : models_) {
+			t.resize(1u << kTableBits);
+			for (auto& m : t) {
+				m.init();
+			}
+		}
+		mixers_.resize(kMaxPixelBytes * kActivityBuckets * 8);
+		for (auto& m : mixers_) {
+			m.init(382);
+		}
+		sse_.init(kMaxPixelBytes * kResidualBuckets * 256, &table_);
+		history_.resize(kHistorySize);
+		history_.restart();
+		match_table_.assign(1u << kMatchHashBits, 0);
+		match_hash_ = 0;
+		match_pos_ = match_len_ = 0;
+		for (auto& m : match_models_) {
+			m.init();
+		}
+		for (auto& m : long_match_models_) {
+			m.init();
+		}
+	}
+
+	static forceinline int clampPixel(int v) {
+		return std::max(std::min(v, 255), 0);
+	}
+
+	// Signed log buckets of a difference, 0 to kResidualBuckets - 1.
+	static forceinline size_t quantize(int d) {
+		const size_t bucket = bitLength(std::min(std::abs(d), 255));
+		return d < 0 ? 8 - bucket : 8 + bucket;
+	}
+
+	static forceinline size_t bitLength(size_t v) {
+		size_t ret = 0;
+		for (; v != 0; v >>= 1) {
+			++ret;
+		}
+		return ret;
+	}
+
+	// Residuals are folded so that small ones of either sign have the high bits clear.
+	static forceinline uint32_t fold(int r) {
+		return r >= 0 ? 2 * r : -2 * r - 1;
+	}
+	static forceinline int unfold(uint32_t folded) {
+		return folded & 1 ? -static_cast<int>(folded + 1) / 2 : static_cast<int>(folded / 2);
+	}
+
+	// Context table index of the first bit model of a context.
+	static forceinline uint32_t base(uint32_t ctx, uint32_t k) {
+		return ((ctx + k * 0x3C6EF372u) * 0x9E3779B1u) >> (32 - (kTableBits - 8)) << 8;
+	}
+
+	static forceinline uint32_t hashFunc(uint32_t a, uint32_t b) {
+		b += a;
+		b += rotate_left(b, 11);
+		return b ^ (b >> 6);
+	}
+
+	forceinline void spatialPredictions(const uint8_t* cur, const uint8_t* up, size_t x, int* out) const {
+		const size_t pb = pixel_bytes_;
+		const int w = cur[x - pb], n = up[x], nw = up[x - pb], ne = up[x + pb];
+		out[0] = clampPixel(w + n - nw);
+		// Smoother ones do better on noise.
+		out[1] = (w + n + 1) / 2;
+		out[2] = clampPixel((3 * w + 3 * n + 2 * ne - 2 * nw + 4) / 8);
+	}
+
+	template <const bool kDecode, typename TStream>
+	uint8_t processByte(TStream& stream, uint8_t value = 0) {
+		const size_t row = static_cast<size_t>(row_ % 6);
+		uint8_t* const cur = &rows_[(row % 3) * padded_row_ + 2 * kMaxPixelBytes];
+		const uint8_t* const up = &rows_[((row + 2) % 3) * padded_row_ + 2 * kMaxPixelBytes];
+		const uint8_t* const up2 = &rows_[((row + 1) % 3) * padded_row_ + 2 * kMaxPixelBytes];
+		int8_t* const res = &residuals_[(row & 1) * padded_row_ + 2 * kMaxPixelBytes];
+		const int8_t* const res_up = &residuals_[((row & 1) ^ 1) * padded_row_ + 2 * kMaxPixelBytes];
+		const size_t x = x_, pb = pixel_bytes_;
+		const uint32_t channel = static_cast<uint32_t>(x % pb);
+		const int w = cur[x - pb], n = up[x], nw = up[x - pb], ne = up[x + pb], nn = up2[x];
+
+		int preds[kPredictors];
+		spatialPredictions(cur, up, x, preds);
+		if (channel != 0) {
+			// Channels tend to change together.
+			int prev[kPredictors / 2];
+			spatialPredictions(cur, up, x - 1, prev);
+			for (size_t k = 0; k < kPredictors / 2; ++k) {
+				preds[kPredictors / 2 + k] = clampPixel(preds[k] + cur[x - 1] - prev[k]);
+			}
+		} else {
+			std::copy(preds, preds + kPredictors / 2, preds + kPredictors / 2);
+		}
+		const uint32_t* const errors = pred_errors_[channel];
+		size_t best = 0, second = 1;
+		for (size_t k = 1; k < kPredictors; ++k) {
+			if (errors[k] < errors[best]) {
+				second = best;
+				best = k;
+			} else if (k != second && errors[k] < errors[second]) {
+				second = k;
+			}
+		}
+		const int pred = preds[best];
+		// Residual of the channel before in the same pixel, or of W for the first one.
+		const int prev_res = channel != 0 ? res[x - 1] : res[x - pb];
+		const size_t activity = std::min(bitLength(std::abs(w - nw) + std::abs(n - nw) + std::abs(ne - n)),
+			kActivityBuckets - 1);
+		// Folded residual the match expects, with a leading 1 like the partial residual in the bit loop.
+		const bool has_match = match_len_ != 0;
+		const uint32_t expected = has_match ? fold(static_cast<int8_t>(static_cast<uint8_t>(history_[match_pos_] - pred))) | 256 : 0;
+		const size_t match_len = std::min(match_len_, kMaxMatchModel);
+
+		uint32_t bases[kTables];
+		bases[0] = base((channel << 8) | static_cast<uint8_t>(prev_res), 0);
+		bases[1] = base((channel << 10) | (quantize(w - pred) << 5) | quantize(n - pred), 1);
+		bases[2] = base((channel << 10) | (quantize(nw - pred) << 5) | quantize(ne - pred), 2);
+		bases[3] = base((channel << 14) | (activity << 10) | (quantize(res[x - pb]) << 5) | quantize(res_up[x]), 3);
+		bases[4] = base((channel << 16) | (w << 8) | n, 4);
+		bases[5] = base(hashFunc((channel << 24) | (w << 16) | (n << 8) | ne, (nw << 8) | nn), 5);
+		bases[6] = base((channel << 13) | (expected << 4) | match_len, 6);
+		bases[7] = base((channel << 10) | (quantize(preds[second] - pred) << 5) | activity, 7);
+		ImageMixer* const mixers = &mixers_[(channel * kActivityBuckets + activity) * 8];
+		const size_t sse_ctx = (channel * kResidualBuckets + quantize(prev_res)) * 256;
+
+		uint32_t folded = kDecode ? 0 : fold(static_cast<int8_t>(static_cast<uint8_t>(value - pred)));
+		uint32_t ctx = 1;
+		if (match_len_ >= kLongMatch) {
+			BitModel* const m = &long_match_models_[channel * 16 + std::min(match_len_ - kLongMatch, static_cast<size_t>(15))];
+			int p = m->getP();
+			p += p == 0;
+			uint32_t bit;
+			if (kDecode) {
+				bit = ent_.getDecodedBit(p, kShift);
+				ent_.Normalize(stream);
+			} else {
+				bit = (folded | 256) == expected;
+				ent_.encode(stream, bit, p, kShift);
+			}
+			m->update(bit);
+			if (bit) {
+				ctx = expected;
+			}
+		}
+		while (ctx < 256) {
+			BitModel* m[kTables];
+			int st[kInputs];
+			for (size_t k = 0; k < kTables; ++k) {
+				m[k] = &models_[k][bases[k] + ctx];
+				st[k] = table_.st(m[k]->getP());
+			}
+			// The match model only predicts while the bits so far are the expected ones.
+			BitModel* mm = nullptr;
+			st[kTables] = 0;
+			const size_t bit_idx = bitLength(ctx) - 1;
+			if (has_match && (expected >> (8 - bit_idx)) == ctx) {
+				mm = &match_models_[match_len * 2 + ((expected >> (7 - bit_idx)) & 1)];
+				st[kTables] = table_.st(mm->getP());
+			}
+			ImageMixer* const mixer = &mixers[bit_idx];
+			const int stp = std::max(std::min(mixer->p(9, st[0], st[1], st[2], st[3], st[4], st[5], st[6], st[7], st[8]),
+				kMaxST - 1), kMinST + 1);
+			const int mixer_p = table_.sq(stp);
+			int p = (mixer_p + 3 * sse_.p(stp + kMaxValue / 2, sse_ctx + ctx)) / 4;
+			p += p == 0;
+			uint32_t bit;
+			if (kDecode) {
+				bit = ent_.getDecodedBit(p, kShift);
+			} else {
+				bit = (folded >> (7 - bit_idx)) & 1;
+				ent_.encode(stream, bit, p, kShift);
+			}
+			mixer->update(mixer_p, bit, kShift, 28, 1, st[0], st[1], st[2], st[3], st[4], st[5], st[6], st[7], st[8]);
+			for (size_t k = 0; k < kTables; ++k) {
+				m[k]->update(bit);
+			}
+			if (mm != nullptr) {
+				mm->update(bit);
+			}
+			sse_.update(bit);
+			ctx = ctx * 2 + bit;
+			if (kDecode) {
+				ent_.Normalize(stream);
+			}
+		}
+		const int r = unfold(ctx ^ 256);
+		value = static_cast<uint8_t>(pred + r);
+		cur[x] = value;
+		res[x] = static_cast<int8_t>(r);
+		uint32_t* const channel_errors = pred_errors_[channel];
+		for (size_t k = 0; k < kPredictors; ++k) {
+			channel_errors[k] += std::abs(value - preds[k]) * 16 - (channel_errors[k] >> 4);
+		}
+		updateMatch(value);
+		if (++x_ == row_bytes_) {
+			x_ = 0;
+			++row_;
+		}
+		return value;
+	}
+
+	void updateMatch(uint8_t value) {
+		if (match_len_ != 0 && history_[match_pos_] == value) {
+			++match_len_;
+			++match_pos_;
+		} else {
+			match_len_ = 0;
+		}
+		history_.push(value);
+		const size_t pos = history_.getPos();
+		// Older bytes are shifted out of the hash.
+		match_hash_ = (match_hash_ * (3 << 3) + value + 1) & ((1u << kMatchHashBits) - 1);
+		if (match_len_ == 0) {
+			const uint32_t candidate = match_table_[match_hash_];
+			if (candidate != 0 && pos - candidate < kHistorySize) {
+				match_pos_ = candidate;
+				match_len_ = 1;
+			}
+		}
+		match_table_[match_hash_] = static_cast<uint32_t>(pos);
+	}
+
+	const size_t row_bytes_;
+	const size_t pixel_bytes_;
+	uint32_t opt_var_;
+	SSTable table_;
+	Range7 ent_;
+	std::vector<BitModel> models_[kTables];
+	std::vector<ImageMixer> mixers_;
+	SSE<kShift> sse_;
+	// Last three rows of pixels and two of residuals, each with padding for the neighbours past the edges.
+	size_t padded_row_;
+	std::vector<uint8_t> rows_;
+	std::vector<int8_t> residuals_;
+	uint64_t row_;
+	size_t x_;
+	// Recent absolute error of each predictor, per channel.
+	uint32_t pred_errors_[kMaxPixelBytes][kPredictors];
+	// Match model.
+	CyclicBuffer<uint8_t> history_;
+	std::vector<uint32_t> match_table_;
+	uint32_t match_hash_;
+	size_t match_pos_;
+	size_t match_len_;
+	BitModel match_models_[(kMaxMatchModel + 1) * 2];
+	BitModel long_match_models_[kMaxPixelBytes * 16];
+};
+
+#endif
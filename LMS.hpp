@@ -0,0 +1,112 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LMS_HPP_
+#define _LMS_HPP_
+
+#include <algorithm>
+#include <emmintrin.h>
+
+#include "Util.hpp"
+
+// Sign-sign LMS predictor over the last kOrder 16 bit inputs, the dot product and the weight update are SSE2.
+// Weights move by a step with the sign of the input times the sign of the error, inputs far above the running
+// average of the magnitudes get larger steps.
+template <size_t kOrder, size_t kShift>
+class SignLMS {
+public:
+	static const size_t kLanes = 8;
+	static const size_t kVectors = kOrder / kLanes;
+	// Inputs added before the history is moved back to the start of the buffers.
+	static const size_t kWindow = 512;
+
+	SignLMS() {
+		static_assert(kOrder % kLanes == 0, "order must be a multiple of the lanes");
+		init();
+	}
+
+	void init() {
+		for (auto& w : weights_) {
+			w = _mm_setzero_si128();
+		}
+		std::fill(input_, input_ + kOrder + kWindow, 0);
+		std::fill(step_, step_ + kOrder + kWindow, 0);
+		pos_ = kOrder;
+		average_ = 0;
+	}
+
+	forceinline int predict() const {
+		const __m128i* input = reinterpret_cast<const __m128i*>(&input_[pos_ - kOrder]);
+		__m128i sum = _mm_setzero_si128();
+		for (size_t i = 0; i < kVectors; ++i) {
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128(input + i), weights_[i]));
+		}
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, shuffle<2, 3, 0, 1>::value));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, shuffle<1, 0, 3, 2>::value));
+		return (_mm_cvtsi128_si32(sum) + (1 << (kShift - 1))) >> kShift;
+	}
+
+	// Adapt to the error of the last prediction and add the next input.
+	forceinline void update(int input, int err) {
+		const __m128i* step = reinterpret_cast<const __m128i*>(&step_[pos_ - kOrder]);
+		if (err > 0) {
+			for (size_t i = 0; i < kVectors; ++i) {
+				weights_[i] = _mm_add_epi16(weights_[i], _mm_loadu_si128(step + i));
+			}
+		} else if (err < 0) {
+			for (size_t i = 0; i < kVectors; ++i) {
+				weights_[i] = _mm_sub_epi16(weights_[i], _mm_loadu_si128(step + i));
+			}
+		}
+		const int magnitude = std::abs(input);
+		int step_size = 0;
+		if (magnitude > average_ * 3) {
+			step_size = 32;
+		} else if (magnitude > average_ * 4 / 3) {
+			step_size = 16;
+		} else if (magnitude > 0) {
+			step_size = 8;
+		}
+		average_ += (magnitude - average_) / 16;
+		step_[pos_] = static_cast<int16_t>(input < 0 ? -step_size : step_size);
+		// Older inputs move the weights less.
+		step_[pos_ - 1] >>= 1;
+		step_[pos_ - 2] >>= 1;
+		step_[pos_ - 8] >>= 1;
+		input_[pos_] = static_cast<int16_t>(std::max(std::min(input, 32767), -32768));
+		if (++pos_ == kOrder + kWindow) {
+			std::copy(input_ + kWindow, input_ + kWindow + kOrder, input_);
+			std::copy(step_ + kWindow, step_ + kWindow + kOrder, step_);
+			pos_ = kOrder;
+		}
+	}
+
+private:
+	__m128i weights_[kVectors];
+	int16_t input_[kOrder + kWindow];
+	int16_t step_[kOrder + kWindow];
+	size_t pos_;
+	int average_;
+};
+
+#endif
@@ -380,19 +380,7 @@ void LZ4::decompressBytes(byte* in, byte* out, uint32_t count) {
 }
 
 size_t MemoryLZ::getMatchLen(byte* m1, byte* m2, byte* limit1) {
-	byte* start = m1;
-	while (m1 < limit1) {
-		uint32_t diff = *reinterpret_cast<uint32_t*>(m1) ^ *reinterpret_cast<uint32_t*>(m2);
-		if (UNLIKELY(diff)) {
-			unsigned long idx = 0;
-			// TODO: Fix _BitScanForward(&idx, diff);
-			m1 += idx >> 3;
-			break;
-		}
-		m1 += sizeof(uint32_t);
-		m2 += sizeof(uint32_t);
-	}
-	return m1 - start;
+	return matchLength(m1, m2, limit1 - m1);
 }
 
 size_t LZFast::getMaxExpansion(size_t in_size) {
@@ -439,16 +427,8 @@ Match GreedyMatchFinder::findNextMatch() {
 					// Improve the match.
 					size_t len = sizeof(lookahead);
 					const auto max_match = std::min(dist, static_cast<size_t>(limit_ - in_ptr_));
-					while (len < max_match) {
-						typedef unsigned long ulong;
-						auto diff = *reinterpret_cast<const ulong*>(in_ptr_ + len) ^ *reinterpret_cast<const ulong*>(match_ptr + len);
-						if (UNLIKELY(diff)) {
-							ulong idx = 0;
-							// TODO: Fix _BitScanForward(&idx, diff);
-							len += idx >> 3;
-							break;
-						}
-						len += sizeof(diff);
+					if (len < max_match) {
+						len += matchLength(in_ptr_ + len, match_ptr + len, max_match - len);
 					}
 					len = std::min(len, max_match);
 					if (len > best_len) {
@@ -702,11 +682,7 @@ size_t VRolz::getMaxExpansion(size_t in_size) {
 }
 
 uint32_t VRolz::getMatchLen(byte* m1, byte* m2, uint32_t max_len) {
-	uint32_t len = 0;
-	while (len <= max_len && m1[len] == m2[len]) {
-		++len;
-	}
-	return len;
+	return static_cast<uint32_t>(matchLength(m1, m2, max_len));
 }
 
 size_t VRolz::compressBytes(byte* in, byte* out, size_t count) {
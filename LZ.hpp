@@ -385,22 +385,11 @@ public:
 		non_match_len_ = in_ptr_ - non_match_ptr_;
 		// Improve the match.
 		size_t len = sizeof(lookahead);
-		while (len < dist) {
-			typedef unsigned long ulong;
-			auto diff = *reinterpret_cast<const ulong*>(in_ptr_ + len) ^ *reinterpret_cast<const ulong*>(match_ptr + len);
-			if (UNLIKELY(diff)) {
-				ulong idx = 0;
-#ifdef WIN32
-				// TODO
-				_BitScanForward(&idx, diff);
-#endif
-				len += idx >> 3;
-				break;
-			}
-			len += sizeof(diff);
+		const size_t max_match = std::min(dist, static_cast<size_t>(limit_ - in_ptr_));
+		if (len < max_match) {
+			len += matchLength(in_ptr_ + len, match_ptr + len, max_match - len);
 		}
-		len = std::min(len, dist);
-		len = std::min(len, static_cast<size_t>(limit_ - in_ptr_));
+		len = std::min(len, max_match);
 		assert(match_ptr + len <= in_ptr_);
 		assert(in_ptr_ + len <= limit_);
 		// Verify match.
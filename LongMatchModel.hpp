@@ -0,0 +1,198 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LONG_MATCH_MODEL_HPP_
+#define _LONG_MATCH_MODEL_HPP_
+
+#include <vector>
+
+#include "CyclicBuffer.hpp"
+#include "Memory.hpp"
+#include "Stream.hpp"
+
+// Finds matches further back than the cyclic buffer window. Sparse anchors are picked by a rolling hash
+// over the last kWindow bytes so that the encoder and decoder agree on them without extra data. Far bytes are
+// read back by position from a history stream, the input when compressing and the output already written when
+// decompressing, so anchors reach back over the whole stream. Without a history stream the bytes the CM has seen
+// are copied into a ring in memory instead, pages are only touched once the stream gets that far.
+class LongMatchModel {
+public:
+	// Bytes covered by the rolling hash, also the verified length of a new match.
+	static const size_t kWindow = 32;
+	// About one in 2^kAnchorBits positions is an anchor.
+	static const size_t kAnchorBits = 5;
+	static const uint32_t kHashMul = 0x2F0B4A23;
+	static const uint64_t kSlotMul = 0x9E3779B97F4A7C15ULL;
+	// Bytes read from the history stream at once, a lot less than the distance of a match so that the decoder
+	// already wrote them.
+	static const size_t kCacheSize = 4 * KB;
+	typedef CyclicBuffer<byte> Buffer;
+
+	// Size is the number of anchor slots and min_dist the distance covered by the regular match model. Far bytes
+	// come from history, or from a ring of the last history_size bytes if it is null. Sizes are powers of 2.
+	void init(size_t size, size_t history_size, size_t min_dist, Stream* history) {
+		hash_mask_ = size - 1;
+		// Check power of 2.
+		assert((hash_mask_ & (hash_mask_ + 1)) == 0);
+		table_storage_.resize(size * sizeof(uint32_t));
+		table_ = reinterpret_cast<uint32_t*>(table_storage_.getData());
+		check_storage_.resize(size);
+		checks_ = reinterpret_cast<byte*>(check_storage_.getData());
+		history_stream_ = history;
+		if (history_stream_ != nullptr) {
+			// Positions in the table are 32 bits.
+			max_dist_ = 0xFFFFFFFFu;
+			history_mask_ = 0;
+			history_ = nullptr;
+			cache_.resize(kCacheSize);
+		} else {
+			history_mask_ = history_size - 1;
+			assert((history_mask_ & (history_mask_ + 1)) == 0);
+			history_storage_.resize(history_size);
+			history_ = reinterpret_cast<byte*>(history_storage_.getData());
+			max_dist_ = history_size - kWindow;
+		}
+		cache_pos_ = cache_size_ = 0;
+		min_dist_ = min_dist;
+		hash_ = 0;
+		remove_mul_ = 1;
+		for (size_t i = 0; i < kWindow; ++i) {
+			remove_mul_ *= kHashMul;
+		}
+		pos_ = len_ = 0;
+	}
+
+	forceinline size_t getLength() const {
+		return len_;
+	}
+
+	forceinline void resetMatch() {
+		len_ = 0;
+	}
+
+	// Only valid if there is a match.
+	forceinline uint32_t getExpectedChar() const {
+		dcheck(len_ != 0);
+		return history_stream_ != nullptr ? cache_[pos_ - cache_pos_] : history_[pos_ & history_mask_];
+	}
+
+	// Called once the last byte has been pushed into the buffer.
+	void update(Buffer& buffer) {
+		const uint64_t bpos = buffer.getPos();
+		if (bpos == 0) {
+			return;
+		}
+		const byte c = buffer[bpos - 1];
+		if (history_stream_ == nullptr) {
+			history_[(bpos - 1) & history_mask_] = c;
+		}
+		if (len_ != 0) {
+			if (getExpectedChar() == c) {
+				++len_;
+				++pos_;
+				if (history_stream_ != nullptr && pos_ - cache_pos_ >= cache_size_ && !fillCache(pos_)) {
+					len_ = 0;
+				}
+			} else {
+				len_ = 0;
+			}
+		}
+		hash_ = hash_ * kHashMul + c + 1;
+		if (bpos <= kWindow) {
+			return;
+		}
+		hash_ -= remove_mul_ * (buffer[bpos - 1 - kWindow] + 1);
+		const uint32_t h = hash_ * kHashMul;
+		if ((h >> (32 - kAnchorBits)) != 0) {
+			return;
+		}
+		// The top bits of h are 0 for anchors, the slot and check bits come from a wider hash. Equal windows have
+		// equal checks, most other anchors are skipped before reading any history.
+		const uint64_t slot_hash = hash_ * kSlotMul;
+		const size_t idx = static_cast<size_t>(slot_hash >> 24) & hash_mask_;
+		const byte check = static_cast<byte>(slot_hash >> 56);
+		const bool same_check = checks_[idx] == check;
+		checks_[idx] = check;
+		// Positions wrap at 32 bits, anything further back than the history is stale.
+		const uint64_t dist = static_cast<uint32_t>(bpos - table_[idx]);
+		table_[idx] = static_cast<uint32_t>(bpos);
+		if (len_ != 0 || !same_check || dist < min_dist_ || dist > max_dist_ || dist + kWindow >= bpos) {
+			return;
+		}
+		// Verify the window before both positions.
+		const uint64_t cand = bpos - dist;
+		if (history_stream_ != nullptr) {
+			if (!fillCache(cand - kWindow) || cache_size_ <= kWindow) {
+				return;
+			}
+			for (size_t i = 0; i < kWindow; ++i) {
+				if (cache_[i] != buffer[bpos - kWindow + i]) {
+					return;
+				}
+			}
+		} else {
+			for (size_t i = 0; i < kWindow; ++i) {
+				if (history_[(cand - kWindow + i) & history_mask_] != buffer[bpos - kWindow + i]) {
+					return;
+				}
+			}
+		}
+		pos_ = cand;
+		len_ = kWindow;
+	}
+
+private:
+	// Anchor table, low 32 bits of the position and 8 check bits of the hash.
+	MemMap table_storage_;
+	uint32_t* table_;
+	MemMap check_storage_;
+	byte* checks_;
+	size_t hash_mask_;
+	uint64_t min_dist_;
+	uint64_t max_dist_;
+	uint32_t hash_;
+	uint32_t remove_mul_;
+
+	// Current match.
+	uint64_t pos_;
+	size_t len_;
+
+	// History stream and the bytes last read from it.
+	Stream* history_stream_;
+	std::vector<byte> cache_;
+	uint64_t cache_pos_;
+	size_t cache_size_;
+
+	// History ring.
+	MemMap history_storage_;
+	byte* history_;
+	size_t history_mask_;
+
+	bool fillCache(uint64_t pos) {
+		cache_pos_ = pos;
+		cache_size_ = history_stream_->readat(pos, &cache_[0], cache_.size());
+		return cache_size_ != 0;
+	}
+};
+
+#endif
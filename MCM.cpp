@@ -35,9 +35,11 @@
 #include "DeltaFilter.hpp"
 #include "Dict.hpp"
 #include "File.hpp"
+#include "FloatFilter.hpp"
 #include "Huffman.hpp"
 #include "LZ.hpp"
 #include "ProgressMeter.hpp"
+#include "RecordFilter.hpp"
 #include "Tests.hpp"
 #include "TurboCM.hpp"
 #include "X86Binary.hpp"
@@ -76,6 +78,8 @@ public:
 		// Single hand mode.
 		kModeCompress,
 		kModeDecompress,
+		// Build a dictionary file from sample files.
+		kModeDictTrain,
 	};
 	Mode mode;
 	bool opt_mode;
@@ -85,6 +89,8 @@ public:
 	uint64_t block_size;
 	FilePath archive_file;
 	std::vector<FilePath> files;
+	// External dictionary.
+	FilePath dict_file;
 
 	Options()
 		: mode(kModeUnknown)
@@ -105,6 +111,14 @@ public:
 			<< "0 .. 11 specifies memory with 32mb .. 5gb per thread (default " << CompressionOptions::kDefaultMemUsage << ")" << std::endl
 			<< "10 and 11 are only supported on 64 bits" << std::endl
 			<< "-test tests the file after compression is done" << std::endl
+			<< "-dedup replaces repeated chunks with references before compression" << std::endl
+			<< "-records={none|delta|transpose|both} transform for arrays of fixed size records (default both)" << std::endl
+			<< "-floats={none|planes|xor|delta} byte planes of float arrays, of the values XORed with the one before or" << std::endl
+			<< "  of the bytes minus the same byte one value before (default delta)" << std::endl
+			<< "-dsample <mb> builds the dictionary from about <mb> MB of the input" << std::endl
+			<< "-dorder <mb> orders the dictionary by the text following each word, using up to <mb> MB of text" << std::endl
+			<< "-dict <file> uses a trained dictionary for text, decompression needs the same file" << std::endl
+			<< "dict-train <samples...> -o <file> trains a dictionary from sample files" << std::endl
 			// << "-b <mb> specifies block size in MB" << std::endl
 			// << "-t <threads> the number of threads to use (decompression requires the same number of threads" << std::endl
 			<< "Examples:" << std::endl
@@ -131,6 +145,7 @@ public:
 			else if (arg == "a") parsed_mode = kModeAdd;
 			else if (arg == "e") parsed_mode = kModeExtract;
 			else if (arg == "x") parsed_mode = kModeExtractAll;
+			else if (arg == "dict-train") parsed_mode = kModeDictTrain;
 			if (parsed_mode != kModeUnknown) {
 				if (mode != kModeUnknown) {
 					std::cerr << "Multiple commands specified" << std::endl;
@@ -150,15 +165,67 @@ public:
 						archive_file = FilePath(argv[i]);
 						break;
 					}
+				default:
+					// Other modes take their files from the remaining arguments.
+					break;
 				}
 			} else if (arg == "-opt") opt_mode = true;
 			else if (arg == "-filter=none") options_.filter_type_ = kFilterTypeNone;
 			else if (arg == "-filter=dict") options_.filter_type_ = kFilterTypeDict;
 			else if (arg == "-filter=x86") options_.filter_type_ = kFilterTypeX86;
+			else if (arg == "-filter=x64") options_.filter_type_ = kFilterTypeX64;
+			else if (arg == "-filter=arm64") options_.filter_type_ = kFilterTypeARM64;
+			else if (arg == "-filter=riscv") options_.filter_type_ = kFilterTypeRISCV;
+			else if (arg == "-filter=columns") options_.filter_type_ = kFilterTypeColumns;
 			else if (arg == "-filter=auto") options_.filter_type_ = kFilterTypeAuto;
+			else if (arg == "-records=none") options_.record_mode_ = 0;
+			else if (arg == "-records=delta") options_.record_mode_ = RecordFilter::kModeDelta;
+			else if (arg == "-records=transpose") options_.record_mode_ = RecordFilter::kModeTranspose;
+			else if (arg == "-records=both") options_.record_mode_ = RecordFilter::kModeBoth;
+			else if (arg == "-floats=none") options_.float_mode_ = 0;
+			else if (arg == "-floats=planes") options_.float_mode_ = FloatFilter::kModePlanes;
+			else if (arg == "-floats=xor") options_.float_mode_ = FloatFilter::kModePlanes | FloatFilter::kModeXor;
+			else if (arg == "-floats=delta") options_.float_mode_ = FloatFilter::kModePlanes | FloatFilter::kModeDelta;
 			else if (arg == "-lzp=auto") options_.lzp_type_ = kLZPTypeAuto;
 			else if (arg == "-lzp=true") options_.lzp_type_ = kLZPTypeEnable;
 			else if (arg == "-lzp=false") options_.lzp_type_ = kLZPTypeDisable;
+			else if (arg == "-dedup") options_.dedup_ = true;
+			else if (arg == "-dsample") {
+				if (i + 1 >= argc) {
+					return usage(program);
+				}
+				std::istringstream iss(argv[++i]);
+				uint64_t sample_mb = 0;
+				iss >> sample_mb;
+				if (iss.fail()) {
+					return usage(program);
+				}
+				options_.dict_sample_size_ = sample_mb * MB;
+			}
+			else if (arg == "-dorder") {
+				if (i + 1 >= argc) {
+					return usage(program);
+				}
+				std::istringstream iss(argv[++i]);
+				uint64_t order_mb = 0;
+				iss >> order_mb;
+				if (iss.fail()) {
+					return usage(program);
+				}
+				options_.dict_order_size_ = order_mb * MB;
+			}
+			else if (arg == "-dict") {
+				if (i + 1 >= argc) {
+					return usage(program);
+				}
+				dict_file = FilePath(argv[++i]);
+			}
+			else if (arg == "-o") {
+				if (i + 1 >= argc) {
+					return usage(program);
+				}
+				archive_file = FilePath(argv[++i]);
+			}
 			else if (arg == "-b") {
 				if  (i + 1 >= argc) {
 					return usage(program);
@@ -207,7 +274,7 @@ public:
 					return 4;
 				}
 			} else if (!arg.empty()) {
-				if (mode == kModeAdd || mode == kModeExtract) {
+				if (mode == kModeAdd || mode == kModeExtract || mode == kModeDictTrain) {
 					// Read in files.
 					files.push_back(FilePath(argv[i]));
 				} else {
@@ -257,6 +324,40 @@ public:
 	}
 };
 
+// Count the words of all the samples and write the resulting dictionary.
+static int trainDict(const Options& options) {
+	printHeader();
+	Dict::Builder builder;
+	builder.setBufferSize(static_cast<size_t>(options.options_.dict_order_size_));
+	for (const auto& sample : options.files) {
+		File fin;
+		int err = fin.open(sample.getName(), std::ios_base::in | std::ios_base::binary);
+		if (err) {
+			std::cerr << "Error opening: " << sample.getName() << " (" << errstr(err) << ")" << std::endl;
+			return 1;
+		}
+		std::cout << "Analyzing " << sample.getName() << std::endl;
+		Analyzer analyzer;
+		// Samples share the text budget in order.
+		analyzer.setDictBufferSize(builder.getBufferSize() - builder.getBuffer()->size());
+		analyzer.analyze(&fin, fin.length(), std::thread::hardware_concurrency());
+		builder.merge(analyzer.getDictBuilder());
+	}
+	Dict::CodeWordGeneratorFast generator;
+	Dict::CodeWordSet code_words;
+	generator.generateCodeWords(builder, &code_words);
+	Dict::Filter filter(nullptr, 0x3, 0x4, 0x6);
+	filter.addCodeWords(code_words.getCodeWords(), code_words.num1_, code_words.num2_, code_words.num3_);
+	const auto& out_file = options.archive_file.getName();
+	int err = Dict::ExternalDict::write(out_file, filter.getDictBuffer());
+	if (err) {
+		std::cerr << "Error writing: " << out_file << " (" << errstr(err) << ")" << std::endl;
+		return 2;
+	}
+	std::cout << "Wrote dictionary " << out_file << std::endl;
+	return 0;
+}
+
 #if 0
 void decompress(Stream* in, Stream* out) {
 	Archive archive(in);
@@ -286,6 +387,12 @@ int main(int argc, char* argv[]) {
 		std::cerr << "Failed to parse arguments" << std::endl;
 		return ret;
 	}
+	Dict::ExternalDict dict;
+	if (!options.dict_file.isEmpty() && !dict.open(options.dict_file.getName())) {
+		std::cerr << "Error opening dictionary: " << options.dict_file.getName() << std::endl;
+		return 1;
+	}
+	const Dict::ExternalDict* dict_ptr = options.dict_file.isEmpty() ? nullptr : &dict;
 	switch (options.mode) {
 	case Options::kModeMemTest: {
 		const uint32_t iterations = kIsDebugBuild ? 1 : 1;
@@ -418,7 +525,10 @@ int main(int argc, char* argv[]) {
 
 			{
 				Archive archive(&fout, options.options_);
+				archive.setDict(dict_ptr);
 				archive.compress(&fin);
+				// Blocks which expanded were rewritten smaller.
+				fout.truncate();
 			}
 			clock_t time = clock() - start;
 			fin.seek(0, SEEK_END);
@@ -436,10 +546,13 @@ int main(int argc, char* argv[]) {
 					return 1;
 				}
 				Archive archive(&fout);
+				archive.setDict(dict_ptr);
 				std::cout << "Decompresing & verifying file" << std::endl;		
 				fin.seek(0);
 				VerifyStream verifyStream(&fin, file_size);
-				archive.decompress(&verifyStream);
+				if (!archive.decompress(&verifyStream)) {
+					return 1;
+				}
 				verifyStream.summary();
 			}
 			fin.close();
@@ -474,7 +587,8 @@ int main(int argc, char* argv[]) {
 			std::cerr << "Error opening: " << out_file << " (" << errstr(err) << ")" << std::endl;
 			return 1;
 		}
-		if (err = fout.open(out_file, std::ios_base::out | std::ios_base::binary)) {
+		// Opened for reading too since deduplicated chunks and long matches are copied from the output.
+		if (err = fout.open(out_file, std::ios_base::in | std::ios_base::out | std::ios_base::binary)) {
 			std::cerr << "Error opening: " << out_file << " (" << errstr(err) << ")" << std::endl;
 			return 2;
 		}
@@ -490,7 +604,10 @@ int main(int argc, char* argv[]) {
 			std::cerr << "Attempting to decompress old version " << header.majorVersion() << "." << header.minorVersion() << std::endl;
 			return 1;
 		}
-		archive.decompress(&fout);
+		archive.setDict(dict_ptr);
+		if (!archive.decompress(&fout)) {
+			return 1;
+		}
 		fin.close();
 		fout.close();
 		// Decompress the single file in the archive to the output out.
@@ -500,10 +617,15 @@ int main(int argc, char* argv[]) {
 		// Extract a single file from multi file archive .
 		break;
 	}
+	case Options::kModeDictTrain: {
+		return trainDict(options);
+	}
 	case Options::kModeExtractAll: {
 		// Extract all the files in the archive.
 		break;
 	}
+	default:
+		break;
 	}
 	return 0;
 }
@@ -14,6 +14,8 @@ public:
 	static const size_t kMaxCtxLen = 32;
 	static const bool kMultiMatch = false;
 	static const bool kExtendMatch = false;
+	// Candidate positions per hash bucket, replaced in recency order.
+	static const size_t kBucketSize = 4;
 private:
 	static const size_t kBitsPerChar = 16;
 	std::vector<Model> models;
@@ -26,6 +28,8 @@ private:
 
 	// Current match.
 	size_t pos, len;
+	// The current match comes from outside of the buffer, pos is not valid.
+	bool external_;
 
 	// Hash
 	uint32_t hash_;
@@ -50,11 +54,12 @@ public:
 		opt_var = var;
 	}
 
+	// Size is the total number of hash slots, split into buckets of kBucketSize.
 	void resize(size_t size) {
-		hash_mask = size - 1;
+		hash_mask = size / kBucketSize - 1;
 		// Check power of 2.
 		assert((hash_mask & (hash_mask + 1)) == 0);
-		hash_storage.resize((hash_mask + 1) * sizeof(uint32_t));
+		hash_storage.resize((hash_mask + 1) * kBucketSize * sizeof(uint32_t));
 		hash_table = (uint32_t*)hash_storage.getData();
 	}
 
@@ -83,6 +88,7 @@ public:
 		cur_min_match = min_match;
 		expected_code = 0;
 		pos = len = dist = 0;
+		external_ = false;
 		for (auto& m : models) m.init();
 		for (size_t c = 0; c < kMaxCtx; ++c) {
 			setCtx(c);
@@ -107,36 +113,62 @@ public:
 		len = 0;
 	}
 
+	// Use a match found by another model for this byte, the caller provides the expected char.
+	forceinline void setExternalMatch(size_t length) {
+		len = std::min(length, cur_max_match);
+		external_ = true;
+	}
+
 	forceinline void setCtx(size_t ctx) {
 		model_base = &models[ctx * num_length_models_];
 	}
 
-	void search(Buffer& buffer, size_t spos) {
-		// Reverse match.
-		size_t blast = buffer.getPos() - 1;
-		size_t len = sizeof(uint32_t);
-		if (*reinterpret_cast<uint32_t*>(&buffer[spos - len]) ==
-			*reinterpret_cast<uint32_t*>(&buffer[blast - len])) {
-			--spos;
-			--blast;
-			if (kExtendMatch) {
-				for (; len < cur_min_match; ++len) {
-					if (buffer[spos - len] != buffer[blast - len]) {
-						return;
-					}
-				}
-				for (;buffer[spos - len] == buffer[blast - len] && len < cur_max_match; ++len);
+	// Returns how many bytes before spos match the bytes before the last char, 0 if less than 4 match.
+	size_t matchLength(Buffer& buffer, size_t spos) {
+		const size_t blast = buffer.getPos() - 1;
+		// Wraparound safe, a mirrored buffer does it in a single compare.
+		const size_t len = buffer.reverseMatchLength(spos, blast, kMaxCtxLen);
+		return len >= sizeof(uint32_t) ? len : 0;
+	}
+
+	// Verify each candidate in the bucket and take the one with the longest context.
+	void search(Buffer& buffer, const uint32_t* bucket, uint32_t hmask) {
+		const size_t bmask = buffer.getMask();
+		size_t best_len = 0, best_pos = 0;
+		for (size_t i = 0; i < kBucketSize; ++i) {
+			const uint32_t entry = bucket[i];
+			if ((entry & ~bmask) != hmask) {
+				continue;
+			}
+			const size_t cur_len = matchLength(buffer, entry & bmask);
+			if (cur_len > best_len) {
+				best_len = cur_len;
+				best_pos = entry & bmask;
 			}
-			// Update our match.
-			const size_t bmask = buffer.getMask();
-			dist = (blast & bmask) - (spos & bmask);
-			this->pos = spos + 1;
-			this->len = len;
 		}
+		if (best_len == 0) {
+			return;
+		}
+		if (kExtendMatch) {
+			if (best_len < cur_min_match) {
+				return;
+			}
+		} else {
+			best_len = sizeof(uint32_t);
+		}
+		// Update our match.
+		const size_t blast = buffer.getPos() - 1;
+		dist = ((blast - 1) & bmask) - ((best_pos - 1) & bmask);
+		this->pos = best_pos;
+		this->len = best_len;
+	}
+
+	forceinline uint32_t* getBucket(uint32_t hash) {
+		return &hash_table[(hash & hash_mask) * kBucketSize];
 	}
 
 	void fetch(uint32_t ctx) {
-		prefetch(&hash_table[(hash_ ^ ctx) & hash_mask]);
+		prefetch(getBucket(hash_ ^ ctx));
 	}
 
 	void update(Buffer& buffer) {
@@ -146,17 +178,23 @@ public:
 		const auto last_pos = blast & bmask;
 		const auto hmask = hash_ & ~bmask;
 		// Update the existing match.
-		auto& b1 = hash_table[hash_ & hash_mask];
+		auto* bucket = getBucket(hash_);
+		if (external_) {
+			len = 0;
+			external_ = false;
+		}
 		if (len) {
 			len += len < cur_max_match;
 			++pos;
 		} else {
-			if ((b1 & ~bmask) == hmask) {
-				search(buffer, b1);
-			}
+			search(buffer, bucket, static_cast<uint32_t>(hmask));
 		}
 		updateCurMdl();
-		b1 = last_pos | hmask;
+		// Most recent first, the oldest candidate is dropped.
+		for (size_t i = kBucketSize - 1; i > 0; --i) {
+			bucket[i] = bucket[i - 1];
+		}
+		bucket[0] = static_cast<uint32_t>(last_pos | hmask);
 	}
 
 	uint32_t getHash() const {
@@ -0,0 +1,118 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RISCV_BINARY_HPP_
+#define _RISCV_BINARY_HPP_
+
+#include "Filter.hpp"
+
+// RISC-V branch filter, JAL call offsets and AUIPC upper offsets are replaced by absolute targets. The stream is
+// parsed as 2 and 4 byte instructions (C extension) from its start, the opcode and rd bits that decide the
+// length and the transform are never changed so the reverse filter parses the same instructions.
+class RISCVFilter : public ByteStreamFilter<16 * KB, 16 * KB> {
+public:
+	RISCVFilter(Stream* stream) : ByteStreamFilter(stream), offset_(0), transform_count_(0) {
+	}
+	virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		process<true>(out, out_count, in, in_count);
+	}
+	virtual void reverseFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		process<false>(out, out_count, in, in_count);
+	}
+	static uint32_t getMaxExpansion() {
+		return 1;
+	}
+	void dumpInfo() const {
+		std::cout << std::endl << "RISCV: " << transform_count_ << std::endl;
+	}
+	void setOpt(uint32_t s) {
+	}
+
+private:
+	template <bool encode>
+	forceinline uint32_t transform(uint32_t insn, uint32_t pc) {
+		const uint32_t opcode = insn & 0x7F;
+		if (opcode == 0x17) {
+			// AUIPC, upper 20 bits of the offset.
+			const uint32_t imm = encode ? (insn >> 12) + (pc >> 12) : (insn >> 12) - (pc >> 12);
+			++transform_count_;
+			return (insn & 0xFFF) | (imm << 12);
+		}
+		const uint32_t rd = (insn >> 7) & 0x1F;
+		if (opcode == 0x6F && (rd == 1 || rd == 5)) {
+			// JAL with a link register is a call, local jumps are better left relative. The scattered offset is
+			// stored as a plain absolute target.
+			++transform_count_;
+			if (encode) {
+				uint32_t imm = (((insn >> 31) & 1) << 20) | (((insn >> 21) & 0x3FF) << 1) |
+					(((insn >> 20) & 1) << 11) | (((insn >> 12) & 0xFF) << 12);
+				imm = (imm + pc) & 0x1FFFFF;
+				return (insn & 0xFFF) | ((imm >> 1) << 12);
+			}
+			const uint32_t imm = (((insn >> 12) << 1) - pc) & 0x1FFFFF;
+			return (insn & 0xFFF) | (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3FF) << 21) |
+				(((imm >> 11) & 1) << 20) | (((imm >> 12) & 0xFF) << 12);
+		}
+		return insn;
+	}
+
+	template <bool encode>
+	void process(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		const size_t in_c = *in_count;
+		const size_t count = std::min(in_c, *out_count);
+		size_t pos = 0;
+		if (in_c < 4) {
+			// Only the end of the stream can't hold a whole instruction.
+			std::copy(in, in + count, out);
+			pos = count;
+		} else {
+			while (pos + 2 <= count) {
+				if ((in[pos] & 3) != 3) {
+					// Compressed.
+					out[pos] = in[pos];
+					out[pos + 1] = in[pos + 1];
+					pos += 2;
+					continue;
+				}
+				if (pos + 4 > count) {
+					break;
+				}
+				const uint32_t insn = static_cast<uint32_t>(in[pos]) | (static_cast<uint32_t>(in[pos + 1]) << 8) |
+					(static_cast<uint32_t>(in[pos + 2]) << 16) | (static_cast<uint32_t>(in[pos + 3]) << 24);
+				const uint32_t value = transform<encode>(insn, static_cast<uint32_t>(offset_ + pos));
+				out[pos + 0] = static_cast<uint8_t>(value);
+				out[pos + 1] = static_cast<uint8_t>(value >> 8);
+				out[pos + 2] = static_cast<uint8_t>(value >> 16);
+				out[pos + 3] = static_cast<uint8_t>(value >> 24);
+				pos += 4;
+			}
+		}
+		*in_count = *out_count = pos;
+		offset_ += pos;
+	}
+
+	uint64_t offset_;
+	size_t transform_count_;
+};
+
+#endif
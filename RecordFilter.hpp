@@ -0,0 +1,113 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RECORD_FILTER_HPP_
+#define _RECORD_FILTER_HPP_
+
+#include <memory>
+
+#include "Filter.hpp"
+
+// Transform for arrays of fixed size records. With delta, each byte is replaced by its difference to the same byte
+// of the previous record. With transpose, the records of each tile are stored field byte by field byte so that
+// the same byte of every record is together. The tail of the stream that doesn't fill a tile is not changed.
+class RecordFilter : public ByteStreamFilter<64 * KB, 64 * KB> {
+public:
+	static const size_t kMaxStride = 256;
+	static const size_t kTileSize = 32 * KB;
+	enum Mode {
+		kModeDelta = 1,
+		kModeTranspose = 2,
+		kModeBoth = kModeDelta | kModeTranspose,
+	};
+
+	RecordFilter(Stream* stream, size_t stride, uint32_t mode)
+		: ByteStreamFilter(stream), stride_(stride), tile_(stride * (kTileSize / stride)), mode_(mode) {
+		check(stride_ > 0 && stride_ <= kMaxStride);
+		prev_.reset(new uint8_t[stride_]());
+	}
+	virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		process<true>(out, out_count, in, in_count);
+	}
+	virtual void reverseFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		process<false>(out, out_count, in, in_count);
+	}
+	static uint32_t getMaxExpansion() {
+		return 1;
+	}
+	void dumpInfo() const {
+	}
+	void setOpt(uint32_t s) {
+	}
+
+private:
+	template <bool encode>
+	void process(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		const size_t in_c = *in_count;
+		const size_t count = std::min(in_c, *out_count);
+		size_t pos = 0;
+		if (in_c < tile_) {
+			// Only the end of the stream has no whole tile.
+			std::copy(in, in + count, out);
+			pos = count;
+		} else {
+			for (; pos + tile_ <= count; pos += tile_) {
+				switch (mode_) {
+				case kModeDelta: transformTile<encode, true, false>(out + pos, in + pos); break;
+				case kModeTranspose: transformTile<encode, false, true>(out + pos, in + pos); break;
+				case kModeBoth: transformTile<encode, true, true>(out + pos, in + pos); break;
+				default: std::copy(in + pos, in + pos + tile_, out + pos); break;
+				}
+			}
+		}
+		*in_count = *out_count = pos;
+	}
+
+	template <bool encode, bool kDelta, bool kTranspose>
+	void transformTile(uint8_t* out, const uint8_t* in) {
+		const size_t records = tile_ / stride_;
+		// Untransformed record r is at raw + r * stride_.
+		const uint8_t* raw = encode ? in : out;
+		for (size_t r = 0; r < records; ++r) {
+			const uint8_t* prev = r != 0 ? raw + (r - 1) * stride_ : prev_.get();
+			for (size_t j = 0; j < stride_; ++j) {
+				const size_t t = kTranspose ? j * records + r : r * stride_ + j;
+				const size_t u = r * stride_ + j;
+				if (encode) {
+					out[t] = kDelta ? in[u] - prev[j] : in[u];
+				} else {
+					out[u] = kDelta ? in[t] + prev[j] : in[t];
+				}
+			}
+		}
+		std::copy(raw + tile_ - stride_, raw + tile_, prev_.get());
+	}
+
+	const size_t stride_;
+	const size_t tile_;
+	const uint32_t mode_;
+	// Last record of the previous tile.
+	std::unique_ptr<uint8_t[]> prev_;
+};
+
+#endif
@@ -138,6 +138,30 @@ public:
     virtual ~ReadStream() {}
 };
 
+// Reads a stream through readat with its own position, several can share a stream if its readat is thread safe.
+class ReadAtStream : public ReadStream {
+	Stream* stream_;
+	uint64_t pos_;
+public:
+	ReadAtStream(Stream* stream, uint64_t pos = 0) : stream_(stream), pos_(pos) {
+	}
+	virtual int get() {
+		uint8_t c;
+		return read(&c, 1) == 1 ? c : EOF;
+	}
+	virtual size_t read(uint8_t* buf, size_t n) {
+		const size_t count = stream_->readat(pos_, buf, n);
+		pos_ += count;
+		return count;
+	}
+	virtual uint64_t tell() const {
+		return pos_;
+	}
+	virtual void seek(uint64_t pos) {
+		pos_ = pos;
+	}
+};
+
 class ReadMemoryStream : public ReadStream {
 public:
 	ReadMemoryStream(const std::vector<byte>* buffer)
@@ -160,6 +184,16 @@ public:
 		pos_ += read_count;
 		return read_count;
 	}
+	// Doesn't move the read position.
+	virtual size_t readat(uint64_t pos, byte* buf, size_t n) {
+		const size_t size = limit_ - buffer_;
+		if (pos >= size) {
+			return 0;
+		}
+		const size_t read_count = std::min(static_cast<size_t>(size - pos), n);
+		std::copy(buffer_ + pos, buffer_ + pos + read_count, buf);
+		return read_count;
+	}
 	virtual uint64_t tell() const {
 		return pos_ - buffer_;
 	}
@@ -388,6 +422,11 @@ public:
 		stream_->seek(pos);
 	}
 
+	// Reads back the reference, only valid for bytes that were already verified.
+	size_t read(uint8_t* buf, size_t n) {
+		return stream_->read(buf, n);
+	}
+
 	void write(const uint8_t* buf, size_t n) {
 		uint8_t buffer[4 * KB];
 		while (n != 0) {
@@ -0,0 +1,148 @@
+/*	MCM file compressor
+
+	Copyright (C) 2015, Google Inc.
+	Authors: Mathieu Chartier
+
+	LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _UTF16_FILTER_HPP_
+#define _UTF16_FILTER_HPP_
+
+#include "Filter.hpp"
+
+// Transcodes UTF-16 text to UTF-8 so that the text models and the dictionary see it. Surrogate pairs become 4 byte
+// sequences and unpaired surrogates 3 byte ones like any other code unit, so every sequence of code units comes
+// back exactly. An odd byte at the end of the stream is escaped with 0xFF, which UTF-8 never has.
+class UTF16Filter : public ByteStreamFilter<16 * KB, 16 * KB> {
+public:
+	// Byte orders, also the stride of UTF-16 blocks.
+	static const uint32_t kLittleEndian = 1;
+	static const uint32_t kBigEndian = 2;
+	static const uint8_t kEscapeOddByte = 0xFF;
+
+	UTF16Filter(Stream* stream, uint32_t byte_order) : ByteStreamFilter(stream), big_endian_(byte_order == kBigEndian) {
+		check(byte_order == kLittleEndian || byte_order == kBigEndian);
+	}
+	virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		const uint8_t* in_ptr = in;
+		uint8_t* out_ptr = out;
+		const uint8_t* const in_limit = in + *in_count;
+		const uint8_t* const out_limit = out + *out_count;
+		while (in_ptr + 2 <= in_limit && out_ptr + 4 <= out_limit) {
+			uint32_t c = readUnit(in_ptr);
+			size_t len = 2;
+			if (c >= 0xD800 && c < 0xDC00) {
+				if (in_ptr + 4 <= in_limit) {
+					const uint32_t low = readUnit(in_ptr + 2);
+					if (low >= 0xDC00 && low < 0xE000) {
+						c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+						len = 4;
+					}
+				} else if (in_ptr != in) {
+					// The low surrogate may come with the next read, only the end of the stream has less than 4 bytes.
+					break;
+				}
+			}
+			out_ptr += encode(c, out_ptr);
+			in_ptr += len;
+		}
+		if (in_ptr == in && in_limit - in_ptr == 1 && out_ptr + 2 <= out_limit) {
+			*(out_ptr++) = kEscapeOddByte;
+			*(out_ptr++) = *(in_ptr++);
+		}
+		*in_count = in_ptr - in;
+		*out_count = out_ptr - out;
+	}
+	virtual void reverseFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+		const uint8_t* in_ptr = in;
+		uint8_t* out_ptr = out;
+		const uint8_t* const in_limit = in + *in_count;
+		const uint8_t* const out_limit = out + *out_count;
+		// Leave what may be a partial sequence for the next write, the last bytes come with the flush.
+		const uint8_t* const max = in_ptr + 4 < in_limit ? in_limit - 4 : in_limit;
+		while (in_ptr < max && out_ptr + 4 <= out_limit) {
+			const uint32_t c = *in_ptr;
+			if (c == kEscapeOddByte) {
+				check(in_ptr + 2 <= in_limit);
+				*(out_ptr++) = in_ptr[1];
+				in_ptr += 2;
+				continue;
+			}
+			const size_t len = c < 0x80 ? 1 : (c < 0xE0 ? 2 : (c < 0xF0 ? 3 : 4));
+			check(in_ptr + len <= in_limit);
+			uint32_t cp = len == 1 ? c : c & (0x7F >> len);
+			for (size_t i = 1; i < len; ++i) {
+				cp = (cp << 6) | (in_ptr[i] & 0x3F);
+			}
+			in_ptr += len;
+			if (cp >= 0x10000) {
+				cp -= 0x10000;
+				writeUnit(out_ptr, 0xD800 + (cp >> 10));
+				writeUnit(out_ptr + 2, 0xDC00 + (cp & 0x3FF));
+				out_ptr += 4;
+			} else {
+				writeUnit(out_ptr, cp);
+				out_ptr += 2;
+			}
+		}
+		*in_count = in_ptr - in;
+		*out_count = out_ptr - out;
+	}
+	// Up to 3 bytes for 2 byte units.
+	static uint32_t getMaxExpansion() {
+		return 2;
+	}
+	void dumpInfo() const {
+	}
+	void setOpt(uint32_t s) {
+	}
+
+private:
+	forceinline uint32_t readUnit(const uint8_t* ptr) const {
+		return big_endian_ ? (ptr[0] << 8) | ptr[1] : ptr[0] | (ptr[1] << 8);
+	}
+	forceinline void writeUnit(uint8_t* ptr, uint32_t c) const {
+		ptr[big_endian_ ? 1 : 0] = static_cast<uint8_t>(c);
+		ptr[big_endian_ ? 0 : 1] = static_cast<uint8_t>(c >> 8);
+	}
+	static forceinline size_t encode(uint32_t c, uint8_t* out) {
+		if (c < 0x80) {
+			out[0] = static_cast<uint8_t>(c);
+			return 1;
+		} else if (c < 0x800) {
+			out[0] = static_cast<uint8_t>(0xC0 | (c >> 6));
+			out[1] = static_cast<uint8_t>(0x80 | (c & 0x3F));
+			return 2;
+		} else if (c < 0x10000) {
+			out[0] = static_cast<uint8_t>(0xE0 | (c >> 12));
+			out[1] = static_cast<uint8_t>(0x80 | ((c >> 6) & 0x3F));
+			out[2] = static_cast<uint8_t>(0x80 | (c & 0x3F));
+			return 3;
+		}
+		out[0] = static_cast<uint8_t>(0xF0 | (c >> 18));
+		out[1] = static_cast<uint8_t>(0x80 | ((c >> 12) & 0x3F));
+		out[2] = static_cast<uint8_t>(0x80 | ((c >> 6) & 0x3F));
+		out[3] = static_cast<uint8_t>(0x80 | (c & 0x3F));
+		return 4;
+	}
+
+	const bool big_endian_;
+};
+
+#endif
@@ -36,6 +36,13 @@
 #include <string>
 #include <vector>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #ifdef WIN32
 #define forceinline __forceinline
 #else
@@ -123,6 +130,90 @@ forceinline uint32_t rotate_right(uint32_t h, uint32_t bits) {
 #define check(c) while (!(c)) { std::cerr << "check failed " << #c << std::endl; *reinterpret_cast<int*>(1234) = 4321;}
 #define dcheck(c) assert(c)
 
+// Bit scans, n must be non zero.
+forceinline uint32_t ctz(uint32_t n) {
+	dcheck(n != 0);
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, n);
+	return idx;
+#else
+	return __builtin_ctz(n);
+#endif
+}
+
+forceinline uint32_t clz(uint32_t n) {
+	dcheck(n != 0);
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanReverse(&idx, n);
+	return 31 - idx;
+#else
+	return __builtin_clz(n);
+#endif
+}
+
+forceinline uint32_t ctz64(uint64_t n) {
+	dcheck(n != 0);
+#if defined(_MSC_VER) && defined(_WIN64)
+	unsigned long idx;
+	_BitScanForward64(&idx, n);
+	return idx;
+#elif defined(_MSC_VER)
+	return static_cast<uint32_t>(n) != 0 ? ctz(static_cast<uint32_t>(n)) : 32 + ctz(static_cast<uint32_t>(n >> 32));
+#else
+	return __builtin_ctzll(n);
+#endif
+}
+
+// Number of equal bytes at the start of a and b, at most max_len. Never reads past max_len.
+forceinline size_t matchLength(const byte* a, const byte* b, size_t max_len) {
+	size_t len = 0;
+#ifdef __AVX2__
+	for (; len + 32 <= max_len; len += 32) {
+		const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + len));
+		const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + len));
+		const uint32_t diff = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+		if (diff) {
+			return len + ctz(diff);
+		}
+	}
+#endif
+	for (; len + 16 <= max_len; len += 16) {
+		const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + len));
+		const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + len));
+		const uint32_t diff = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFF;
+		if (diff) {
+			return len + ctz(diff);
+		}
+	}
+	if (len + sizeof(uint64_t) <= max_len) {
+		const uint64_t diff = *reinterpret_cast<const uint64_t*>(a + len) ^ *reinterpret_cast<const uint64_t*>(b + len);
+		if (diff) {
+			return len + ctz64(diff) / kBitsPerByte;
+		}
+		len += sizeof(uint64_t);
+	}
+	for (; len < max_len && a[len] == b[len]; ++len);
+	return len;
+}
+
+// Number of equal bytes before a and b (a[-1] == b[-1], ...), at most max_len.
+forceinline size_t reverseMatchLength(const byte* a, const byte* b, size_t max_len) {
+	size_t len = 0;
+	for (; len + 16 <= max_len; len += 16) {
+		const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a - len - 16));
+		const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b - len - 16));
+		const uint32_t diff = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFF;
+		if (diff) {
+			// The highest set bit is the first mismatch walking backwards.
+			return len + clz(diff) - 16;
+		}
+	}
+	for (; len < max_len && *(a - len - 1) == *(b - len - 1); ++len);
+	return len;
+}
+
 template <const uint32_t A, const uint32_t B, const uint32_t C, const uint32_t D>
 struct shuffle {
 	enum {
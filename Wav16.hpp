@@ -30,6 +30,7 @@
 #include "DivTable.hpp"
 #include "Entropy.hpp"
 #include "Huffman.hpp"
+#include "LMS.hpp"
 #include "Log.hpp"
 #include "MatchModel.hpp"
 #include "Memory.hpp"
@@ -40,6 +41,10 @@
 #include "Util.hpp"
 #include "WordModel.hpp"
 
+// PCM samples of kSampleBytes bytes, interleaved for kChannels channels. Each sample is predicted by a cascade of
+// LMS filters and the residual is coded modulo the sample size, top bits first. 8 bit samples are coarse enough for
+// the LMS to leave a lot to byte contexts, their residual is coded by a small CM over the last samples instead.
+template <size_t kSampleBytes, size_t kChannels>
 class Wav16 : public Compressor {
 public:
 	// SS table
@@ -48,23 +53,60 @@ public:
 	typedef fastBitModel<int, kShift, 9, 30> StationaryModel;
 	// typedef bitLearnModel<kShift, 8, 30> StationaryModel;
 	
-	static const size_t kSampleShift = 4;
-	static const size_t kSamplePr = 16 - kSampleShift;	
-	static const size_t kSampleCount = 1u << kSamplePr;
+	static const size_t kSampleBits = kSampleBytes * 8;
+	static const uint32_t kSampleMask = (1u << kSampleBits) - 1;
+	static const size_t kFrameBytes = kSampleBytes * kChannels;
+	// The top 16 bits of the residual are modelled, the noise bits below them are just direct encoded.
+	static const size_t kModelBits = kSampleBits < 16 ? kSampleBits : 16;
+	static const size_t kNoiseBits = kSampleBits - kModelBits;
+	// The context is the bit length of the recent average residual magnitude of the channel.
+	static const size_t kContexts = kSampleBits + 1;
+	static const size_t kAverageShift = 4;
 	
-	static const size_t kContextBits = 2;
-	static const size_t kContextMask = (1u << kContextBits) - 1;
 	std::vector<StationaryModel> models_;
 
+	// 8 bit samples: context tables of the last samples, the prediction and the last residual, mixed per residual
+	// magnitude and bit.
+	static const bool kMixContexts = kSampleBytes == 1;
+	static const int kMinST = -static_cast<int>(kMaxValue) / 2;
+	static const int kMaxST = static_cast<int>(kMaxValue) / 2;
+	typedef ss_table<short, kMaxValue, kMinST, kMaxST, 8> SSTable;
+	typedef bitLearnModel<kShift, 8, 30> BitModel;
+	static const size_t kTables = 6;
+	static const size_t kTableBits = 18;
+	typedef Mixer<int, kTables, 17, 11> SampleMixer;
+	SSTable table_;
+	std::vector<BitModel> tables_[kTables];
+	std::vector<SampleMixer> mixers_;
+	uint32_t pred_[kChannels];
+	uint32_t last2_[kChannels];
+	uint32_t last_folded_[kChannels];
+
 	// Range encoder
 	Range7 ent;
 
 	// Optimization variable.
 	uint32_t opt_var;
 
-	// Noise bits which are just direct encoded.
-	size_t noise_bits_;
-	size_t non_noise_bits_;
+	// Predictor cascade: a fixed first order filter, a short LMS over the filtered values of both channels and
+	// SIMD LMS stages over what is left.
+	static const size_t kCrossTaps = kChannels == 1 ? 2 : 4;
+	static const size_t kCrossShift = 12;
+	static const int kCrossStep = 1;
+	struct Stages {
+		int fixed_;
+		int cross_;
+		int long_;
+		int short_;
+		int filtered_;
+		int filtered2_;
+		int cross_weights_[kCrossTaps];
+		SignLMS<256, 13> long_lms_;
+		SignLMS<16, 10> short_lms_;
+	};
+	Stages stages_[kChannels];
+	int last_[kChannels];
+	uint32_t residual_average_[kChannels];
 
 	Wav16() : opt_var(0) {
 	}
@@ -75,26 +117,54 @@ public:
 	}
 
 	void init() {
-		noise_bits_ = 3;
-		non_noise_bits_ = 16 - noise_bits_;
-		size_t num_ctx = 2 << (non_noise_bits_ + kContextBits);
-		models_.resize(num_ctx);
-		for (auto& m : models_) {
-			m.init();
+		if (kMixContexts) {
+			table_.build(0);
+			for (auto& t : tables_) {
+				t.resize(kChannels << kTableBits);
+				for (auto& m : t) {
+					m.init();
+				}
+			}
+			mixers_.resize(kChannels * kContexts * 8);
+			for (auto& m : mixers_) {
+				m.init(382);
+			}
+		} else {
+			models_.resize((kChannels * kContexts) << kModelBits);
+			for (auto& m : models_) {
+				m.init();
+			}
+		}
+		for (size_t ch = 0; ch < kChannels; ++ch) {
+			Stages& st = stages_[ch];
+			st.fixed_ = st.cross_ = st.long_ = st.short_ = 0;
+			st.filtered_ = st.filtered2_ = 0;
+			std::fill(st.cross_weights_, st.cross_weights_ + kCrossTaps, 0);
+			st.long_lms_.init();
+			st.short_lms_.init();
+			last_[ch] = 0;
+			residual_average_[ch] = 0;
+			pred_[ch] = last2_[ch] = last_folded_[ch] = 0;
+		}
+	}
+
+	forceinline size_t residualContext(size_t ch) const {
+		size_t bits = 0;
+		for (uint32_t average = residual_average_[ch] >> kAverageShift; average != 0; average >>= 1) {
+			++bits;
 		}
+		return bits;
 	}
 
 	template <const bool kDecode, typename TStream>
 	uint32_t processSample(TStream& stream, size_t context, size_t channel, uint32_t c = 0) {
 		uint32_t code = 0;
 		if (!kDecode) {
-			code = c << (sizeof(uint32_t) * 8 - 16);
+			code = c << (sizeof(uint32_t) * 8 - kSampleBits);
 		}
-		int ctx = 1;
-		context = context * 2 + channel;
-		context <<= non_noise_bits_;
-		check(context < models_.size());
-		for (uint32_t i = 0; i < non_noise_bits_; ++i) {
+		uint32_t ctx = 1;
+		context = (channel * kContexts + context) << kModelBits;
+		for (uint32_t i = 0; i < kModelBits; ++i) {
 			auto& m = models_[context + ctx];
 			int p = m.getP();
 			p += p == 0;
@@ -115,7 +185,7 @@ public:
 		}
 
 		// Decode noisy bits (direct).
-		for (size_t i = 0; i < noise_bits_; ++i) {
+		for (size_t i = 0; i < kNoiseBits; ++i) {
 			if (kDecode) {
 				ctx += ctx + ent.decodeBit(stream);
 			} else {
@@ -123,7 +193,132 @@ public:
 			}
 		}
 		
-		return ctx ^ (1u << 16);
+		return ctx ^ (1u << kSampleBits);
+	}
+
+	// Context table index of the first bit model of a context.
+	static forceinline uint32_t base(size_t channel, uint32_t ctx, uint32_t k) {
+		return static_cast<uint32_t>(channel << kTableBits) |
+			(((ctx + k * 0x3C6EF372u) * 0x9E3779B1u) >> (32 - (kTableBits - 8)) << 8);
+	}
+
+	// Residuals of 8 bit samples are folded to 0, -1, 1, -2, ... so that small ones share their top bits.
+	template <const bool kDecode, typename TStream>
+	uint32_t processMixed(TStream& stream, size_t context, size_t channel, uint32_t c = 0) {
+		const uint32_t last = fromSigned(last_[channel]), last2 = last2_[channel], pred = pred_[channel];
+		uint32_t bases[kTables];
+		bases[0] = base(channel, static_cast<uint32_t>(context), 0);
+		bases[1] = base(channel, last, 1);
+		bases[2] = base(channel, (last << 8) | last2, 2);
+		bases[3] = base(channel, pred, 3);
+		bases[4] = base(channel, (static_cast<uint32_t>(context) << 8) | last_folded_[channel], 4);
+		bases[5] = base(channel, (last << 8) | pred, 5);
+		SampleMixer* const mixers = &mixers_[(channel * kContexts + context) * 8];
+		const int8_t signed_residual = static_cast<int8_t>(static_cast<uint8_t>(c));
+		const uint32_t folded = kDecode ? 0 : (signed_residual < 0 ? -2 * signed_residual - 1 : 2 * signed_residual);
+		uint32_t ctx = 1;
+		for (size_t bit_idx = 0; bit_idx < 8; ++bit_idx) {
+			BitModel* m[kTables];
+			int st[kTables];
+			for (size_t k = 0; k < kTables; ++k) {
+				m[k] = &tables_[k][bases[k] + ctx];
+				st[k] = table_.st(m[k]->getP());
+			}
+			SampleMixer* const mixer = &mixers[bit_idx];
+			const int stp = std::max(std::min(mixer->p(9, st[0], st[1], st[2], st[3], st[4], st[5]), kMaxST - 1), kMinST + 1);
+			int p = table_.sq(stp);
+			p += p == 0;
+			uint32_t bit;
+			if (kDecode) {
+				bit = ent.getDecodedBit(p, kShift);
+			} else {
+				bit = (folded >> (7 - bit_idx)) & 1;
+				ent.encode(stream, bit, p, kShift);
+			}
+			mixer->update(p, bit, kShift, 28, 1, st[0], st[1], st[2], st[3], st[4], st[5]);
+			for (size_t k = 0; k < kTables; ++k) {
+				m[k]->update(bit);
+			}
+			ctx = ctx * 2 + bit;
+			if (kDecode) {
+				ent.Normalize(stream);
+			}
+		}
+		const uint32_t f = ctx ^ 256;
+		last_folded_[channel] = f;
+		return static_cast<uint32_t>(f & 1 ? -static_cast<int>(f + 1) / 2 : static_cast<int>(f / 2)) & kSampleMask;
+	}
+
+	static forceinline int signExtend(uint32_t value) {
+		return static_cast<int>(value << (32 - kSampleBits)) >> (32 - kSampleBits);
+	}
+	// Signed value of a sample, 8 bit samples are offset by 128.
+	static forceinline int toSigned(uint32_t sample) {
+		return kSampleBytes == 1 ? static_cast<int>(sample) - 128 : signExtend(sample);
+	}
+	static forceinline uint32_t fromSigned(int value) {
+		return static_cast<uint32_t>(kSampleBytes == 1 ? value + 128 : value) & kSampleMask;
+	}
+
+	// The LMS stages run on 16 bit values.
+	static forceinline int toLMS(int value) {
+		return kSampleBits > 16 ? value >> (kSampleBits - 16) : value << (16 - kSampleBits);
+	}
+	static forceinline int fromLMS(int value) {
+		return kSampleBits > 16 ? value << (kSampleBits - 16) :
+			(value + ((1 << (16 - kSampleBits)) >> 1)) >> (16 - kSampleBits);
+	}
+
+	// Prediction of the next sample of a channel, the sum of the stages of the cascade. Each stage predicts what
+	// is left after the stages before it.
+	forceinline uint32_t predict(size_t ch) {
+		Stages& st = stages_[ch];
+		st.fixed_ = last_[ch];
+		int64_t sum = 0;
+		for (size_t i = 0; i < kCrossTaps; ++i) {
+			sum += static_cast<int64_t>(st.cross_weights_[i]) * crossInput(ch, i);
+		}
+		st.cross_ = static_cast<int>(sum >> kCrossShift);
+		st.long_ = fromLMS(st.long_lms_.predict());
+		st.short_ = fromLMS(st.short_lms_.predict());
+		return pred_[ch] = fromSigned(st.fixed_ + st.cross_ + st.long_ + st.short_);
+	}
+
+	forceinline void update(size_t ch, uint32_t sample, uint32_t residual) {
+		Stages& st = stages_[ch];
+		const int value = toSigned(sample);
+		// Inputs of each stage.
+		const int filtered = value - st.fixed_;
+		const int cross_res = filtered - st.cross_;
+		const int long_res = cross_res - st.long_;
+		const int err = long_res - st.short_;
+		for (size_t i = 0; i < kCrossTaps; ++i) {
+			const int input = crossInput(ch, i);
+			if (cross_res > 0) {
+				st.cross_weights_[i] += input > 0 ? kCrossStep : (input < 0 ? -kCrossStep : 0);
+			} else if (cross_res < 0) {
+				st.cross_weights_[i] -= input > 0 ? kCrossStep : (input < 0 ? -kCrossStep : 0);
+			}
+		}
+		st.long_lms_.update(toLMS(cross_res), long_res);
+		st.short_lms_.update(toLMS(long_res), err);
+		st.filtered2_ = st.filtered_;
+		st.filtered_ = filtered;
+		const uint32_t magnitude = static_cast<uint32_t>(std::abs(signExtend(residual)));
+		residual_average_[ch] += magnitude - (residual_average_[ch] >> kAverageShift);
+		last2_[ch] = fromSigned(last_[ch]);
+		last_[ch] = value;
+	}
+
+	// Last two filtered values of the channel and of the other channel, for the second channel the one of the
+	// same frame is already known.
+	forceinline int crossInput(size_t ch, size_t i) const {
+		const Stages& own = stages_[ch];
+		if (kChannels == 1 || i < 2) {
+			return i % 2 == 0 ? own.filtered_ : own.filtered2_;
+		}
+		const Stages& other = stages_[ch ^ 1];
+		return i == 2 ? other.filtered_ : other.filtered2_;
 	}
 
 	virtual void compress(Stream* in_stream, Stream* out_stream, uint64_t max_count) {
@@ -133,32 +328,28 @@ public:
 		assert(out_stream != nullptr);
 		init();
 		ent.init();
-		uint16_t last_a = 0, last_b = 0;
-		uint16_t last_a2 = 0, last_b2 = 0;
-		uint16_t last_a3 = 0, last_b3 = 0;
-		uint64_t i = 0;
-		for (; i < max_count; i += 4) {
-			int c1 = sin.get(), c2 = sin.get();
-			uint16_t a = c1 + c2 * 256;
-			int c3 = sin.get(), c4 = sin.get();
-			uint16_t b = c3 + c4 * 256;
-			uint16_t pred_a = 2 * last_a - last_a2;
-			uint16_t pred_b = 2 * last_b - last_b2;
-			uint16_t pred_a2 = 3 * last_a - 3 * last_a2 - last_a3;
-			uint16_t pred_b2 = 3 * last_b - 3 * last_b2 - last_b3;
-			uint16_t delta_a = a - pred_a;
-			uint16_t delta_b = b - pred_b;
-			if (c1 == EOF) {
+		for (uint64_t i = 0; i < max_count; i += kFrameBytes) {
+			int c = sin.get();
+			if (c == EOF) {
 				break;
 			}
-			processSample<false>(sout, 0, 0, delta_a);
-			processSample<false>(sout, 0, 1, delta_b);
-			last_a3 = last_a2;
-			last_b3 = last_b2;
-			last_a2 = last_a;
-			last_b2 = last_b;
-			last_a = a;
-			last_b = b;
+			for (size_t ch = 0; ch < kChannels; ++ch) {
+				// Missing bytes of the last frame are zero, the decoder only writes max_count bytes.
+				uint32_t sample = 0;
+				for (size_t j = 0; j < kSampleBytes; ++j) {
+					if (ch != 0 || j != 0) {
+						c = sin.get();
+					}
+					sample |= static_cast<uint32_t>(c == EOF ? 0 : c) << (8 * j);
+				}
+				const uint32_t residual = (sample - predict(ch)) & kSampleMask;
+				if (kMixContexts) {
+					processMixed<false>(sout, residualContext(ch), ch, residual);
+				} else {
+					processSample<false>(sout, residualContext(ch), ch, residual);
+				}
+				update(ch, sample, residual);
+			}
 		}
 		ent.flush(sout);
 		sout.flush();
@@ -167,27 +358,19 @@ public:
 	virtual void decompress(Stream* in_stream, Stream* out_stream, uint64_t max_count) {
 		BufferedStreamReader<4 * KB> sin(in_stream);
 		BufferedStreamWriter<4 * KB> sout(out_stream);
-		auto start = in_stream->tell();
 		init();
 		ent.initDecoder(sin);
-		uint16_t last_a = 0, last_b = 0;
-		uint16_t last_a2 = 0, last_b2 = 0;
-		uint16_t last_a3 = 0, last_b3 = 0;
 		while (max_count > 0) {
-			uint16_t pred_a = 2 * last_a - last_a2;
-			uint16_t pred_b = 2 * last_b - last_b2;
-			uint16_t a = pred_a + processSample<true>(sin, 0, 0);
-			uint16_t b = pred_b + processSample<true>(sin, 0, 1);
-			if (max_count > 0) { --max_count; sout.put(a & 0xFF); }
-			if (max_count > 0) { --max_count; sout.put(a >> 8); }
-			if (max_count > 0) { --max_count; sout.put(b & 0xFF); }
-			if (max_count > 0) { --max_count; sout.put(b >> 8); }
-			last_a3 = last_a2;
-			last_b3 = last_b2;
-			last_a2 = last_a;
-			last_b2 = last_b;
-			last_a = a;
-			last_b = b;
+			for (size_t ch = 0; ch < kChannels; ++ch) {
+				const uint32_t pred = predict(ch);
+				const uint32_t residual = kMixContexts ? processMixed<true>(sin, residualContext(ch), ch) :
+					processSample<true>(sin, residualContext(ch), ch);
+				const uint32_t sample = (pred + residual) & kSampleMask;
+				for (size_t j = 0; j < kSampleBytes; ++j) {
+					if (max_count > 0) { --max_count; sout.put(static_cast<uint8_t>(sample >> (8 * j))); }
+				}
+				update(ch, sample, residual);
+			}
 		}
 		sout.flush();
 		size_t remain = sin.remain();
@@ -199,5 +382,4 @@ public:
 	}	
 };
 
-
 #endif
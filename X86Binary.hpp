@@ -24,6 +24,7 @@
 #ifndef _X86_BINARY_HPP_
 #define _X86_BINARY_HPP_
 
+#include <emmintrin.h>
 #include <memory>
 
 #include "Filter.hpp"
@@ -32,20 +33,31 @@
 // E8/E9 FF/00 XX XX XX
 // E8/E8 B2 <char> -> E8/E9 <char>
 // E8/E9 <other> -> E8/E9 <other>
+// With rip_relative, x86-64 MOV / LEA with a RIP relative operand:
+// 8B/89/8D <modrm> FF/00 XX XX XX 99
+// 8B/89/8D <modrm> B2 <char> -> 8B/89/8D <modrm> <char>
 class X86AdvancedFilter : public ByteStreamFilter<16 * KB, 20 * KB> {
 	static const uint8_t kXORByte = 162;
 	static const uint8_t kMarkerByte = 99;
 public:
-	X86AdvancedFilter(Stream* stream)
+	X86AdvancedFilter(Stream* stream, bool rip_relative = false)
 		: ByteStreamFilter(stream), offset_(17), last_offset_(17)
-		, opt_var_(0), transform_count_(0), false_positives_(0) {
+		, opt_var_(0), transform_count_(0), false_positives_(0), rip_relative_(rip_relative), last_byte_(0) {
 
 	}
 	virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
-		process<true>(out, out_count, in, in_count);
+		if (rip_relative_) {
+			process<true, true>(out, out_count, in, in_count);
+		} else {
+			process<true, false>(out, out_count, in, in_count);
+		}
 	}
 	virtual void reverseFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
-		process<false>(out, out_count, in, in_count);
+		if (rip_relative_) {
+			process<false, true>(out, out_count, in, in_count);
+		} else {
+			process<false, false>(out, out_count, in, in_count);
+		}
 	}
 	static uint32_t getMaxExpansion() {
 		return 1;
@@ -58,7 +70,65 @@ public:
 	}
 	
 private:
-	template <bool encode>
+	static forceinline bool isRipOpcode(uint8_t c) {
+		return c == 0x8B || c == 0x89 || c == 0x8D;
+	}
+
+	// E8 / E9 or a 0F 8X Jcc. Before start the x86 filter has no byte, the x86-64 one has prev from the last call.
+	template <bool kRip>
+	static forceinline bool isCandidate(const uint8_t* start, const uint8_t* ptr, uint8_t prev) {
+		const bool after_0f = ptr > start ? ptr[-1] == 0x0F : kRip && prev == 0x0F;
+		return (*ptr & 0xFE) == 0xE8 || ((*ptr & 0xF0) == 0x80 && after_0f) || (kRip && isRipOpcode(*ptr));
+	}
+
+	// First candidate in [ptr, limit), or limit if there is none. Checks 32 bytes at a time.
+	template <bool kRip>
+	static const uint8_t* findCandidate(const uint8_t* start, const uint8_t* ptr, const uint8_t* limit, uint8_t prev) {
+		if (ptr < limit && ptr == start) {
+			if (isCandidate<kRip>(start, ptr, prev)) {
+				return ptr;
+			}
+			++ptr;
+		}
+		const __m128i mask_fe = _mm_set1_epi8(static_cast<char>(0xFE));
+		const __m128i mask_f0 = _mm_set1_epi8(static_cast<char>(0xF0));
+		const __m128i e8 = _mm_set1_epi8(static_cast<char>(0xE8));
+		const __m128i jcc = _mm_set1_epi8(static_cast<char>(0x80));
+		const __m128i prefix = _mm_set1_epi8(0x0F);
+		const __m128i mov_load = _mm_set1_epi8(static_cast<char>(0x8B));
+		const __m128i mov_store = _mm_set1_epi8(static_cast<char>(0x89));
+		const __m128i lea = _mm_set1_epi8(static_cast<char>(0x8D));
+		for (; ptr + 32 <= limit; ptr += 32) {
+			// ptr > start so the bytes before are readable.
+			const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+			const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 16));
+			const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr - 1));
+			const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 15));
+			__m128i c0 = _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(v0, mask_fe), e8),
+				_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v0, mask_f0), jcc), _mm_cmpeq_epi8(p0, prefix)));
+			__m128i c1 = _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(v1, mask_fe), e8),
+				_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v1, mask_f0), jcc), _mm_cmpeq_epi8(p1, prefix)));
+			if (kRip) {
+				c0 = _mm_or_si128(c0, _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v0, mov_load), _mm_cmpeq_epi8(v0, mov_store)),
+					_mm_cmpeq_epi8(v0, lea)));
+				c1 = _mm_or_si128(c1, _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v1, mov_load), _mm_cmpeq_epi8(v1, mov_store)),
+					_mm_cmpeq_epi8(v1, lea)));
+			}
+			const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(c0)) |
+				(static_cast<uint32_t>(_mm_movemask_epi8(c1)) << 16);
+			if (mask != 0) {
+				return ptr + ctz(mask);
+			}
+		}
+		for (; ptr < limit; ++ptr) {
+			if (isCandidate<kRip>(start, ptr, prev)) {
+				return ptr;
+			}
+		}
+		return limit;
+	}
+
+	template <bool encode, bool kRip>
 	void process(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
 		const size_t in_c = *in_count;
 		const size_t out_c = *out_count;
@@ -70,79 +140,141 @@ private:
 			in += in_c;
 			out += in_c;
 		} else {
-			for ( ;in < in_limit - 6 && out < out_limit - 6; ++in) {
+			while (in < in_limit - 6 && out < out_limit - 6) {
+				// Bulk copy the bytes before the next candidate.
+				const size_t max_count = std::min(in_limit - 6 - in, out_limit - 6 - out);
+				const uint8_t* cand = findCandidate<kRip>(start_in, in, in + max_count, last_byte_);
+				const size_t count = cand - in;
+				std::copy(in, in + count, out);
+				in += count;
+				out += count;
+				if (count == max_count) {
+					break;
+				}
 				*out++ = *in;
-				if ((*in & 0xFE) == 0xE8 || ((*in & 0xF0) == 0x80 && in > start_in && in[-1] == 0x0F)) {
-					const size_t cur_offset = offset_ + (encode ? (in - start_in) : (out - 1 - start_out));
-					if (false && (in[4] == 0 || in[4] == 0xFF) && cur_offset - last_offset_ > 4 * KB) {
-						last_offset_ = cur_offset;
-						*out++ = in[1];
-						*out++ = in[2];
-						*out++ = in[3];
-						*out++ = in[4];
-						in += 4;
-						continue;
-					}
-					if (encode) {
-						uint8_t sign_byte = in[4];
-						if (sign_byte == 0xFF || sign_byte == 0x00) {
-							int32_t delta = 
-									static_cast<uint32_t>(in[1]) +
-									(static_cast<uint32_t>(in[2]) << 8) +
-									(static_cast<uint32_t>(in[3]) << 16) +
-									(static_cast<uint32_t>(sign_byte) << 24);
-							// Don't change 0 deltas.
-							if (delta > 0 || (delta < 0 && -delta < static_cast<int32_t>(cur_offset))) {
-								if (cur_offset - last_offset_ > 3  * KB * 32) {
-									offset_ = 0;
-								}
-								uint32_t addr = delta + static_cast<uint32_t>(cur_offset);
-								*out++ = sign_byte;
-								*out++ = (addr >> 16) ^ kXORByte;
-								*out++ = (addr >> 8) ^ kXORByte;
-								*out++ = (addr >> 0) ^ kXORByte;
-								*out++ = kMarkerByte;  // Marker byte for CM models (signals end of jump).
-								in += 4;
-								++transform_count_;
-								last_offset_ = cur_offset;
-								continue;
-							}
-						}
-						// Forbidden chars / non match.
-						if (in[1] == 0xFF || in[1] == 0x00 || in[1] == 0xB2) {
-							++false_positives_;
-							*out++ = 0xB2;
-							*out++ = in[1];
-							in++;
-						}
-					} else {
-						auto sign_byte = in[1];
-						if (sign_byte == 0xFF || sign_byte == 0x00) {
-							if (cur_offset - last_offset_ > 3 * KB * 32) {
-								offset_ = 0;
-							}
-							uint32_t delta = 
-								static_cast<uint32_t>(in[4] ^ kXORByte) +
-								(static_cast<uint32_t>(in[3] ^ kXORByte) << 8) +
-								(static_cast<uint32_t>(in[2] ^ kXORByte) << 16);
-							uint32_t addr = delta - static_cast<uint32_t>(cur_offset);
-							*out++ = (addr >> 0);
-							*out++ = (addr >> 8);
-							*out++ = (addr >> 16);
-							*out++ = sign_byte;
-							last_offset_ = cur_offset;
-							in += 5;
-						} else if (in[1] == 0xB2) {
-							*out++ = in[2];
-							in += 2;
-						}
-					}
+				const size_t cur_offset = offset_ + (encode ? (in - start_in) : (out - 1 - start_out));
+				if (kRip && isRipOpcode(*in) && (in > start_in ? in[-1] : last_byte_) != 0x0F) {
+					transformRip<encode>(in, out, cur_offset);
+				} else {
+					transform<encode>(in, out, cur_offset);
 				}
+				++in;
 			}
 		}
 		*out_count = out - start_out;
 		*in_count = in - start_in;
 		offset_ += encode ? *in_count : *out_count;
+		if (in > start_in) {
+			// Not part of a transformed field if it is 0F, so the same in both directions.
+			last_byte_ = in[-1];
+		}
+	}
+
+	// The opcode at in was already copied, advances in to the last byte consumed. Like E8 / E9 the sign byte is
+	// moved in front of the address so the reverse filter only looks at bytes that are never changed.
+	template <bool encode>
+	forceinline void transformRip(uint8_t*& in, uint8_t*& out, size_t cur_offset) {
+		if ((in[1] & 0xC7) != 0x05) {
+			return;
+		}
+		if (encode) {
+			const uint8_t sign_byte = in[5];
+			if (sign_byte == 0xFF || sign_byte == 0x00) {
+				const uint32_t addr = (static_cast<uint32_t>(in[2]) | (static_cast<uint32_t>(in[3]) << 8) |
+					(static_cast<uint32_t>(in[4]) << 16)) + static_cast<uint32_t>(cur_offset);
+				*out++ = in[1];
+				*out++ = sign_byte;
+				*out++ = (addr >> 16) ^ kXORByte;
+				*out++ = (addr >> 8) ^ kXORByte;
+				*out++ = (addr >> 0) ^ kXORByte;
+				*out++ = kMarkerByte;
+				in += 5;
+				++transform_count_;
+				return;
+			}
+			if (in[2] == 0xFF || in[2] == 0x00 || in[2] == 0xB2) {
+				++false_positives_;
+				*out++ = in[1];
+				*out++ = 0xB2;
+				*out++ = in[2];
+				in += 2;
+			}
+		} else {
+			const uint8_t sign_byte = in[2];
+			if (sign_byte == 0xFF || sign_byte == 0x00) {
+				const uint32_t addr = (static_cast<uint32_t>(in[5] ^ kXORByte) | (static_cast<uint32_t>(in[4] ^ kXORByte) << 8) |
+					(static_cast<uint32_t>(in[3] ^ kXORByte) << 16)) - static_cast<uint32_t>(cur_offset);
+				*out++ = in[1];
+				*out++ = (addr >> 0);
+				*out++ = (addr >> 8);
+				*out++ = (addr >> 16);
+				*out++ = sign_byte;
+				in += 6;
+			} else if (sign_byte == 0xB2) {
+				*out++ = in[1];
+				*out++ = in[3];
+				in += 3;
+			}
+		}
+	}
+
+	// The candidate byte at in was already copied, advances in to the last byte consumed.
+	template <bool encode>
+	forceinline void transform(uint8_t*& in, uint8_t*& out, size_t cur_offset) {
+		if (encode) {
+			uint8_t sign_byte = in[4];
+			if (sign_byte == 0xFF || sign_byte == 0x00) {
+				int32_t delta = 
+						static_cast<uint32_t>(in[1]) +
+						(static_cast<uint32_t>(in[2]) << 8) +
+						(static_cast<uint32_t>(in[3]) << 16) +
+						(static_cast<uint32_t>(sign_byte) << 24);
+				// Don't change 0 deltas.
+				if (delta > 0 || (delta < 0 && -delta < static_cast<int32_t>(cur_offset))) {
+					if (cur_offset - last_offset_ > 3  * KB * 32) {
+						offset_ = 0;
+					}
+					uint32_t addr = delta + static_cast<uint32_t>(cur_offset);
+					*out++ = sign_byte;
+					*out++ = (addr >> 16) ^ kXORByte;
+					*out++ = (addr >> 8) ^ kXORByte;
+					*out++ = (addr >> 0) ^ kXORByte;
+					*out++ = kMarkerByte;  // Marker byte for CM models (signals end of jump).
+					in += 4;
+					++transform_count_;
+					last_offset_ = cur_offset;
+					return;
+				}
+			}
+			// Forbidden chars / non match.
+			if (in[1] == 0xFF || in[1] == 0x00 || in[1] == 0xB2) {
+				++false_positives_;
+				*out++ = 0xB2;
+				*out++ = in[1];
+				in++;
+			}
+		} else {
+			auto sign_byte = in[1];
+			if (sign_byte == 0xFF || sign_byte == 0x00) {
+				if (cur_offset - last_offset_ > 3 * KB * 32) {
+					offset_ = 0;
+				}
+				uint32_t delta = 
+					static_cast<uint32_t>(in[4] ^ kXORByte) +
+					(static_cast<uint32_t>(in[3] ^ kXORByte) << 8) +
+					(static_cast<uint32_t>(in[2] ^ kXORByte) << 16);
+				uint32_t addr = delta - static_cast<uint32_t>(cur_offset);
+				*out++ = (addr >> 0);
+				*out++ = (addr >> 8);
+				*out++ = (addr >> 16);
+				*out++ = sign_byte;
+				last_offset_ = cur_offset;
+				in += 5;
+			} else if (in[1] == 0xB2) {
+				*out++ = in[2];
+				in += 2;
+			}
+		}
 	}
 
 	size_t offset_;
@@ -151,6 +283,15 @@ private:
 
 	size_t transform_count_;
 	size_t false_positives_;
+	bool rip_relative_;
+	uint8_t last_byte_;
+};
+
+// x86-64, also transforms RIP relative MOV / LEA.
+class X64Filter : public X86AdvancedFilter {
+public:
+	X64Filter(Stream* stream) : X86AdvancedFilter(stream, true) {
+	}
 };
 
 // Simple E8E9 filter.